@@ -0,0 +1,36 @@
+/*
+
+CascadeEmbed.cpp
+Description:   Build step that turns a Haar cascade XML file into the compiled in
+               tables HaarCascadeEmbed.h describes.  The ClusterTest project runs it
+               before compiling so the detector never has to read the XML
+
+Author:        Chris Leighton
+
+*/
+
+#include <iostream>
+#include <string>
+#include "HaarCascadeEmbed.h"
+
+
+int main( int argc, char** argv )
+{
+    if ( argc != 4 )
+    {
+        std::cout << "CascadeEmbed [cascade xml] [source file to write] [variable name]" << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        WriteCascadeSource(argv[1], argv[2], argv[3]);
+    }
+    catch ( std::string err )
+    {
+        std::cout << "Error: " << err << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
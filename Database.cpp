@@ -1,5 +1,10 @@
 #include "Database.h"
 #include "PreProcess.h"
+#include "MappedFile.h"
+#include "DistanceKernel.h"
+#include <map>
+#include <stdio.h>
+#include <string.h>
 
 
 IplImage**  imageArray;
@@ -8,15 +13,178 @@ IplImage*   averageImage;     // Average image of all training images
 CvMat*      personIDMatrix;   // matrix to store person ids
 CvMat*      eigenValueMatrix; // matrix to store Eigen values
 CvMat*      projectedFaceMatrix; // matrix to store projected faces
+CvMat*      whitenedFaceMatrix;  // projected faces with each column scaled by 1/sqrt(eigen value)
+CvMat*      personCentroidMatrix;   // mean projected face of each person
+CvMat*      personCentroidIDMatrix; // person id of each row of personCentroidMatrix
+CvMat*      eigenBasisMatrix;       // eigen vectors as rows, nEigenVals x pixels
 
-Database::Database() : m_Storage(NULL), m_nImages(0), m_nPeople(0), m_nEigenVals(0), m_EuclideanThreshold(0.0), m_MahalanobisThreshold(0.0)
+
+// every row of the eigen basis starts on a cache line
+static const int BASIS_ALIGN = 64;
+
+// faces projected by each GEMM call, a block of centered faces stays in cache
+// while the basis streams past it
+static const int PROJECT_BLOCK = 32;
+
+// HNSW graphs are kept next to the database, e.g. faces.xml.mahalanobis.hnsw
+static const char* HNSW_SUFFIXES[NUM_METRICS] = { "euclidean.hnsw", "mahalanobis.hnsw" };
+
+
+////////////////////////////////////////////
+//        binary database format          //
+////////////////////////////////////////////
+
+// A header, then a table of sections, then the sections themselves, each one
+// starting on a cache line.  Arrays are stored row by row with the step given in
+// the table so they can be used where they are in the mapped file.  The eigen
+// basis keeps the BASIS_ALIGN padding it has in memory.  Numbers are written in
+// the machine's own byte order.  Version 2 added the precision, which was a
+// reserved 0 (Float32Storage) in version 1.  Version 3 added the quantizer
+// sections and the flags, which were reserved 0s before
+static const char BINARY_DB_MAGIC[8] = { 'E', 'I', 'G', 'E', 'N', 'D', 'B', '\0' };
+static const int  BINARY_DB_VERSION = 3;
+static const int  SECTION_ALIGN = 64;
+
+// the Mahalanobis codes were made from the whitened gallery
+static const int  BINARY_FLAG_WHITENED_CODES = 1;
+
+enum BinarySectionID
+{
+    SECTION_PERSON_IDS = 1,     // 1 x nImages CV_32SC1
+    SECTION_EIGEN_VALUES,       // 1 x nEigenVals CV_32FC1
+    SECTION_PROJECTED_FACES,    // nImages x nEigenVals CV_32FC1, CV_16UC1 for 16 bit precision
+    SECTION_AVERAGE_IMAGE,      // height x width, as the projected faces
+    SECTION_EIGEN_BASIS,        // nEigenVals x pixels, as the projected faces
+    SECTION_CENTROIDS,          // nCentroids x nEigenVals CV_32FC1
+    SECTION_CENTROID_IDS,       // 1 x nCentroids CV_32SC1
+    SECTION_STRINGS,            // rows strings: offsets then the characters, see WriteBinary
+
+    // one of each quantizer section per metric, the id plus the DistanceMetric
+    SECTION_PQ_CODEBOOKS,                                   // nCentroids x nEigenVals CV_32FC1
+    SECTION_PQ_CODES = SECTION_PQ_CODEBOOKS + NUM_METRICS,  // nImages x nSubspaces CV_8UC1
+    SECTION_SQ8_SCALES = SECTION_PQ_CODES + NUM_METRICS,    // 1 x nEigenVals CV_32FC1
+    SECTION_SQ8_CODES = SECTION_SQ8_SCALES + NUM_METRICS,   // nImages x nEigenVals CV_8SC1
+    SECTION_END = SECTION_SQ8_CODES + NUM_METRICS
+};
+
+struct BinaryHeader
+{
+    char        m_Magic[8];
+    int         m_Version;
+    int         m_nSections;
+    int         m_nImages;
+    int         m_nPeople;
+    int         m_nEigenVals;
+    int         m_Width;            // of the average image and eigen vectors
+    int         m_Height;
+    int         m_SkipDetection;
+    double      m_EuclideanThreshold;
+    double      m_MahalanobisThreshold;
+    int         m_Precision;        // StoragePrecision of the projected faces, average image and basis
+    int         m_Flags;            // BINARY_FLAG_ bits
+};
+
+struct BinarySection
+{
+    int         m_ID;
+    int         m_Type;             // OpenCV matrix type, 0 for the strings
+    int         m_Rows;
+    int         m_Cols;             // for the strings, bytes of characters
+    long long   m_Step;             // bytes from one row to the next
+    long long   m_Offset;           // from the start of the file
+};
+
+
+// what WriteBinary copies into a section, rows of m_RowBytes every m_SrcStep bytes.
+// Rows of m_nValues are converted on the way if the two precisions differ
+struct BinarySource
+{
+    const uchar*        m_Data;
+    int                 m_SrcStep;
+    int                 m_RowBytes;
+    int                 m_nValues;
+    StoragePrecision    m_From;
+    StoragePrecision    m_To;
+};
+
+
+/*
+   Function:   ConvertRow
+   Purpose:    n values from one precision to another, through float
+*/
+static void ConvertRow( const uchar* src, StoragePrecision from, uchar* dst, StoragePrecision to, int n )
+{
+    for ( int i = 0; i < n; i++ )
+    {
+        float f;
+        if ( from == Float16Storage )
+            f = HalfToFloat(((const unsigned short*)src)[i]);
+        else if ( from == BFloat16Storage )
+            f = BFloat16ToFloat(((const unsigned short*)src)[i]);
+        else
+            f = ((const float*)src)[i];
+
+        if ( to == Float16Storage )
+            ((unsigned short*)dst)[i] = FloatToHalf(f);
+        else if ( to == BFloat16Storage )
+            ((unsigned short*)dst)[i] = FloatToBFloat16(f);
+        else
+            ((float*)dst)[i] = f;
+    }
+}
+
+
+// kernel for a basis stored in precision
+static DotHalfFunc HalfDot( StoragePrecision precision )
+{
+    return precision == Float16Storage ? GetDistanceKernel().DotF16 : GetDistanceKernel().DotBF16;
+}
+
+
+static long long AlignOffset( long long offset )
+{
+    return (offset + SECTION_ALIGN - 1) / SECTION_ALIGN * SECTION_ALIGN;
+}
+
+
+// a binary database is found by what it starts with, whatever it is called
+static bool IsBinaryDatabase( const std::string& databaseName )
+{
+    FILE* in = fopen(databaseName.c_str(), "rb");
+    if ( !in )
+        return false;
+
+    char magic[sizeof(BINARY_DB_MAGIC)];
+    bool bBinary = fread(magic, sizeof(magic), 1, in) == 1 && memcmp(magic, BINARY_DB_MAGIC, sizeof(magic)) == 0;
+    fclose(in);
+
+    return bBinary;
+}
+
+Database::Database() : m_Storage(NULL), m_nImages(0), m_nPeople(0), m_nEigenVals(0), m_EuclideanThreshold(0.0), m_MahalanobisThreshold(0.0), m_bSkipDetection(false),
+                       m_bLazyImages(true), m_bImagesPending(false), m_bOwnImages(false), m_bUseWhitened(false), m_SearchMode(ExactSearch), m_SearchEf(64),
+                       m_PQSubspaceDims(8), m_PQRerank(32), m_SQ8Rerank(16), m_ShortlistSize(5), m_ProgressiveChunk(16), m_ProgressiveTolerance(0.0), m_bWhitenedGallery(false), m_bFloatGalleryReleased(false),
+                       m_pEigenBasisBuffer(NULL), m_nBasisHeaders(0), m_pMappedFile(NULL), m_bMappedAverage(false),
+                       m_StoragePrecision(Float32Storage), m_BasisPrecision(Float32Storage), m_pHalfBasis(NULL)
 {
+    for ( int i = 0; i < NUM_METRICS; i++ )
+    {
+        m_pHNSWIndex[i] = NULL;
+        m_pVPTree[i] = NULL;
+        m_pQuantizer[i] = NULL;
+        m_pScalarQuantizer[i] = NULL;
+    }
+
     imageArray = NULL;
     eigenVectorArray = NULL;
     averageImage = NULL;
     personIDMatrix = NULL;
     eigenValueMatrix = NULL;
     projectedFaceMatrix = NULL;
+    whitenedFaceMatrix = NULL;
+    personCentroidMatrix = NULL;
+    personCentroidIDMatrix = NULL;
+    eigenBasisMatrix = NULL;
 }
 
 
@@ -26,12 +194,66 @@ Database::~Database()
     if ( m_Storage )
         cvReleaseFileStorage(&m_Storage);
 
+    ClearImages();
     ClearExternalData();
 }
 
 
+
+/*
+   Function:   ClearImages
+   Purpose:    forget the names and training images, releasing the faces we loaded
+   Notes:      faces that are still pending are dropped with the rest
+*/
+void Database::ClearImages()
+{
+    if ( m_bOwnImages )
+    {
+        for ( size_t i = 0; i < m_ImageVec.size(); i++ )
+        {
+            if ( m_ImageVec[i].m_Image )
+                cvReleaseImage(&m_ImageVec[i].m_Image);
+        }
+        m_bOwnImages = false;
+    }
+    m_Names.clear();
+    m_ImageVec.clear();
+    m_bImagesPending = false;
+}
+
+
+void Database::ClearIndexes()
+{
+    for ( int i = 0; i < NUM_METRICS; i++ )
+    {
+        if ( m_pHNSWIndex[i] )
+            delete m_pHNSWIndex[i];
+        m_pHNSWIndex[i] = NULL;
+
+        if ( m_pVPTree[i] )
+            delete m_pVPTree[i];
+        m_pVPTree[i] = NULL;
+
+        if ( m_pQuantizer[i] )
+            delete m_pQuantizer[i];
+        m_pQuantizer[i] = NULL;
+
+        if ( m_pScalarQuantizer[i] )
+            delete m_pScalarQuantizer[i];
+        m_pScalarQuantizer[i] = NULL;
+
+        m_SuffixEnergy[i].clear();
+    }
+}
+
+
 void Database::ClearExternalData()
 {
+    ClearIndexes();
+
+    // a mapped average image is only a header over the file
+    if ( averageImage && m_bMappedAverage )
+        cvReleaseImageHeader(&averageImage);
     if (averageImage)
         cvReleaseImage(&averageImage);
     if (personIDMatrix)
@@ -40,6 +262,12 @@ void Database::ClearExternalData()
         cvReleaseMat(&eigenValueMatrix);
     if (projectedFaceMatrix)
         cvReleaseMat(&projectedFaceMatrix);
+    if (whitenedFaceMatrix)
+        cvReleaseMat(&whitenedFaceMatrix);
+    if (personCentroidMatrix)
+        cvReleaseMat(&personCentroidMatrix);
+    if (personCentroidIDMatrix)
+        cvReleaseMat(&personCentroidIDMatrix);
 
     if ( imageArray )
     {
@@ -50,24 +278,123 @@ void Database::ClearExternalData()
         }
     }
 
-    if ( eigenVectorArray )
-    {
-        for ( int i = 0; i < m_nEigenVals; i++ )
-        {
-            if ( eigenVectorArray[i] )
-                cvReleaseImage(&eigenVectorArray[i]);
-        }
-    }
+    ReleaseEigenBasis();
+
+    // every matrix read from a binary database pointed into the file
+    if ( m_pMappedFile )
+        delete m_pMappedFile;
+    m_pMappedFile = NULL;
 
     imageArray = NULL;
-    eigenVectorArray = NULL;
     averageImage = NULL;
     personIDMatrix = NULL;
     eigenValueMatrix = NULL;
     projectedFaceMatrix = NULL;
+    whitenedFaceMatrix = NULL;
+    personCentroidMatrix = NULL;
+    personCentroidIDMatrix = NULL;
+    m_bMappedAverage = false;
+    m_WhiteningWeights.clear();
+    m_WhitenedCentroids.clear();
+    m_CentroidRows.clear();
+    m_InverseEigenValues.clear();
+    m_bWhitenedGallery = false;
+    m_bFloatGalleryReleased = false;
+}
+
+/*
+   Function:   GetImageVec
+   Purpose:    the training images, with their preprocessed faces
+   Notes:      after Read the faces are loaded and preprocessed the first time this
+               is called, so call it from one thread.  Use GetImageName when only the
+               file name is wanted
+   Throws      std::string if an original image can not be loaded
+*/
+Database::ImageVec& Database::GetImageVec()
+{
+    if ( m_bImagesPending )
+        LoadPendingImages();
+
+    return m_ImageVec;
+}
+
+
+
+const std::string& Database::GetImageName( int i )
+{
+    static const std::string none;
+    return i >= 0 && i < (int)m_ImageVec.size() ? m_ImageVec[i].m_ImageName : none;
+}
+
+
+
+/*
+   Function:   LoadPendingImages
+   Purpose:    load and preprocess the original images named in the database
+   Notes:      the images are done in parallel, like the probes in RecognizeBatch.
+               The first image that fails, in database order, is thrown and the
+               faces stay pending
+   Throws      std::string if an original image can not be loaded
+*/
+void Database::LoadPendingImages()
+{
+    PreProcessOptions options = GetPreProcessOptions();
+    options.m_bSkipDetection = options.m_bSkipDetection || m_bSkipDetection;
+
+    int nImages = (int)m_ImageVec.size();
+    std::vector<std::string> errors(nImages);
+
+    #pragma omp parallel for schedule(dynamic) num_threads(GetNumWorkers())
+    for ( int i = 0; i < nImages; i++ )
+    {
+        Image& img = m_ImageVec[i];
+        if ( img.m_Image )
+            continue;
+
+        try
+        {
+            if ( !LoadAndPreProcess(img.m_ImageName.c_str(), &img.m_Image, options) )
+                errors[i] = "Database::Read could not find original image";
+        }
+        catch ( std::string err )
+        {
+            errors[i] = err;
+        }
+        catch ( ... )
+        {
+            errors[i] = "Database::Read - unknown error";
+        }
+    }
 
+    m_bOwnImages = true;
+
+    for ( int i = 0; i < nImages; i++ )
+    {
+        if ( !errors[i].empty() )
+            throw errors[i];
+    }
+
+    m_bImagesPending = false;
+}
+
+
+
+// number of different names, each person has one name
+static int CountPeople( const Database::NameVec& names )
+{
+    std::vector<std::string> unique_names;
+    std::vector<std::string>::iterator it;
+    for ( size_t i = 0; i < names.size(); i++ )
+    {
+        it = find(unique_names.begin(), unique_names.end(), names[i]);
+        if ( it == unique_names.end() )
+            unique_names.push_back(names[i]);
+    }
+
+    return (int)unique_names.size();
 }
 
+
 bool Database::Write( const std::string& databaseName )
 {
     bool bRet = true;
@@ -75,6 +402,51 @@ bool Database::Write( const std::string& databaseName )
     if ( !ValidateData() )
         throw std::string("Can note write database - database not valid");
 
+    if ( m_bFloatGalleryReleased )
+        throw std::string("Database::Write - the float gallery has been released");
+
+    m_DatabaseName = databaseName;
+
+    // the graph and codes are only worth saving if we are going to search with them.
+    // The codes go in the database itself so they are made before it is written.
+    // Whatever is already in memory is still good, BuildSearchData throws it away
+    // when the gallery changes
+    if ( m_SearchMode == PQSearch || m_SearchMode == SQ8Search )
+        PrepareSearch();
+
+    if ( IsBinaryDatabaseName(databaseName) )
+    {
+        WriteBinary(databaseName);
+    }
+    else
+    {
+        WriteStorage(databaseName);
+        WriteQuantizers();
+    }
+
+    // a graph built or read under the old name is saved next to the new file,
+    // one that is still missing is built and saved by PrepareSearch
+    if ( m_SearchMode == HNSWSearch )
+    {
+        for ( int i = 0; i < NUM_METRICS; i++ )
+        {
+            if ( m_pHNSWIndex[i] )
+                m_pHNSWIndex[i]->Write(GetIndexFileName(HNSW_SUFFIXES[i]));
+        }
+        PrepareSearch();
+    }
+
+    return bRet;
+}
+
+
+
+/*
+   Function:   WriteStorage
+   Purpose:    write the model as an OpenCV XML or YAML file
+*/
+void Database::WriteStorage( const std::string& databaseName )
+{
     if ( m_Storage )
     {
         cvReleaseFileStorage(&m_Storage);
@@ -87,18 +459,8 @@ bool Database::Write( const std::string& databaseName )
         throw std::string("Database::Write could not open database");
 
     cvWriteInt( m_Storage, "nImages", m_nImages );
-
-
-    std::vector<std::string> unique_names;
-    std::vector<std::string>::iterator it;
-    for ( size_t i = 0; i < m_Names.size(); i++ )
-    {
-        it = find(unique_names.begin(), unique_names.end(), m_Names[i]);
-        if ( it == unique_names.end() )
-            unique_names.push_back(m_Names[i]);
-    }
-
-    cvWriteInt( m_Storage, "nPeople", unique_names.size() );
+    cvWriteInt( m_Storage, "SkipDetection", m_bSkipDetection ? 1 : 0 );
+    cvWriteInt( m_Storage, "nPeople", CountPeople(m_Names) );
 
     for ( size_t i = 0; i < m_Names.size(); i++ )
     {
@@ -118,21 +480,31 @@ bool Database::Write( const std::string& databaseName )
     cvWrite( m_Storage, "PersonIDMatrix", personIDMatrix, cvAttrList(0,0) );
     cvWrite( m_Storage, "EigenValueMatrix", eigenValueMatrix, cvAttrList(0,0) );
     cvWrite( m_Storage, "ProjectedFaceMatrix", projectedFaceMatrix, cvAttrList(0,0) );
+    if ( personCentroidMatrix && personCentroidIDMatrix )
+    {
+        cvWrite( m_Storage, "PersonCentroidMatrix", personCentroidMatrix, cvAttrList(0,0) );
+        cvWrite( m_Storage, "PersonCentroidIDMatrix", personCentroidIDMatrix, cvAttrList(0,0) );
+    }
     cvWrite( m_Storage, "AverageImage", averageImage, cvAttrList(0,0) );
 
-    // store each eigen vector that we saved off
-    for ( int i = 0; i < m_nImages-1; i++ )
+    // every eigen vector we kept, one per row.  A 16 bit basis goes back to float
+    CvMat* basis = eigenBasisMatrix;
+    if ( !basis && m_pHalfBasis )
     {
-        char var[256];
-        sprintf(var ,"EigenVector_%d",i);
-        cvWrite( m_Storage, var, eigenVectorArray[i], cvAttrList(0,0) );
+        basis = cvCreateMat(m_pHalfBasis->rows, m_pHalfBasis->cols, CV_32FC1);
+        for ( int i = 0; i < basis->rows; i++ )
+            ConvertRow((const uchar*)GetHalfBasisRow(i), m_BasisPrecision, basis->data.ptr + i*basis->step, Float32Storage, basis->cols);
     }
+    // only the matrix is written, the EigenVector_N images older databases have
+    // are still read by ReadStorage when there is no matrix
+    cvWrite( m_Storage, "EigenBasisMatrix", basis, cvAttrList(0,0) );
+
+    if ( basis != eigenBasisMatrix )
+        cvReleaseMat(&basis);
 
     // store threshold values
     cvWriteReal( m_Storage, "EuclideanThreshold", m_EuclideanThreshold );
     cvWriteReal( m_Storage, "MahalanobisThreshold", m_MahalanobisThreshold );
-
-    return bRet;
 }
 
 
@@ -140,83 +512,1418 @@ bool Database::Read( const std::string& databaseName )
 {
     bool bRet = true;
 
+    m_DatabaseName = databaseName;
+
+    if ( IsBinaryDatabase(databaseName) )
+        ReadBinary(databaseName);
+    else
+        ReadStorage(databaseName);
+
+    // searching only needs the model, the faces are loaded when they are asked for
+    m_bImagesPending = true;
+    if ( !m_bLazyImages )
+        LoadPendingImages();
+
+    // databases written before the centroids were stored
+    if ( !personCentroidMatrix || !personCentroidIDMatrix ||
+         personCentroidMatrix->cols != m_nEigenVals || personCentroidIDMatrix->cols != personCentroidMatrix->rows )
+        BuildCentroids();
+
+    BuildSearchData();
+    ReadQuantizers();
+
+    // once here rather than on every search
+    PrepareSearch();
+
+    return bRet;
+}
+
+
+
+/*
+   Function:   IsBinaryDatabaseName
+   Purpose:    Write uses the binary format for names ending in BINARY_DATABASE_EXT
+*/
+bool Database::IsBinaryDatabaseName( const std::string& databaseName )
+{
+    std::string ext(BINARY_DATABASE_EXT);
+    return databaseName.size() >= ext.size() &&
+           databaseName.compare(databaseName.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+
+
+/*
+   Function:   WriteBinary
+   Purpose:    write the model in the binary format ReadBinary maps
+   Notes:      the strings section holds every person name then every image name.
+               It starts with the offset of each string from the first character,
+               the characters follow with a 0 after each string.  The projected
+               faces, average image and basis are converted to m_StoragePrecision
+               a row at a time as they are written.
+               The rows may point into the file this database has mapped, which
+               can be databaseName itself, so everything goes to databaseName.tmp
+               and is renamed over databaseName once it is complete
+   Throws      std::string if the file can not be written
+*/
+void Database::WriteBinary( const std::string& databaseName )
+{
     if ( m_Storage )
     {
         cvReleaseFileStorage(&m_Storage);
         m_Storage = NULL;
     }
 
-    m_Storage = cvOpenFileStorage(databaseName.c_str(), 0, CV_STORAGE_READ);
+    std::vector<BinarySection> sections;
+    std::vector<BinarySource> sources;
 
-    if ( !m_Storage )
-        throw std::string("Database::Read could not open database");
+    // the strings are built first so their size is known
+    std::vector<int> stringOffsets;
+    std::string characters;
+    for ( size_t i = 0; i < m_Names.size(); i++ )
+    {
+        stringOffsets.push_back((int)characters.size());
+        characters += m_Names[i];
+        characters += '\0';
+    }
+    for ( size_t i = 0; i < m_ImageVec.size(); i++ )
+    {
+        stringOffsets.push_back((int)characters.size());
+        characters += m_ImageVec[i].m_ImageName;
+        characters += '\0';
+    }
+    std::vector<uchar> strings(stringOffsets.size()*sizeof(int) + characters.size());
+    if ( !stringOffsets.empty() )
+        memcpy(&strings[0], &stringOffsets[0], stringOffsets.size()*sizeof(int));
+    if ( !characters.empty() )
+        memcpy(&strings[stringOffsets.size()*sizeof(int)], characters.data(), characters.size());
 
-    m_nImages = cvReadIntByName( m_Storage, 0, "nImages", 0 );
-    m_nPeople = cvReadIntByName( m_Storage, 0, "nPeople", 0 );
+    CvMat averageHeader;
+    CvMat* average = cvGetMat(averageImage, &averageHeader);
 
-    personIDMatrix = (CvMat*)cvReadByName( m_Storage, 0, "PersonIDMatrix", 0 );
+    const CvMat* basis = eigenBasisMatrix ? eigenBasisMatrix : m_pHalfBasis;
+    std::vector<const CvMat*> mats;
+    std::vector<int> ids;
+    const CvMat* model[7] = { personIDMatrix, eigenValueMatrix, projectedFaceMatrix, average, basis,
+                              personCentroidMatrix, personCentroidIDMatrix };
+    const int modelIDs[7] = { SECTION_PERSON_IDS, SECTION_EIGEN_VALUES, SECTION_PROJECTED_FACES, SECTION_AVERAGE_IMAGE,
+                              SECTION_EIGEN_BASIS, SECTION_CENTROIDS, SECTION_CENTROID_IDS };
+    mats.assign(model, model + 7);
+    ids.assign(modelIDs, modelIDs + 7);
 
-    // read person names and original image names
-    for ( int i = 0; i < m_nImages; i++ )
+    // whatever codes we have go in the same file, so loading it never has to train them
+    for ( int i = 0; i < NUM_METRICS; i++ )
     {
-        Image img;
-        std::string tempName;
-        char varname[256];
-        sprintf(varname,"PersonID_%d",i+1);
-        tempName = cvReadStringByName( m_Storage, 0, varname, 0 );
-        m_Names.push_back(tempName);
-        img.m_PersonName = tempName;
+        if ( m_pQuantizer[i] )
+        {
+            mats.push_back(m_pQuantizer[i]->GetCodebooks());
+            ids.push_back(SECTION_PQ_CODEBOOKS + i);
+            mats.push_back(m_pQuantizer[i]->GetCodes());
+            ids.push_back(SECTION_PQ_CODES + i);
+        }
+        if ( m_pScalarQuantizer[i] )
+        {
+            mats.push_back(m_pScalarQuantizer[i]->GetScales());
+            ids.push_back(SECTION_SQ8_SCALES + i);
+            mats.push_back(m_pScalarQuantizer[i]->GetCodes());
+            ids.push_back(SECTION_SQ8_CODES + i);
+        }
+    }
 
-        sprintf(varname, "ImageID_%d", i);
-        tempName = cvReadStringByName( m_Storage, 0, varname, 0 );
+    for ( size_t i = 0; i < mats.size(); i++ )
+    {
+        // no centroids is fine, Read builds them
+        if ( !mats[i] || (ids[i] == SECTION_CENTROIDS && !personCentroidIDMatrix) || (ids[i] == SECTION_CENTROID_IDS && !personCentroidMatrix) )
+            continue;
 
-        IplImage* image = cvLoadImage(tempName.c_str(), CV_LOAD_IMAGE_GRAYSCALE);
-        if (!image)
-            throw std::string("Database::Read could not find original image");
+        BinarySource source;
+        source.m_Data = mats[i]->data.ptr;
+        source.m_SrcStep = mats[i]->step;
+        source.m_nValues = mats[i]->cols;
+        source.m_From = Float32Storage;
+        source.m_To = Float32Storage;
 
-        IplImage* newimage = NULL;
-        PreProcess(image, &newimage);
+        bool bConvert = ids[i] == SECTION_PROJECTED_FACES || ids[i] == SECTION_AVERAGE_IMAGE || ids[i] == SECTION_EIGEN_BASIS;
+        if ( bConvert )
+        {
+            source.m_From = mats[i] == m_pHalfBasis ? m_BasisPrecision : Float32Storage;
+            source.m_To = m_StoragePrecision;
+        }
 
-        img.m_ID = personIDMatrix->data.i[i];
-        img.m_Image = newimage;
-        img.m_ImageName = tempName;
+        BinarySection section;
+        section.m_ID = ids[i];
+        section.m_Type = bConvert ? (source.m_To == Float32Storage ? CV_32FC1 : CV_16UC1) : CV_MAT_TYPE(mats[i]->type);
+        section.m_Rows = mats[i]->rows;
+        section.m_Cols = mats[i]->cols;
+        int rowBytes = mats[i]->cols*CV_ELEM_SIZE(section.m_Type);
+        source.m_RowBytes = rowBytes;
 
+        // the basis rows are padded so they are aligned when mapped
+        section.m_Step = ids[i] == SECTION_EIGEN_BASIS ? (rowBytes + BASIS_ALIGN - 1) / BASIS_ALIGN * BASIS_ALIGN : rowBytes;
 
-        m_ImageVec.push_back(img);
+        sections.push_back(section);
+        sources.push_back(source);
     }
 
+    BinarySection stringSection;
+    stringSection.m_ID = SECTION_STRINGS;
+    stringSection.m_Type = 0;
+    stringSection.m_Rows = (int)stringOffsets.size();
+    stringSection.m_Cols = (int)characters.size();
+    stringSection.m_Step = (long long)strings.size();
+    BinarySource stringSource;
+    stringSource.m_Data = strings.empty() ? NULL : &strings[0];
+    stringSource.m_SrcStep = (int)strings.size();
+    stringSource.m_RowBytes = (int)strings.size();
+    stringSource.m_nValues = 0;
+    stringSource.m_From = Float32Storage;
+    stringSource.m_To = Float32Storage;
+    sections.push_back(stringSection);
+    sources.push_back(stringSource);
 
-    m_nEigenVals = cvReadIntByName( m_Storage, 0, "nEigenVals", 0 );
-    averageImage = (IplImage*)cvReadByName( m_Storage, 0, "AverageImage", 0 );
-    eigenValueMatrix = (CvMat*)cvReadByName( m_Storage, 0, "EigenValueMatrix", 0 );
-    projectedFaceMatrix = (CvMat*)cvReadByName( m_Storage, 0, "ProjectedFaceMatrix", 0 );
+    // the strings section is one row of all its bytes
+    long long offset = AlignOffset(sizeof(BinaryHeader) + sections.size()*sizeof(BinarySection));
+    for ( size_t i = 0; i < sections.size(); i++ )
+    {
+        sections[i].m_Offset = offset;
+        int rows = sections[i].m_ID == SECTION_STRINGS ? 1 : sections[i].m_Rows;
+        offset = AlignOffset(offset + rows*sections[i].m_Step);
+    }
+
+    BinaryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.m_Magic, BINARY_DB_MAGIC, sizeof(header.m_Magic));
+    header.m_Version = BINARY_DB_VERSION;
+    header.m_nSections = (int)sections.size();
+    header.m_nImages = m_nImages;
+    header.m_nPeople = CountPeople(m_Names);
+    header.m_nEigenVals = m_nEigenVals;
+    header.m_Width = averageImage->width;
+    header.m_Height = averageImage->height;
+    header.m_SkipDetection = m_bSkipDetection ? 1 : 0;
+    header.m_EuclideanThreshold = m_EuclideanThreshold;
+    header.m_MahalanobisThreshold = m_MahalanobisThreshold;
+    header.m_Precision = m_StoragePrecision;
+    header.m_Flags = m_bWhitenedGallery ? BINARY_FLAG_WHITENED_CODES : 0;
+
+    std::string tempName = databaseName + ".tmp";
+    FILE* out = fopen(tempName.c_str(), "wb");
+    if ( !out )
+        throw std::string("Database::Write could not open database");
+
+    std::vector<uchar> padding(SECTION_ALIGN + BASIS_ALIGN, 0);
+    std::vector<uchar> converted;
+    long long written = 0;
+
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(&sections[0], sizeof(BinarySection), sections.size(), out);
+    written = sizeof(header) + sections.size()*sizeof(BinarySection);
 
-    eigenVectorArray = (IplImage**)cvAlloc(m_nImages*sizeof(IplImage*));
-    for ( int i = 0; i < m_nEigenVals; i++ )
+    for ( size_t i = 0; i < sections.size(); i++ )
     {
-        char var[256];
-        sprintf(var ,"EigenVector_%d",i);
-        eigenVectorArray[i] = (IplImage*)cvReadByName(m_Storage, 0, var, 0);
+        fwrite(&padding[0], 1, (size_t)(sections[i].m_Offset - written), out);
+        written = sections[i].m_Offset;
+
+        const BinarySource& source = sources[i];
+        int rows = sections[i].m_ID == SECTION_STRINGS ? 1 : sections[i].m_Rows;
+        converted.resize(source.m_RowBytes + 1);
+        for ( int r = 0; r < rows; r++ )
+        {
+            const uchar* row = source.m_Data + (size_t)r*source.m_SrcStep;
+            if ( source.m_From != source.m_To )
+            {
+                ConvertRow(row, source.m_From, &converted[0], source.m_To, source.m_nValues);
+                row = &converted[0];
+            }
+
+            if ( source.m_RowBytes > 0 )
+                fwrite(row, 1, source.m_RowBytes, out);
+            fwrite(&padding[0], 1, (size_t)(sections[i].m_Step - source.m_RowBytes), out);
+        }
+        written += rows*sections[i].m_Step;
     }
 
-    m_EuclideanThreshold = cvReadRealByName( m_Storage, 0, "EuclideanThreshold", 0 );
-    m_MahalanobisThreshold = cvReadRealByName (m_Storage, 0, "MahalanobisThreshold", 0 );
+    bool bOk = ferror(out) == 0;
+    if ( fclose(out) != 0 )
+        bOk = false;
 
-    return bRet;
+    if ( !bOk )
+    {
+        remove(tempName.c_str());
+        throw std::string("Database::Write could not write database");
+    }
+
+    if ( !RenameOver(tempName, databaseName) )
+    {
+        remove(tempName.c_str());
+        throw std::string("Database::Write could not replace database");
+    }
 }
 
 
 
-bool Database::ValidateData()
+/*
+   Function:   ReadBinary
+   Purpose:    map a database written by WriteBinary
+   Notes:      the matrices and the average image are headers over the mapped file,
+               nothing is copied and a page is only read from disk when it is used.
+               Only the names are copied out.  A 16 bit basis stays in the file as
+               m_pHalfBasis, the 16 bit projected faces and average image are small
+               and every search wants floats so they are read into float copies
+   Throws      std::string if the file is not a binary database this version can read,
+               or a section is missing or does not fit in the file
+*/
+void Database::ReadBinary( const std::string& databaseName )
 {
-    if ( m_nImages <= 0         ||
-         m_nEigenVals <= 0      ||
-         averageImage == NULL ||
-         m_EuclideanThreshold < 0
-         )
-         return false;
+    if ( m_Storage )
+    {
+        cvReleaseFileStorage(&m_Storage);
+        m_Storage = NULL;
+    }
 
-    return true;
+    ClearExternalData();
+    ClearImages();
+
+    m_pMappedFile = new MappedFile();
+    m_pMappedFile->Open(databaseName);
+
+    uchar* data = m_pMappedFile->GetData();
+    long long size = (long long)m_pMappedFile->GetSize();
+
+    if ( size < (long long)sizeof(BinaryHeader) )
+        throw std::string("Database::Read binary database is too short");
+
+    const BinaryHeader* header = (const BinaryHeader*)data;
+    if ( memcmp(header->m_Magic, BINARY_DB_MAGIC, sizeof(header->m_Magic)) != 0 )
+        throw std::string("Database::Read is not a binary database");
+    if ( header->m_Version < 1 || header->m_Version > BINARY_DB_VERSION )
+        throw std::string("Database::Read binary database version is not supported");
+    if ( header->m_Precision < Float32Storage || header->m_Precision > BFloat16Storage )
+        throw std::string("Database::Read binary database precision is not supported");
+    if ( header->m_nSections <= 0 || header->m_nImages <= 0 || header->m_nEigenVals <= 0 ||
+         header->m_Width <= 0 || header->m_Height <= 0 ||
+         (long long)sizeof(BinaryHeader) + header->m_nSections*(long long)sizeof(BinarySection) > size )
+        throw std::string("Database::Read binary database header is damaged");
+
+    const BinarySection* table = (const BinarySection*)(data + sizeof(BinaryHeader));
+    const BinarySection* found[SECTION_END] = { NULL };
+    for ( int i = 0; i < header->m_nSections; i++ )
+    {
+        const BinarySection& section = table[i];
+        if ( section.m_ID < SECTION_PERSON_IDS || section.m_ID >= SECTION_END )
+            continue;
+
+        int rows = section.m_ID == SECTION_STRINGS ? 1 : section.m_Rows;
+        long long rowBytes = section.m_ID == SECTION_STRINGS ? section.m_Step : (long long)section.m_Cols*CV_ELEM_SIZE(section.m_Type);
+        if ( section.m_Rows < 0 || section.m_Cols < 0 || section.m_Offset < 0 || section.m_Offset % sizeof(float) != 0 ||
+             section.m_Step < rowBytes || section.m_Offset + rows*section.m_Step > size )
+            throw std::string("Database::Read binary database section does not fit in the file");
+
+        // only the basis rows are padded, the searches index everything else as packed rows
+        if ( section.m_ID != SECTION_EIGEN_BASIS && section.m_Step != rowBytes )
+            throw std::string("Database::Read binary database section rows are not packed");
+
+        found[section.m_ID] = &section;
+    }
+
+    const int nPixels = header->m_Width*header->m_Height;
+    if ( !found[SECTION_PERSON_IDS] || !found[SECTION_EIGEN_VALUES] || !found[SECTION_PROJECTED_FACES] ||
+         !found[SECTION_AVERAGE_IMAGE] || !found[SECTION_EIGEN_BASIS] || !found[SECTION_STRINGS] )
+        throw std::string("Database::Read binary database is missing a section");
+
+    const BinarySection& ids = *found[SECTION_PERSON_IDS];
+    const BinarySection& values = *found[SECTION_EIGEN_VALUES];
+    const BinarySection& projected = *found[SECTION_PROJECTED_FACES];
+    const BinarySection& average = *found[SECTION_AVERAGE_IMAGE];
+    const BinarySection& basis = *found[SECTION_EIGEN_BASIS];
+    const BinarySection& strings = *found[SECTION_STRINGS];
+
+    StoragePrecision precision = (StoragePrecision)header->m_Precision;
+    int storedType = precision == Float32Storage ? CV_32FC1 : CV_16UC1;
 
+    if ( ids.m_Type != CV_32SC1 || ids.m_Rows != 1 || ids.m_Cols != header->m_nImages ||
+         values.m_Type != CV_32FC1 || values.m_Cols < header->m_nEigenVals ||
+         projected.m_Type != storedType || projected.m_Rows != header->m_nImages || projected.m_Cols != header->m_nEigenVals ||
+         average.m_Type != storedType || average.m_Rows != header->m_Height || average.m_Cols != header->m_Width ||
+         basis.m_Type != storedType || basis.m_Rows != header->m_nEigenVals || basis.m_Cols != nPixels ||
+         strings.m_Rows != 2*header->m_nImages || strings.m_Step != strings.m_Rows*(long long)sizeof(int) + strings.m_Cols )
+        throw std::string("Database::Read binary database sections do not match");
+
+    m_nImages = header->m_nImages;
+    m_nPeople = header->m_nPeople;
+    m_bSkipDetection = header->m_SkipDetection != 0;
+    m_EuclideanThreshold = header->m_EuclideanThreshold;
+    m_MahalanobisThreshold = header->m_MahalanobisThreshold;
+    m_StoragePrecision = precision;
+
+    personIDMatrix = cvCreateMatHeader(ids.m_Rows, ids.m_Cols, CV_32SC1);
+    cvSetData(personIDMatrix, data + ids.m_Offset, (int)ids.m_Step);
+    eigenValueMatrix = cvCreateMatHeader(values.m_Rows, values.m_Cols, CV_32FC1);
+    cvSetData(eigenValueMatrix, data + values.m_Offset, (int)values.m_Step);
+
+    if ( precision == Float32Storage )
+    {
+        projectedFaceMatrix = cvCreateMatHeader(projected.m_Rows, projected.m_Cols, CV_32FC1);
+        cvSetData(projectedFaceMatrix, data + projected.m_Offset, (int)projected.m_Step);
+        averageImage = cvCreateImageHeader(cvSize(header->m_Width, header->m_Height), IPL_DEPTH_32F, 1);
+        cvSetData(averageImage, data + average.m_Offset, (int)average.m_Step);
+        m_bMappedAverage = true;
+    }
+    else
+    {
+        projectedFaceMatrix = cvCreateMat(projected.m_Rows, projected.m_Cols, CV_32FC1);
+        for ( int i = 0; i < projected.m_Rows; i++ )
+            ConvertRow(data + projected.m_Offset + i*projected.m_Step, precision,
+                       projectedFaceMatrix->data.ptr + i*projectedFaceMatrix->step, Float32Storage, projected.m_Cols);
+
+        averageImage = cvCreateImage(cvSize(header->m_Width, header->m_Height), IPL_DEPTH_32F, 1);
+        for ( int i = 0; i < average.m_Rows; i++ )
+            ConvertRow(data + average.m_Offset + i*average.m_Step, precision,
+                       (uchar*)averageImage->imageData + i*averageImage->widthStep, Float32Storage, average.m_Cols);
+    }
 
+    const BinarySection* centroids = found[SECTION_CENTROIDS];
+    const BinarySection* centroidIDs = found[SECTION_CENTROID_IDS];
+    if ( centroids && centroidIDs && centroids->m_Type == CV_32FC1 && centroidIDs->m_Type == CV_32SC1 )
+    {
+        if ( centroids->m_Cols != header->m_nEigenVals || centroidIDs->m_Rows != 1 || centroidIDs->m_Cols != centroids->m_Rows )
+            throw std::string("Database::Read binary database centroids do not match");
+
+        personCentroidMatrix = cvCreateMatHeader(centroids->m_Rows, centroids->m_Cols, CV_32FC1);
+        cvSetData(personCentroidMatrix, data + centroids->m_Offset, (int)centroids->m_Step);
+        personCentroidIDMatrix = cvCreateMatHeader(centroidIDs->m_Rows, centroidIDs->m_Cols, CV_32SC1);
+        cvSetData(personCentroidIDMatrix, data + centroidIDs->m_Offset, (int)centroidIDs->m_Step);
+    }
+
+    if ( precision == Float32Storage )
+    {
+        MakeBasisHeaders(header->m_nEigenVals, cvSize(header->m_Width, header->m_Height), data + basis.m_Offset, (int)basis.m_Step);
+    }
+    else
+    {
+        m_pHalfBasis = cvCreateMatHeader(basis.m_Rows, basis.m_Cols, CV_16UC1);
+        cvSetData(m_pHalfBasis, data + basis.m_Offset, (int)basis.m_Step);
+        m_BasisPrecision = precision;
+        m_nEigenVals = header->m_nEigenVals;
+    }
+
+    // person names then image names
+    const int* offsets = (const int*)(data + strings.m_Offset);
+    const char* characters = (const char*)(offsets + strings.m_Rows);
+    for ( int i = 0; i < strings.m_Rows; i++ )
+    {
+        if ( offsets[i] < 0 || offsets[i] >= strings.m_Cols ||
+             memchr(characters + offsets[i], 0, strings.m_Cols - offsets[i]) == NULL )
+            throw std::string("Database::Read binary database string table is damaged");
+    }
+
+    for ( int i = 0; i < m_nImages; i++ )
+    {
+        Image img;
+        img.m_PersonName = characters + offsets[i];
+        img.m_ImageName = characters + offsets[m_nImages + i];
+        img.m_ID = personIDMatrix->data.i[i];
+
+        m_Names.push_back(img.m_PersonName);
+        m_ImageVec.push_back(img);
+    }
+}
+
+
+
+/*
+   Function:   ReadStorage
+   Purpose:    read the model from an OpenCV XML or YAML file
+   Throws      std::string if the file can not be opened or is missing data
+*/
+void Database::ReadStorage( const std::string& databaseName )
+{
+    if ( m_Storage )
+    {
+        cvReleaseFileStorage(&m_Storage);
+        m_Storage = NULL;
+    }
+
+    // reading a second database into this one replaces everything from the first
+    ClearExternalData();
+    ClearImages();
+
+    m_Storage = cvOpenFileStorage(databaseName.c_str(), 0, CV_STORAGE_READ);
+
+    if ( !m_Storage )
+        throw std::string("Database::Read could not open database");
+
+    m_nImages = cvReadIntByName( m_Storage, 0, "nImages", 0 );
+    m_nPeople = cvReadIntByName( m_Storage, 0, "nPeople", 0 );
+
+    personIDMatrix = (CvMat*)cvReadByName( m_Storage, 0, "PersonIDMatrix", 0 );
+
+    // images trained with #nodetect are loaded the same way
+    m_bSkipDetection = cvReadIntByName( m_Storage, 0, "SkipDetection", 0 ) != 0;
+
+    // read person names and original image names
+    for ( int i = 0; i < m_nImages; i++ )
+    {
+        Image img;
+        std::string tempName;
+        char varname[256];
+        sprintf(varname,"PersonID_%d",i+1);
+        tempName = cvReadStringByName( m_Storage, 0, varname, 0 );
+        m_Names.push_back(tempName);
+        img.m_PersonName = tempName;
+
+        sprintf(varname, "ImageID_%d", i);
+        tempName = cvReadStringByName( m_Storage, 0, varname, 0 );
+
+        img.m_ID = personIDMatrix->data.i[i];
+        img.m_ImageName = tempName;
+
+
+        m_ImageVec.push_back(img);
+    }
+
+
+    m_nEigenVals = cvReadIntByName( m_Storage, 0, "nEigenVals", 0 );
+    averageImage = (IplImage*)cvReadByName( m_Storage, 0, "AverageImage", 0 );
+    eigenValueMatrix = (CvMat*)cvReadByName( m_Storage, 0, "EigenValueMatrix", 0 );
+    projectedFaceMatrix = (CvMat*)cvReadByName( m_Storage, 0, "ProjectedFaceMatrix", 0 );
+    personCentroidMatrix = (CvMat*)cvReadByName( m_Storage, 0, "PersonCentroidMatrix", 0 );
+    personCentroidIDMatrix = (CvMat*)cvReadByName( m_Storage, 0, "PersonCentroidIDMatrix", 0 );
+
+    if ( !averageImage )
+        throw std::string("Database::Read could not find the average image");
+
+    AllocateEigenBasis(m_nEigenVals, cvGetSize(averageImage));
+
+    CvMat* basis = (CvMat*)cvReadByName( m_Storage, 0, "EigenBasisMatrix", 0 );
+    if ( basis )
+    {
+        if ( basis->rows != m_nEigenVals || basis->cols != eigenBasisMatrix->cols )
+            throw std::string("Database::Read eigen basis does not match the average image");
+
+        for ( int i = 0; i < m_nEigenVals; i++ )
+        {
+            memcpy(eigenBasisMatrix->data.ptr + i*eigenBasisMatrix->step, basis->data.ptr + i*basis->step,
+                   basis->cols*sizeof(float));
+        }
+        cvReleaseMat(&basis);
+    }
+    else
+    {
+        // databases written before the basis was one matrix have an image per eigen vector
+        for ( int i = 0; i < m_nEigenVals; i++ )
+        {
+            char var[256];
+            sprintf(var ,"EigenVector_%d",i);
+            IplImage* eigenVector = (IplImage*)cvReadByName(m_Storage, 0, var, 0);
+            if ( !eigenVector )
+                throw std::string("Database::Read could not find eigen vector");
+
+            cvCopy(eigenVector, eigenVectorArray[i]);
+            cvReleaseImage(&eigenVector);
+        }
+    }
+
+    m_EuclideanThreshold = cvReadRealByName( m_Storage, 0, "EuclideanThreshold", 0 );
+    m_MahalanobisThreshold = cvReadRealByName (m_Storage, 0, "MahalanobisThreshold", 0 );
+}
+
+
+
+/*
+   Function:   BuildSearchData
+   Purpose:    work out the Mahalanobis weights and, if m_bUseWhitened is set, scale every
+               column of projectedFaceMatrix by 1/sqrt(eigen value)
+   Notes:      squared L2 distance between whitened faces is the squared Mahalanobis
+               distance, so a probe only has to be whitened once and the search
+               never divides.  The whitened copy is as big as projectedFaceMatrix, so
+               it is off by default and the Mahalanobis search multiplies by the
+               inverse eigen values instead.  A component with an eigen value of 0
+               is ignored, before it made every distance inf or NaN
+*/
+void Database::BuildSearchData()
+{
+    if ( !projectedFaceMatrix || !eigenValueMatrix )
+        throw std::string("Database::BuildSearchData needs projected faces and eigen values");
+
+    ClearIndexes();
+
+    m_WhiteningWeights.resize(m_nEigenVals);
+    m_InverseEigenValues.resize(m_nEigenVals);
+    for ( int col = 0; col < m_nEigenVals; col++ )
+    {
+        float val = eigenValueMatrix->data.fl[col];
+        m_WhiteningWeights[col] = val > 0 ? (float)(1.0 / sqrt((double)val)) : 0.0f;
+        m_InverseEigenValues[col] = m_WhiteningWeights[col] * m_WhiteningWeights[col];
+    }
+
+    if ( whitenedFaceMatrix )
+        cvReleaseMat(&whitenedFaceMatrix);
+
+    m_bWhitenedGallery = m_bUseWhitened;
+    m_bFloatGalleryReleased = false;
+
+    // which gallery rows belong to each centroid, and the centroids in whitened space
+    m_CentroidRows.clear();
+    m_WhitenedCentroids.clear();
+    if ( personCentroidMatrix && personCentroidIDMatrix )
+    {
+        int nCentroids = personCentroidMatrix->rows;
+        std::map<int, int> centroidOfID;
+        for ( int c = 0; c < nCentroids; c++ )
+            centroidOfID[personCentroidIDMatrix->data.i[c]] = c;
+
+        m_CentroidRows.resize(nCentroids);
+        for ( int row = 0; row < m_nImages; row++ )
+        {
+            std::map<int, int>::iterator it = centroidOfID.find(personIDMatrix->data.i[row]);
+            if ( it != centroidOfID.end() )
+                m_CentroidRows[it->second].push_back(row);
+        }
+
+        if ( m_bUseWhitened )
+        {
+            m_WhitenedCentroids.resize((size_t)nCentroids * m_nEigenVals);
+            for ( int c = 0; c < nCentroids; c++ )
+                WhitenFace(personCentroidMatrix->data.fl + c*m_nEigenVals, &m_WhitenedCentroids[(size_t)c*m_nEigenVals]);
+        }
+    }
+
+    if ( !m_bUseWhitened )
+        return;
+
+    whitenedFaceMatrix = cvCreateMat(m_nImages, m_nEigenVals, CV_32FC1);
+    if ( !whitenedFaceMatrix )
+        throw std::string("Database::BuildSearchData could not allocate matrix");
+
+    for ( int row = 0; row < m_nImages; row++ )
+        WhitenFace(projectedFaceMatrix->data.fl + row*m_nEigenVals, whitenedFaceMatrix->data.fl + row*m_nEigenVals);
+}
+
+
+
+/*
+   Function:   BuildCentroids
+   Purpose:    average the projected faces of each person into personCentroidMatrix
+   Notes:      people are kept in the order they first appear in personIDMatrix
+   Throws      std::string if there are no projected faces
+*/
+void Database::BuildCentroids()
+{
+    if ( !projectedFaceMatrix || !personIDMatrix )
+        throw std::string("Database::BuildCentroids needs projected faces and person ids");
+
+    if ( personCentroidMatrix )
+        cvReleaseMat(&personCentroidMatrix);
+    if ( personCentroidIDMatrix )
+        cvReleaseMat(&personCentroidIDMatrix);
+
+    std::vector<int> ids;
+    std::map<int, int> centroidOfID;
+    for ( int row = 0; row < m_nImages; row++ )
+    {
+        int id = personIDMatrix->data.i[row];
+        if ( centroidOfID.find(id) == centroidOfID.end() )
+        {
+            centroidOfID[id] = (int)ids.size();
+            ids.push_back(id);
+        }
+    }
+
+    int nCentroids = (int)ids.size();
+    personCentroidMatrix = cvCreateMat(nCentroids, m_nEigenVals, CV_32FC1);
+    personCentroidIDMatrix = cvCreateMat(1, nCentroids, CV_32SC1);
+    if ( !personCentroidMatrix || !personCentroidIDMatrix )
+        throw std::string("Database::BuildCentroids could not allocate matrix");
+
+    std::vector<double> sums((size_t)nCentroids * m_nEigenVals, 0.0);
+    std::vector<int> counts(nCentroids, 0);
+    for ( int row = 0; row < m_nImages; row++ )
+    {
+        int c = centroidOfID[personIDMatrix->data.i[row]];
+        const float* face = projectedFaceMatrix->data.fl + row*m_nEigenVals;
+        for ( int col = 0; col < m_nEigenVals; col++ )
+            sums[(size_t)c*m_nEigenVals + col] += face[col];
+        counts[c]++;
+    }
+
+    for ( int c = 0; c < nCentroids; c++ )
+    {
+        personCentroidIDMatrix->data.i[c] = ids[c];
+        for ( int col = 0; col < m_nEigenVals; col++ )
+            personCentroidMatrix->data.fl[c*m_nEigenVals + col] = (float)(sums[(size_t)c*m_nEigenVals + col] / counts[c]);
+    }
+}
+
+
+
+/*
+   Function:   GetCentroids
+   Purpose:    centroids to compare a MakeQuery(metric) query with, use GetGalleryWeights too
+*/
+const float* Database::GetCentroids( DistanceMetric metric )
+{
+    if ( metric == MahalanobisMetric && !m_WhitenedCentroids.empty() )
+        return &m_WhitenedCentroids[0];
+
+    return personCentroidMatrix ? personCentroidMatrix->data.fl : NULL;
+}
+
+
+
+/*
+   Function:   AllocateEigenBasis
+   Purpose:    make room for nEigenVals eigen vectors of size in one buffer
+   Notes:      each row is padded to a multiple of 64 bytes so every eigen vector
+               starts on a cache line.  eigenVectorArray[i] is an image header over
+               row i, cvCalcEigenObjects writes straight into it
+   Throws      std::string if memory cannot be allocated
+*/
+void Database::AllocateEigenBasis( int nEigenVals, CvSize size )
+{
+    ReleaseEigenBasis();
+
+    int nPixels = size.width*size.height;
+    int step = ((nPixels*(int)sizeof(float) + BASIS_ALIGN - 1) / BASIS_ALIGN) * BASIS_ALIGN;
+
+    m_pEigenBasisBuffer = cvAlloc((size_t)nEigenVals*step + BASIS_ALIGN);
+    if ( !m_pEigenBasisBuffer )
+        throw std::string("Database::AllocateEigenBasis could not allocate eigen vectors");
+
+    MakeBasisHeaders(nEigenVals, size, (uchar*)cvAlignPtr(m_pEigenBasisBuffer, BASIS_ALIGN), step);
+}
+
+
+
+/*
+   Function:   MakeBasisHeaders
+   Purpose:    point eigenBasisMatrix and the eigenVectorArray images at nEigenVals
+               rows of step bytes starting at basis
+   Notes:      basis belongs to someone else, the buffer from AllocateEigenBasis or
+               the mapped file
+*/
+void Database::MakeBasisHeaders( int nEigenVals, CvSize size, uchar* basis, int step )
+{
+    int nPixels = size.width*size.height;
+
+    eigenBasisMatrix = cvCreateMatHeader(nEigenVals, nPixels, CV_32FC1);
+    eigenVectorArray = (IplImage**)cvAlloc(nEigenVals*sizeof(IplImage*));
+    m_nBasisHeaders = 0;
+    if ( !eigenBasisMatrix || !eigenVectorArray )
+        throw std::string("Database::AllocateEigenBasis could not allocate eigen vectors");
+
+    cvSetData(eigenBasisMatrix, basis, step);
+
+    for ( int i = 0; i < nEigenVals; i++ )
+    {
+        eigenVectorArray[i] = cvCreateImageHeader(size, IPL_DEPTH_32F, 1);
+        if ( !eigenVectorArray[i] )
+            throw std::string("Database::AllocateEigenBasis could not allocate eigen vector header");
+        cvSetData(eigenVectorArray[i], basis + (size_t)i*step, size.width*sizeof(float));
+        m_nBasisHeaders = i + 1;
+    }
+
+    m_nEigenVals = nEigenVals;
+}
+
+
+
+size_t Database::GetBasisBytes()
+{
+    const CvMat* basis = m_pHalfBasis ? m_pHalfBasis : eigenBasisMatrix;
+    return basis ? (size_t)basis->rows*basis->step : 0;
+}
+
+
+
+/*
+   Function:   TruncateEigenBasis
+   Purpose:    keep only the first nKeep eigen vectors
+   Notes:      the rows are already in order so only the headers change, the buffer
+               is the right size the next time the database is read.  A 16 bit
+               basis has no eigenBasisMatrix, only m_pHalfBasis is cut down
+*/
+void Database::TruncateEigenBasis( int nKeep )
+{
+    if ( nKeep >= m_nEigenVals || nKeep < 1 )
+        return;
+
+    if ( m_pHalfBasis )
+    {
+        cvInitMatHeader(m_pHalfBasis, nKeep, m_pHalfBasis->cols, CV_16UC1,
+                        m_pHalfBasis->data.ptr, m_pHalfBasis->step);
+        m_nEigenVals = nKeep;
+        return;
+    }
+
+    if ( !eigenBasisMatrix )
+        return;
+
+    for ( int i = nKeep; i < m_nBasisHeaders; i++ )
+        cvReleaseImageHeader(&eigenVectorArray[i]);
+    m_nBasisHeaders = std::min(m_nBasisHeaders, nKeep);
+
+    cvInitMatHeader(eigenBasisMatrix, nKeep, eigenBasisMatrix->cols, CV_32FC1,
+                    eigenBasisMatrix->data.ptr, eigenBasisMatrix->step);
+
+    m_nEigenVals = nKeep;
+}
+
+
+
+/*
+   Function:   ReleaseEigenBasis
+   Purpose:    free the eigen vector headers and the buffer they point into, or the
+               header over a 16 bit basis
+*/
+void Database::ReleaseEigenBasis()
+{
+    if ( eigenVectorArray )
+    {
+        for ( int i = 0; i < m_nBasisHeaders; i++ )
+        {
+            if ( eigenVectorArray[i] )
+                cvReleaseImageHeader(&eigenVectorArray[i]);
+        }
+        cvFree(&eigenVectorArray);
+    }
+
+    if ( eigenBasisMatrix )
+        cvReleaseMat(&eigenBasisMatrix);
+
+    if ( m_pEigenBasisBuffer )
+        cvFree(&m_pEigenBasisBuffer);
+
+    if ( m_pHalfBasis )
+        cvReleaseMat(&m_pHalfBasis);
+
+    eigenVectorArray = NULL;
+    eigenBasisMatrix = NULL;
+    m_pEigenBasisBuffer = NULL;
+    m_nBasisHeaders = 0;
+    m_pHalfBasis = NULL;
+    m_BasisPrecision = Float32Storage;
+}
+
+
+
+/*
+   Function:   ProjectFaces
+   Purpose:    project many faces onto the PCA subspace with one matrix multiply
+   Notes:      each block of faces is converted to float and has the average image
+               taken away, then a single GEMM against the transposed basis gives the
+               coefficients of every face in the block.  Blocks are shared out between
+               threads, cvGEMM does its own cache blocking inside a block.  A 16 bit
+               basis has no GEMM, each of its rows is dotted with every face in the
+               block while it is in cache
+   Throws      std::string if there is no basis or a face is the wrong size
+*/
+void Database::ProjectFaces( IplImage** faces, int nFaces, float* projectedFaces, int nThreads )
+{
+    if ( (!eigenBasisMatrix && !m_pHalfBasis) || !averageImage )
+        throw std::string("Database::ProjectFaces - the eigen basis has not been built");
+
+    int width = averageImage->width;
+    int height = averageImage->height;
+    int nPixels = width*height;
+    int nEigenVals = m_nEigenVals;
+
+    for ( int i = 0; i < nFaces; i++ )
+    {
+        if ( !faces[i] || faces[i]->width != width || faces[i]->height != height || faces[i]->nChannels != 1 )
+            throw std::string("Database::ProjectFaces - face does not match the training images");
+    }
+
+    if ( nFaces <= 0 )
+        return;
+
+    // a single probe only needs one row, not a whole block
+    int blockRows = std::min(PROJECT_BLOCK, nFaces);
+    int nBlocks = (nFaces + PROJECT_BLOCK - 1) / PROJECT_BLOCK;
+    int nWorkers = std::min(GetNumWorkers(nThreads), nBlocks);
+    DotHalfFunc dot = HalfDot(m_BasisPrecision);
+
+    #pragma omp parallel num_threads(nWorkers)
+    {
+        CvMat* centered = cvCreateMat(blockRows, nPixels, CV_32FC1);
+
+        #pragma omp for schedule(dynamic)
+        for ( int block = 0; block < nBlocks; block++ )
+        {
+            int first = block*PROJECT_BLOCK;
+            int count = std::min(PROJECT_BLOCK, nFaces - first);
+
+            for ( int i = 0; i < count; i++ )
+                CenterFace(faces[first + i], centered->data.fl + (size_t)i*nPixels);
+
+            if ( m_pHalfBasis )
+            {
+                for ( int j = 0; j < nEigenVals; j++ )
+                {
+                    const unsigned short* row = GetHalfBasisRow(j);
+                    for ( int i = 0; i < count; i++ )
+                        projectedFaces[(size_t)(first + i)*nEigenVals + j] = dot(centered->data.fl + (size_t)i*nPixels, row, nPixels);
+                }
+                continue;
+            }
+
+            CvMat a;
+            CvMat out;
+            cvGetRows(centered, &a, 0, count);
+            cvInitMatHeader(&out, count, nEigenVals, CV_32FC1, projectedFaces + (size_t)first*nEigenVals);
+            cvGEMM(&a, eigenBasisMatrix, 1.0, NULL, 0.0, &out, CV_GEMM_B_T);
+        }
+
+        cvReleaseMat(&centered);
+    }
+}
+
+
+
+/*
+   Function:   CenterFace
+   Purpose:    convert a preprocessed face to float and take away the average image,
+               centered must hold width*height floats
+   Notes:      the face is not checked, ProjectFaces checks a whole batch up front
+*/
+void Database::CenterFace( IplImage* face, float* centered )
+{
+    CvMat mat;
+    cvInitMatHeader(&mat, averageImage->height, averageImage->width, CV_32FC1, centered);
+    cvConvert(face, &mat);
+    cvSub(&mat, averageImage, &mat);
+}
+
+
+
+/*
+   Function:   ProjectCentered
+   Purpose:    coefficients for eigen vectors first to first+count-1 of a face that
+               has already been centered by CenterFace
+   Notes:      the rows of the basis are a view, nothing is copied.  Used by the
+               progressive search so only the components it needs are worked out
+*/
+void Database::ProjectCentered( const float* centered, int first, int count, float* coefficients )
+{
+    int nPixels = averageImage->width*averageImage->height;
+
+    if ( m_pHalfBasis )
+    {
+        DotHalfFunc dot = HalfDot(m_BasisPrecision);
+        for ( int i = 0; i < count; i++ )
+            coefficients[i] = dot(centered, GetHalfBasisRow(first + i), nPixels);
+        return;
+    }
+
+    CvMat a;
+    CvMat basis;
+    CvMat out;
+    cvInitMatHeader(&a, 1, nPixels, CV_32FC1, (void*)centered);
+    cvGetRows(eigenBasisMatrix, &basis, first, first + count);
+    cvInitMatHeader(&out, 1, count, CV_32FC1, coefficients);
+    cvGEMM(&a, &basis, 1.0, NULL, 0.0, &out, CV_GEMM_B_T);
+}
+
+
+
+/*
+   Function:   WhitenFace
+   Purpose:    whiten one projected face, whitenedFace must hold nEigenVals floats
+*/
+void Database::WhitenFace( const float* projectedFace, float* whitenedFace )
+{
+    for ( int col = 0; col < m_nEigenVals; col++ )
+        whitenedFace[col] = projectedFace[col] * m_WhiteningWeights[col];
+}
+
+
+
+/*
+   Function:   GetGallery
+   Purpose:    the rows a search for metric runs over, m_nImages rows of m_nEigenVals
+*/
+const float* Database::GetGallery( DistanceMetric metric )
+{
+    if ( m_bFloatGalleryReleased )
+        return NULL;
+
+    if ( metric == MahalanobisMetric && whitenedFaceMatrix )
+        return whitenedFaceMatrix->data.fl;
+
+    return projectedFaceMatrix->data.fl;
+}
+
+
+
+/*
+   Function:   GetGalleryWeights
+   Purpose:    weights to use with GetGallery, NULL when the distance is plain L2
+*/
+const float* Database::GetGalleryWeights( DistanceMetric metric )
+{
+    if ( metric == EuclideanMetric || m_bWhitenedGallery || m_InverseEigenValues.empty() )
+        return NULL;
+
+    return &m_InverseEigenValues[0];
+}
+
+
+
+/*
+   Function:   MakeQuery
+   Purpose:    turn a projected probe into a query for GetGallery(metric)
+*/
+void Database::MakeQuery( DistanceMetric metric, const float* projectedFace, std::vector<float>& query )
+{
+    query.resize(m_nEigenVals);
+
+    if ( metric == MahalanobisMetric && m_bWhitenedGallery )
+        WhitenFace(projectedFace, &query[0]);
+    else
+        std::copy(projectedFace, projectedFace + m_nEigenVals, query.begin());
+}
+
+
+
+/*
+   Function:   GetIndexFileName
+   Purpose:    name of a file that is kept next to the database, e.g. faces.xml.euclidean.hnsw
+*/
+std::string Database::GetIndexFileName( const char* suffix )
+{
+    std::string name = m_DatabaseName;
+    name += ".";
+    name += suffix;
+    return name;
+}
+
+
+
+/*
+   Function:   PrepareSearch
+   Purpose:    make sure whatever the search mode needs to search by metric is in memory
+   Notes:      Read calls it for the Mahalanobis metric, which is all FindFace uses, and the
+               Euclidean graph, tree or codes are only made when something asks for them.
+               Safe to call from the OpenMP workers, the first call for a metric builds
+               inside the critical section and the rest find it there
+   Throws      std::string if the float gallery has been released for anything but PQSearch
+*/
+void Database::PrepareSearch( DistanceMetric metric )
+{
+    // exceptions must not leave the critical section, they are thrown after it
+    std::string error;
+
+    #pragma omp critical(PrepareSearch)
+    {
+        try
+        {
+            PrepareMetric(metric);
+        }
+        catch ( std::string err )
+        {
+            error = err;
+        }
+        catch ( cv::Exception& e )
+        {
+            error = std::string("Database::PrepareSearch - ") + e.what();
+        }
+        catch ( ... )
+        {
+            error = "Database::PrepareSearch - could not build the search index";
+        }
+    }
+
+    if ( !error.empty() )
+        throw error;
+}
+
+
+
+/*
+   Function:   PrepareMetric
+   Purpose:    the work of PrepareSearch, only called inside its critical section
+   Notes:      HNSW graphs are read from next to the database if they are there and
+               match, otherwise they are built and saved for next time.  VP trees are
+               cheap to build so they are always built on load and never saved.
+               Product and int8 quantizers are trained here if Read did not find codes
+*/
+void Database::PrepareMetric( DistanceMetric metric )
+{
+    if ( m_bFloatGalleryReleased && m_SearchMode != PQSearch )
+        throw std::string("Database::PrepareSearch - the float gallery has been released, only PQSearch can be used");
+
+    if ( m_SearchMode == PQSearch )
+    {
+        if ( m_pQuantizer[metric] )
+            return;
+
+        if ( m_bFloatGalleryReleased )
+            throw std::string("Database::PrepareSearch - no codes to search and the float gallery has been released");
+
+        m_pQuantizer[metric] = new ProductQuantizer();
+        m_pQuantizer[metric]->Train(GetGallery(metric), m_nImages, m_nEigenVals, m_PQSubspaceDims);
+        return;
+    }
+
+    if ( m_SearchMode == SQ8Search )
+    {
+        if ( m_pScalarQuantizer[metric] )
+            return;
+
+        m_pScalarQuantizer[metric] = new ScalarQuantizer();
+        m_pScalarQuantizer[metric]->Train(GetGallery(metric), m_nImages, m_nEigenVals, GetGalleryWeights(metric));
+        return;
+    }
+
+    if ( m_SearchMode == ProgressiveSearch )
+    {
+        if ( m_SuffixEnergy[0].empty() )
+            BuildProgressiveData();
+        return;
+    }
+
+    if ( m_SearchMode == TreeSearch )
+    {
+        if ( m_pVPTree[metric] )
+            return;
+
+        m_pVPTree[metric] = new VPTree();
+        m_pVPTree[metric]->Build(GetGallery(metric), m_nImages, m_nEigenVals, GetGalleryWeights(metric));
+        return;
+    }
+
+    if ( m_SearchMode != HNSWSearch )
+        return;
+
+    if ( m_pHNSWIndex[metric] )
+        return;
+
+    HNSWIndex* index = new HNSWIndex();
+    std::string fileName = GetIndexFileName(HNSW_SUFFIXES[metric]);
+
+    try
+    {
+        if ( !index->Read(fileName, GetGallery(metric), m_nImages, m_nEigenVals, GetGalleryWeights(metric)) )
+        {
+            index->Build(GetGallery(metric), m_nImages, m_nEigenVals, GetGalleryWeights(metric));
+            if ( !m_DatabaseName.empty() )
+                index->Write(fileName);
+        }
+    }
+    catch ( ... )
+    {
+        delete index;
+        throw;
+    }
+
+    m_pHNSWIndex[metric] = index;
+}
+
+
+
+/*
+   Function:   SetProgressiveOptions
+   Purpose:    set the chunk size and tolerance of ProgressiveSearch
+   Notes:      the suffix energies depend on the chunk size so they are rebuilt
+               by the next PrepareSearch
+*/
+void Database::SetProgressiveOptions( int chunk, double tolerance )
+{
+    chunk = std::max(chunk, 1);
+    if ( chunk != m_ProgressiveChunk )
+    {
+        for ( int i = 0; i < NUM_METRICS; i++ )
+            m_SuffixEnergy[i].clear();
+    }
+
+    m_ProgressiveChunk = chunk;
+    m_ProgressiveTolerance = std::max(tolerance, 0.0);
+}
+
+
+
+const float* Database::GetProjectedWeights( DistanceMetric metric )
+{
+    if ( metric == EuclideanMetric || m_InverseEigenValues.empty() )
+        return NULL;
+
+    return &m_InverseEigenValues[0];
+}
+
+
+
+/*
+   Function:   BuildProgressiveData
+   Purpose:    work out what ProgressiveSearch needs to bound the components it
+               has not compared yet
+   Notes:      for every chunk boundary, each face's weighted energy in the columns
+               after it
+*/
+void Database::BuildProgressiveData()
+{
+    int nBounds = GetnChunkBounds();
+
+    for ( int i = 0; i < NUM_METRICS; i++ )
+    {
+        const float* weights = GetProjectedWeights((DistanceMetric)i);
+
+        m_SuffixEnergy[i].assign((size_t)m_nImages * nBounds, 0.0f);
+        for ( int row = 0; row < m_nImages; row++ )
+        {
+            const float* face = projectedFaceMatrix->data.fl + (size_t)row*m_nEigenVals;
+            float* energy = &m_SuffixEnergy[i][(size_t)row*nBounds];
+
+            double total = 0.0;
+            for ( int b = nBounds - 2; b >= 0; b-- )
+            {
+                for ( int col = b*m_ProgressiveChunk; col < std::min((b+1)*m_ProgressiveChunk, m_nEigenVals); col++ )
+                    total += (weights ? weights[col] : 1.0) * face[col] * face[col];
+                energy[b] = (float)total;
+            }
+        }
+    }
+}
+
+
+
+/*
+   Function:   ReleaseFloatGallery
+   Purpose:    free projectedFaceMatrix and whitenedFaceMatrix so only the codes stay resident
+   Notes:      the Mahalanobis codes are trained first if Read did not load them.
+               After this the database can only be searched with PQSearch, with the
+               Mahalanobis distance and without re-ranking
+   Throws      std::string if the search mode is not PQSearch
+*/
+void Database::ReleaseFloatGallery()
+{
+    if ( m_SearchMode != PQSearch )
+        throw std::string("Database::ReleaseFloatGallery - only PQSearch can search without the float gallery");
+
+    PrepareSearch();
+
+    for ( int i = 0; i < NUM_METRICS; i++ )
+    {
+        if ( m_pHNSWIndex[i] )
+            delete m_pHNSWIndex[i];
+        m_pHNSWIndex[i] = NULL;
+
+        if ( m_pVPTree[i] )
+            delete m_pVPTree[i];
+        m_pVPTree[i] = NULL;
+
+        if ( m_pScalarQuantizer[i] )
+            delete m_pScalarQuantizer[i];
+        m_pScalarQuantizer[i] = NULL;
+    }
+
+    if ( projectedFaceMatrix )
+        cvReleaseMat(&projectedFaceMatrix);
+    if ( whitenedFaceMatrix )
+        cvReleaseMat(&whitenedFaceMatrix);
+
+    projectedFaceMatrix = NULL;
+    whitenedFaceMatrix = NULL;
+    m_bFloatGalleryReleased = true;
+}
+
+
+
+/*
+   Function:   WriteQuantizers
+   Purpose:    store the product quantizer and int8 codes with the rest of the database
+   Notes:      only for XML and YAML, WriteBinary puts them in sections of their own
+*/
+void Database::WriteQuantizers()
+{
+    if ( !m_Storage )
+        return;
+
+    static const char* prefixes[NUM_METRICS] = { "PQ_Euclidean", "PQ_Mahalanobis" };
+    static const char* sq8Prefixes[NUM_METRICS] = { "SQ8_Euclidean", "SQ8_Mahalanobis" };
+
+    if ( m_pQuantizer[EuclideanMetric] || m_pQuantizer[MahalanobisMetric] )
+        cvWriteInt( m_Storage, "PQ_Whitened", m_bWhitenedGallery ? 1 : 0 );
+    for ( int i = 0; i < NUM_METRICS; i++ )
+    {
+        if ( m_pQuantizer[i] )
+            m_pQuantizer[i]->Write(m_Storage, prefixes[i]);
+    }
+
+    if ( m_pScalarQuantizer[EuclideanMetric] || m_pScalarQuantizer[MahalanobisMetric] )
+        cvWriteInt( m_Storage, "SQ8_Whitened", m_bWhitenedGallery ? 1 : 0 );
+    for ( int i = 0; i < NUM_METRICS; i++ )
+    {
+        if ( m_pScalarQuantizer[i] )
+            m_pScalarQuantizer[i]->Write(m_Storage, sq8Prefixes[i]);
+    }
+}
+
+
+
+/*
+   Function:   ReadQuantizers
+   Purpose:    load product quantizer and int8 codes if the database has them
+   Notes:      Mahalanobis codes made for a whitened gallery are no good if we are
+               not whitening now (and the other way round), PrepareSearch retrains them
+*/
+void Database::ReadQuantizers()
+{
+    if ( m_pMappedFile )
+    {
+        ReadBinaryQuantizers();
+        return;
+    }
+
+    if ( !m_Storage )
+        return;
+
+    static const char* prefixes[NUM_METRICS] = { "PQ_Euclidean", "PQ_Mahalanobis" };
+    static const char* sq8Prefixes[NUM_METRICS] = { "SQ8_Euclidean", "SQ8_Mahalanobis" };
+
+    int whitened = cvReadIntByName( m_Storage, 0, "PQ_Whitened", -1 );
+    for ( int i = 0; i < NUM_METRICS && whitened >= 0; i++ )
+    {
+        if ( i == MahalanobisMetric && (whitened != 0) != m_bWhitenedGallery )
+            continue;
+
+        ProductQuantizer* pq = new ProductQuantizer();
+        if ( pq->Read(m_Storage, prefixes[i], m_nImages, m_nEigenVals) )
+            m_pQuantizer[i] = pq;
+        else
+            delete pq;
+    }
+
+    whitened = cvReadIntByName( m_Storage, 0, "SQ8_Whitened", -1 );
+    for ( int i = 0; i < NUM_METRICS && whitened >= 0; i++ )
+    {
+        if ( i == MahalanobisMetric && (whitened != 0) != m_bWhitenedGallery )
+            continue;
+
+        DistanceMetric metric = (DistanceMetric)i;
+        ScalarQuantizer* sq = new ScalarQuantizer();
+        if ( sq->Read(m_Storage, sq8Prefixes[i], m_nImages, m_nEigenVals, GetGalleryWeights(metric)) )
+            m_pScalarQuantizer[i] = sq;
+        else
+            delete sq;
+    }
+}
+
+
+
+/*
+   Function:   MapSection
+   Purpose:    header over a section of the mapped file, NULL if it is not of type
+*/
+static CvMat* MapSection( uchar* data, const BinarySection& section, int type )
+{
+    if ( section.m_Type != type || section.m_Rows <= 0 || section.m_Cols <= 0 )
+        return NULL;
+
+    CvMat* mat = cvCreateMatHeader(section.m_Rows, section.m_Cols, type);
+    cvSetData(mat, data + section.m_Offset, (int)section.m_Step);
+    return mat;
+}
+
+
+
+/*
+   Function:   ReadBinaryQuantizers
+   Purpose:    point product quantizers and int8 codes at their sections of the mapped file
+   Notes:      ReadBinary has already checked every section fits in the file.  The
+               codes are used where they are, nothing is copied
+*/
+void Database::ReadBinaryQuantizers()
+{
+    uchar* data = m_pMappedFile->GetData();
+    const BinaryHeader* header = (const BinaryHeader*)data;
+    const BinarySection* table = (const BinarySection*)(data + sizeof(BinaryHeader));
+    bool bWhitened = (header->m_Flags & BINARY_FLAG_WHITENED_CODES) != 0;
+
+    const BinarySection* found[SECTION_END] = { NULL };
+    for ( int i = 0; i < header->m_nSections; i++ )
+    {
+        if ( table[i].m_ID >= SECTION_PQ_CODEBOOKS && table[i].m_ID < SECTION_END )
+            found[table[i].m_ID] = &table[i];
+    }
+
+    for ( int i = 0; i < NUM_METRICS; i++ )
+    {
+        if ( i == MahalanobisMetric && bWhitened != m_bWhitenedGallery )
+            continue;
+
+        const BinarySection* codebooks = found[SECTION_PQ_CODEBOOKS + i];
+        const BinarySection* codes = found[SECTION_PQ_CODES + i];
+        if ( codebooks && codes )
+        {
+            ProductQuantizer* pq = new ProductQuantizer();
+            if ( pq->Attach(MapSection(data, *codebooks, CV_32FC1), MapSection(data, *codes, CV_8UC1), m_nImages, m_nEigenVals) )
+                m_pQuantizer[i] = pq;
+            else
+                delete pq;
+        }
+
+        const BinarySection* scales = found[SECTION_SQ8_SCALES + i];
+        codes = found[SECTION_SQ8_CODES + i];
+        if ( scales && codes )
+        {
+            DistanceMetric metric = (DistanceMetric)i;
+            ScalarQuantizer* sq = new ScalarQuantizer();
+            if ( sq->Attach(MapSection(data, *scales, CV_32FC1), MapSection(data, *codes, CV_8SC1), m_nImages, m_nEigenVals,
+                            GetGalleryWeights(metric)) )
+                m_pScalarQuantizer[i] = sq;
+            else
+                delete sq;
+        }
+    }
+}
+
+
+
+bool Database::ValidateData()
+{
+    if ( m_nImages <= 0         ||
+         m_nEigenVals <= 0      ||
+         averageImage == NULL ||
+         m_EuclideanThreshold < 0
+         )
+         return false;
+
+    return true;
+
+
+}
+
+
+
+/*
+   Function:   ConvertDatabase
+   Purpose:    turn an XML database into a binary one, or back
+   Notes:      each database is read once more afterwards so the two read times can
+               be compared.  The gallery faces are not loaded for any of the reads.
+               precision only matters if to is binary
+   Throws      std::string if either database can not be read or written
+*/
+void ConvertDatabase( const std::string& from, const std::string& to, std::ostream& out, StoragePrecision precision )
+{
+    {
+        Database db;
+        db.Read(from);
+        db.SetStoragePrecision(precision);
+        db.Write(to);
+    }
+
+    const std::string* names[2] = { &from, &to };
+    for ( int i = 0; i < 2; i++ )
+    {
+        double t = (double)cvGetTickCount();
+        int nImages = 0;
+        {
+            Database db;
+            db.Read(*names[i]);
+            nImages = db.GetnImages();
+        }
+        double ms = ((double)cvGetTickCount() - t) / ((double)cvGetTickFrequency() * 1000.0);
+
+        out << (i == 0 ? "Read " : "Read converted ") << *names[i] << " (" << nImages << " images) in " << ms << " ms" << std::endl;
+    }
 }
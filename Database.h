@@ -3,6 +3,12 @@
 
 #include "Utilities.h"
 #include "ImageStruct.h"
+#include "HNSWIndex.h"
+#include "VPTree.h"
+#include "ProductQuantizer.h"
+#include "ScalarQuantizer.h"
+
+class MappedFile;
 
 
 extern IplImage**  imageArray;
@@ -11,8 +17,51 @@ extern IplImage*   averageImage;     // Average image of all training images
 extern CvMat*      personIDMatrix;   // matrix to store person ids
 extern CvMat*      eigenValueMatrix; // matrix to store Eigen values
 extern CvMat*      projectedFaceMatrix; // matrix to store projected faces
+extern CvMat*      whitenedFaceMatrix;  // projected faces with each column scaled by 1/sqrt(eigen value)
+extern CvMat*      personCentroidMatrix;   // mean projected face of each person
+extern CvMat*      personCentroidIDMatrix; // person id of each row of personCentroidMatrix
+extern CvMat*      eigenBasisMatrix;       // eigen vectors as rows, nEigenVals x pixels, owns the data
+                                           // eigenVectorArray points into.  Both are NULL when a
+                                           // binary database with a 16 bit basis is read, use
+                                           // ProjectFaces/ProjectCentered or check them first
+
+
+
+// Database::Write uses the binary format for names ending in this, Read knows a
+// binary database by its first bytes whatever it is called
+#define BINARY_DATABASE_EXT ".edb"
+
+
+// how a binary database stores the eigen basis, the average image and the projected
+// faces.  The 16 bit forms halve the file and the mapped basis, which is most of both
+enum StoragePrecision
+{
+    Float32Storage = 0,
+    Float16Storage,         // IEEE half, 11 bit mantissa, largest value 65504
+    BFloat16Storage         // top half of a float, the float's range with an 8 bit mantissa
+};
 
 
+// how Recognizer searches the projected faces
+enum SearchMode
+{
+    ExactSearch,        // scan every face, also used to verify the other modes
+    HNSWSearch,         // approximate search through the HNSW graph
+    TreeSearch,         // exact search through a vantage point tree
+    PQSearch,           // approximate search of the product quantized codes
+    SQ8Search,          // int8 gallery for the candidates, float gallery for the final order
+    CentroidSearch,     // closest people first, then every face of the best few people
+    ProgressiveSearch   // FindFace compares a chunk of components at a time and drops faces that cannot win
+};
+
+// the two distances the recognizer uses, each has its own gallery to search
+enum DistanceMetric
+{
+    EuclideanMetric = 0,
+    MahalanobisMetric = 1,
+    NUM_METRICS = 2
+};
+
 
 class Database
 {
@@ -27,9 +76,101 @@ public:
     bool Write( const std::string& databaseName );
     bool Read( const std::string& databaseName );
 
+    // true if Write would use the binary format for databaseName
+    static bool IsBinaryDatabaseName( const std::string& databaseName );
+
+    // precision Write uses for a binary database, Read sets it to the file's.  A 16 bit
+    // basis stays 16 bit in the mapped file and is projected onto with the DotF16 or
+    // DotBF16 kernel, the average image and projected faces are read back into floats.
+    // XML databases are always float
+    void SetStoragePrecision( StoragePrecision p ) { m_StoragePrecision = p; }
+    StoragePrecision GetStoragePrecision() { return m_StoragePrecision; }
+
+    // memory the eigen basis takes, whichever precision it is in
+    size_t GetBasisBytes();
+
     bool ValidateData();
     void ClearExternalData();
 
+    // one 64 byte aligned buffer holds every eigen vector, eigenBasisMatrix and the
+    // eigenVectorArray images are headers over it for the OpenCV calls that want them
+    void AllocateEigenBasis( int nEigenVals, CvSize size );
+    void TruncateEigenBasis( int nKeep );
+
+    // project nFaces preprocessed faces at once, projectedFaces gets nFaces rows of nEigenVals.
+    // Same result as cvEigenDecomposite on each face.  nThreads 0 uses one per core
+    void ProjectFaces( IplImage** faces, int nFaces, float* projectedFaces, int nThreads = 0 );
+
+    // the two halves of ProjectFaces for one face, ProjectCentered only works out
+    // components first to first+count-1
+    void CenterFace( IplImage* face, float* centered );
+    void ProjectCentered( const float* centered, int first, int count, float* coefficients );
+
+    // Mahalanobis weights and, if SetUseWhitened(true), a whitened copy of projectedFaceMatrix
+    // that Mahalanobis distance is plain L2 on.  The copy doubles the gallery so it is off by default
+    void BuildSearchData();
+    void WhitenFace( const float* projectedFace, float* whitenedFace );
+    void SetUseWhitened( bool b ) { m_bUseWhitened = b; }
+    bool GetUseWhitened() { return m_bUseWhitened; }
+
+    // mean projected face of each person, done when training and stored with the database
+    void BuildCentroids();
+    const float* GetCentroids( DistanceMetric metric );
+    int  GetnCentroids() { return personCentroidMatrix ? personCentroidMatrix->rows : 0; }
+    const std::vector<int>& GetCentroidRows( int centroid ) { return m_CentroidRows[centroid]; }
+
+    // number of people CentroidSearch scans the faces of
+    void SetShortlistSize( int M ) { m_ShortlistSize = M; }
+    int  GetShortlistSize() { return m_ShortlistSize; }
+
+    // rows to search for metric and the weights to search them with (NULL for plain L2)
+    const float* GetGallery( DistanceMetric metric );
+    const float* GetGalleryWeights( DistanceMetric metric );
+    void MakeQuery( DistanceMetric metric, const float* projectedFace, std::vector<float>& query );
+
+    void SetSearchMode( SearchMode mode ) { m_SearchMode = mode; }
+    SearchMode GetSearchMode() { return m_SearchMode; }
+
+    // size of the HNSW candidate list, higher is slower with better recall
+    void SetSearchEf( int ef ) { m_SearchEf = ef; }
+    int  GetSearchEf() { return m_SearchEf; }
+
+    // load or build what the search mode needs to search by metric.  Read does it for the
+    // Mahalanobis metric, call it again after changing the search mode
+    void PrepareSearch( DistanceMetric metric = MahalanobisMetric );
+    HNSWIndex* GetHNSWIndex( DistanceMetric metric ) { return m_pHNSWIndex[metric]; }
+    VPTree*    GetVPTree( DistanceMetric metric ) { return m_pVPTree[metric]; }
+    ProductQuantizer* GetQuantizer( DistanceMetric metric ) { return m_pQuantizer[metric]; }
+    ScalarQuantizer*  GetScalarQuantizer( DistanceMetric metric ) { return m_pScalarQuantizer[metric]; }
+
+    // columns per product quantizer subspace (1 byte each) and how many of the best
+    // codes are re-scored against the float gallery, 0 to trust the codes
+    void SetPQOptions( int subspaceDims, int nRerank ) { m_PQSubspaceDims = subspaceDims; m_PQRerank = nRerank; }
+    int  GetPQRerank() { return m_PQRerank; }
+
+    // how many of the best int8 distances are re-scored with the float gallery
+    void SetSQ8Rerank( int nRerank ) { m_SQ8Rerank = nRerank; }
+    int  GetSQ8Rerank() { return m_SQ8Rerank; }
+
+    // components ProgressiveSearch compares between checks, and how much closer (as a
+    // fraction) another face may still be when it stops, 0 stops only on a certain winner
+    void SetProgressiveOptions( int chunk, double tolerance );
+    int  GetProgressiveChunk() { return m_ProgressiveChunk; }
+    double GetProgressiveTolerance() { return m_ProgressiveTolerance; }
+
+    // weights of the raw projected coefficients for metric, NULL for plain L2
+    const float* GetProjectedWeights( DistanceMetric metric );
+
+    // for the chunk boundary b (column b*chunk): the weighted energy of each projected
+    // face from that column on, nImages rows of GetnChunkBounds()
+    int  GetnChunkBounds() { return (m_nEigenVals + m_ProgressiveChunk - 1) / m_ProgressiveChunk + 1; }
+    const float* GetSuffixEnergy( DistanceMetric metric ) { return m_SuffixEnergy[metric].empty() ? NULL : &m_SuffixEnergy[metric][0]; }
+
+    // drop the float galleries once the codes are ready, only PQSearch works after this
+    void ReleaseFloatGallery();
+    bool IsFloatGalleryReleased() { return m_bFloatGalleryReleased; }
+    std::string GetIndexFileName( const char* suffix );
+
     void SetnImages( int n ) { m_nImages = n; }
     int  GetnImages() { return m_nImages; }
 
@@ -48,8 +189,18 @@ public:
     void SetNames( NameVec& names ) { m_Names = names; }
     NameVec& GetNames() { return m_Names; }
 
+    // gallery images are already cropped to the face, Read does not look for faces in them
+    void SetSkipDetection( bool b ) { m_bSkipDetection = b; }
+    bool GetSkipDetection() { return m_bSkipDetection; }
+
     void SetImageVec( ImageVec& images ) { m_ImageVec = images; }
-    ImageVec& GetImageVec() { return m_ImageVec; }
+    ImageVec& GetImageVec();
+    const std::string& GetImageName( int i );
+
+    // Read only reads the model and the image names, the faces are loaded the first
+    // time GetImageVec is called.  Turn it off before Read to load them straight away
+    void SetLazyImages( bool b ) { m_bLazyImages = b; }
+    bool GetLazyImages() { return m_bLazyImages; }
 
 
 private:
@@ -65,6 +216,61 @@ private:
 
     NameVec                     m_Names;
     ImageVec                    m_ImageVec;
+    bool                        m_bSkipDetection;
+    bool                        m_bLazyImages;
+    bool                        m_bImagesPending;      // Read has not loaded the faces yet
+    bool                        m_bOwnImages;          // we loaded the faces so we release them
+
+    bool                        m_bUseWhitened;        // build whitenedFaceMatrix after training and on Read, false by default
+    std::vector<float>          m_WhiteningWeights;    // 1/sqrt(eigen value) for each column
+    std::vector<float>          m_InverseEigenValues;  // Mahalanobis weights when there is no whitened gallery
+
+    std::string                 m_DatabaseName;        // file we were read from or written to
+    SearchMode                  m_SearchMode;
+    int                         m_SearchEf;
+    HNSWIndex*                  m_pHNSWIndex[NUM_METRICS];
+    VPTree*                     m_pVPTree[NUM_METRICS];
+    ProductQuantizer*           m_pQuantizer[NUM_METRICS];
+    int                         m_PQSubspaceDims;
+    int                         m_PQRerank;
+    ScalarQuantizer*            m_pScalarQuantizer[NUM_METRICS];
+    int                         m_SQ8Rerank;
+    std::vector<float>          m_WhitenedCentroids;
+    std::vector< std::vector<int> > m_CentroidRows;    // gallery rows of each centroid's person
+    int                         m_ShortlistSize;
+    int                         m_ProgressiveChunk;
+    double                      m_ProgressiveTolerance;
+    std::vector<float>          m_SuffixEnergy[NUM_METRICS];
+    bool                        m_bWhitenedGallery;      // the Mahalanobis gallery (or its codes) is whitened
+    bool                        m_bFloatGalleryReleased;
+
+    void*                       m_pEigenBasisBuffer;   // what cvAlloc gave us, the basis starts at the next 64 bytes
+    int                         m_nBasisHeaders;       // eigenVectorArray headers we made
+    MappedFile*                 m_pMappedFile;         // binary database the model matrices point into
+    bool                        m_bMappedAverage;      // averageImage is a header over the file
+
+    StoragePrecision            m_StoragePrecision;
+    StoragePrecision            m_BasisPrecision;      // of m_pHalfBasis
+    CvMat*                      m_pHalfBasis;          // nEigenVals x pixels of 16 bit floats in the mapped file,
+                                                       // used instead of eigenBasisMatrix when it is set
+
+    void WriteStorage( const std::string& databaseName );
+    void ReadStorage( const std::string& databaseName );
+    void WriteBinary( const std::string& databaseName );
+    void ReadBinary( const std::string& databaseName );
+    void MakeBasisHeaders( int nEigenVals, CvSize size, uchar* basis, int step );
+    const unsigned short* GetHalfBasisRow( int i ) { return (const unsigned short*)(m_pHalfBasis->data.ptr + (size_t)i*m_pHalfBasis->step); }
+
+    void WriteQuantizers();
+    void ReadQuantizers();
+    void ReadBinaryQuantizers();
+    void ReleaseEigenBasis();
+    void PrepareMetric( DistanceMetric metric );
+    void BuildProgressiveData();
+    void LoadPendingImages();
+    void ClearImages();
+
+    void ClearIndexes();
 
 
 
@@ -72,5 +278,11 @@ private:
 
 
 
+// read the database from and write it as to, which is binary with precision if it
+// ends in BINARY_DATABASE_EXT.  The time to read each of them is written to out
+void ConvertDatabase( const std::string& from, const std::string& to, std::ostream& out, StoragePrecision precision = Float32Storage );
+
+
+
 
 #endif
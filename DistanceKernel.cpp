@@ -0,0 +1,943 @@
+#include "DistanceKernel.h"
+#include <float.h>
+#include <string.h>
+#include <algorithm>
+#include <queue>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define DK_X86
+#endif
+
+#ifdef DK_X86
+#include <emmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#if _MSC_VER >= 1700
+#define DK_HAVE_AVX2
+#endif
+#if _MSC_VER >= 1910
+#define DK_HAVE_AVX512
+#endif
+#if _MSC_VER >= 1930
+#define DK_HAVE_VNNI
+#endif
+#define DK_TARGET(x)
+#else
+#include <cpuid.h>
+#define DK_HAVE_AVX2
+#define DK_HAVE_AVX512
+#if (defined(__clang__) && __clang_major__ >= 12) || (!defined(__clang__) && __GNUC__ >= 11)
+#define DK_HAVE_VNNI
+#endif
+#define DK_TARGET(x) __attribute__((target(x)))
+#endif
+#if defined(DK_HAVE_AVX2) || defined(DK_HAVE_AVX512)
+#include <immintrin.h>
+#endif
+#endif
+
+
+
+////////////////////////////////////////////
+//           scalar kernels               //
+////////////////////////////////////////////
+
+static double L2SqrScalar( const float* a, const float* b, int n )
+{
+    double distance = 0.0;
+    for ( int i = 0; i < n; i++ )
+    {
+        float d = a[i] - b[i];
+        distance += d*d;
+    }
+    return distance;
+}
+
+
+static double WeightedL2SqrScalar( const float* a, const float* b, const float* w, int n )
+{
+    double distance = 0.0;
+    for ( int i = 0; i < n; i++ )
+    {
+        float d = a[i] - b[i];
+        distance += d*d*w[i];
+    }
+    return distance;
+}
+
+
+static long long DotS8S16Scalar( const signed char* codes, const short* q, int n )
+{
+    long long dot = 0;
+    for ( int i = 0; i < n; i++ )
+        dot += (int)codes[i] * (int)q[i];
+    return dot;
+}
+
+
+static float DotF16Scalar( const float* x, const unsigned short* h, int n )
+{
+    float dot = 0.0f;
+    for ( int i = 0; i < n; i++ )
+        dot += x[i] * HalfToFloat(h[i]);
+    return dot;
+}
+
+
+static float DotBF16Scalar( const float* x, const unsigned short* h, int n )
+{
+    float dot = 0.0f;
+    for ( int i = 0; i < n; i++ )
+        dot += x[i] * BFloat16ToFloat(h[i]);
+    return dot;
+}
+
+
+// the integer kernels add pairs of 127*32767 products into 32 bit lanes, after
+// this many columns the lanes are moved into a 64 bit sum before they can overflow
+static const int DOT_SPILL = 1024;
+
+
+
+#ifdef DK_X86
+
+////////////////////////////////////////////
+//           SSE2 kernels                 //
+////////////////////////////////////////////
+
+static double HorizontalSum( __m128 v )
+{
+    float tmp[4];
+    _mm_storeu_ps(tmp, v);
+    return (double)tmp[0] + tmp[1] + tmp[2] + tmp[3];
+}
+
+
+// each product is worked out in float, as the scalar kernel does, then added in
+// double so a long sum does not drift from the scalar one
+static __m128d AddWidened( __m128d acc, __m128 p )
+{
+    acc = _mm_add_pd(acc, _mm_cvtps_pd(p));
+    return _mm_add_pd(acc, _mm_cvtps_pd(_mm_movehl_ps(p, p)));
+}
+
+
+static double HorizontalSumPD( __m128d v )
+{
+    double tmp[2];
+    _mm_storeu_pd(tmp, v);
+    return tmp[0] + tmp[1];
+}
+
+
+static double L2SqrSSE2( const float* a, const float* b, int n )
+{
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    int i = 0;
+
+    for ( ; i + 8 <= n; i += 8 )
+    {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i));
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a+i+4), _mm_loadu_ps(b+i+4));
+        acc0 = AddWidened(acc0, _mm_mul_ps(d0, d0));
+        acc1 = AddWidened(acc1, _mm_mul_ps(d1, d1));
+    }
+
+    double distance = HorizontalSumPD(_mm_add_pd(acc0, acc1));
+    return distance + L2SqrScalar(a+i, b+i, n-i);
+}
+
+
+static double WeightedL2SqrSSE2( const float* a, const float* b, const float* w, int n )
+{
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    int i = 0;
+
+    for ( ; i + 8 <= n; i += 8 )
+    {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i));
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a+i+4), _mm_loadu_ps(b+i+4));
+        acc0 = AddWidened(acc0, _mm_mul_ps(_mm_mul_ps(d0, d0), _mm_loadu_ps(w+i)));
+        acc1 = AddWidened(acc1, _mm_mul_ps(_mm_mul_ps(d1, d1), _mm_loadu_ps(w+i+4)));
+    }
+
+    double distance = HorizontalSumPD(_mm_add_pd(acc0, acc1));
+    return distance + WeightedL2SqrScalar(a+i, b+i, w+i, n-i);
+}
+
+
+static long long HorizontalSumEpi32( __m128i v )
+{
+    int tmp[4];
+    _mm_storeu_si128((__m128i*)tmp, v);
+    return (long long)tmp[0] + tmp[1] + tmp[2] + tmp[3];
+}
+
+
+static long long DotS8S16SSE2( const signed char* codes, const short* q, int n )
+{
+    long long dot = 0;
+    int i = 0;
+
+    while ( i + 8 <= n )
+    {
+        __m128i acc = _mm_setzero_si128();
+        int end = std::min(n, i + DOT_SPILL);
+        for ( ; i + 8 <= end; i += 8 )
+        {
+            // sign extend 8 codes to 16 bits, SSE2 has no cvtepi8
+            __m128i c = _mm_loadl_epi64((const __m128i*)(codes+i));
+            c = _mm_srai_epi16(_mm_unpacklo_epi8(c, c), 8);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(c, _mm_loadu_si128((const __m128i*)(q+i))));
+        }
+        dot += HorizontalSumEpi32(acc);
+    }
+
+    return dot + DotS8S16Scalar(codes+i, q+i, n-i);
+}
+
+
+// a bfloat16 is the top half of a float, putting it above 16 zero bits is the
+// whole conversion.  IEEE half needs F16C so SSE2 only does bfloat16
+static float DotBF16SSE2( const float* x, const unsigned short* h, int n )
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    int i = 0;
+
+    for ( ; i + 8 <= n; i += 8 )
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(h+i));
+        __m128 h0 = _mm_castsi128_ps(_mm_unpacklo_epi16(zero, v));
+        __m128 h1 = _mm_castsi128_ps(_mm_unpackhi_epi16(zero, v));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x+i), h0));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x+i+4), h1));
+    }
+
+    float dot = (float)HorizontalSum(_mm_add_ps(acc0, acc1));
+    return dot + DotBF16Scalar(x+i, h+i, n-i);
+}
+
+
+
+////////////////////////////////////////////
+//           AVX2 kernels                 //
+////////////////////////////////////////////
+
+#ifdef DK_HAVE_AVX2
+
+DK_TARGET("avx2,fma")
+static double HorizontalSum256( __m256 v )
+{
+    float tmp[8];
+    _mm256_storeu_ps(tmp, v);
+    return (double)tmp[0] + tmp[1] + tmp[2] + tmp[3] + tmp[4] + tmp[5] + tmp[6] + tmp[7];
+}
+
+
+DK_TARGET("avx2")
+static __m256d AddWidened256( __m256d acc, __m256 p )
+{
+    acc = _mm256_add_pd(acc, _mm256_cvtps_pd(_mm256_castps256_ps128(p)));
+    return _mm256_add_pd(acc, _mm256_cvtps_pd(_mm256_extractf128_ps(p, 1)));
+}
+
+
+DK_TARGET("avx2")
+static double HorizontalSumPD256( __m256d v )
+{
+    double tmp[4];
+    _mm256_storeu_pd(tmp, v);
+    return tmp[0] + tmp[1] + tmp[2] + tmp[3];
+}
+
+
+DK_TARGET("avx2")
+static double L2SqrAVX2( const float* a, const float* b, int n )
+{
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    int i = 0;
+
+    for ( ; i + 16 <= n; i += 16 )
+    {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a+i+8), _mm256_loadu_ps(b+i+8));
+        acc0 = AddWidened256(acc0, _mm256_mul_ps(d0, d0));
+        acc1 = AddWidened256(acc1, _mm256_mul_ps(d1, d1));
+    }
+    for ( ; i + 8 <= n; i += 8 )
+    {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i));
+        acc0 = AddWidened256(acc0, _mm256_mul_ps(d0, d0));
+    }
+
+    double distance = HorizontalSumPD256(_mm256_add_pd(acc0, acc1));
+    return distance + L2SqrScalar(a+i, b+i, n-i);
+}
+
+
+DK_TARGET("avx2")
+static double WeightedL2SqrAVX2( const float* a, const float* b, const float* w, int n )
+{
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    int i = 0;
+
+    for ( ; i + 16 <= n; i += 16 )
+    {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a+i+8), _mm256_loadu_ps(b+i+8));
+        acc0 = AddWidened256(acc0, _mm256_mul_ps(_mm256_mul_ps(d0, d0), _mm256_loadu_ps(w+i)));
+        acc1 = AddWidened256(acc1, _mm256_mul_ps(_mm256_mul_ps(d1, d1), _mm256_loadu_ps(w+i+8)));
+    }
+    for ( ; i + 8 <= n; i += 8 )
+    {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i));
+        acc0 = AddWidened256(acc0, _mm256_mul_ps(_mm256_mul_ps(d0, d0), _mm256_loadu_ps(w+i)));
+    }
+
+    double distance = HorizontalSumPD256(_mm256_add_pd(acc0, acc1));
+    return distance + WeightedL2SqrScalar(a+i, b+i, w+i, n-i);
+}
+
+
+DK_TARGET("avx2")
+static long long HorizontalSumEpi32_256( __m256i v )
+{
+    int tmp[8];
+    _mm256_storeu_si256((__m256i*)tmp, v);
+    return (long long)tmp[0] + tmp[1] + tmp[2] + tmp[3] + tmp[4] + tmp[5] + tmp[6] + tmp[7];
+}
+
+
+DK_TARGET("avx2")
+static long long DotS8S16AVX2( const signed char* codes, const short* q, int n )
+{
+    long long dot = 0;
+    int i = 0;
+
+    while ( i + 16 <= n )
+    {
+        __m256i acc = _mm256_setzero_si256();
+        int end = std::min(n, i + DOT_SPILL);
+        for ( ; i + 16 <= end; i += 16 )
+        {
+            __m256i c = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(codes+i)));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(c, _mm256_loadu_si256((const __m256i*)(q+i))));
+        }
+        dot += HorizontalSumEpi32_256(acc);
+    }
+
+    return dot + DotS8S16Scalar(codes+i, q+i, n-i);
+}
+
+
+DK_TARGET("avx2,fma,f16c")
+static float DotF16AVX2( const float* x, const unsigned short* h, int n )
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+
+    for ( ; i + 16 <= n; i += 16 )
+    {
+        __m256 h0 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(h+i)));
+        __m256 h1 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(h+i+8)));
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x+i), h0, acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x+i+8), h1, acc1);
+    }
+    for ( ; i + 8 <= n; i += 8 )
+    {
+        __m256 h0 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(h+i)));
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x+i), h0, acc0);
+    }
+
+    float dot = (float)HorizontalSum256(_mm256_add_ps(acc0, acc1));
+    return dot + DotF16Scalar(x+i, h+i, n-i);
+}
+
+
+DK_TARGET("avx2,fma")
+static float DotBF16AVX2( const float* x, const unsigned short* h, int n )
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+
+    for ( ; i + 16 <= n; i += 16 )
+    {
+        __m256i v0 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(h+i)));
+        __m256i v1 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(h+i+8)));
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x+i), _mm256_castsi256_ps(_mm256_slli_epi32(v0, 16)), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x+i+8), _mm256_castsi256_ps(_mm256_slli_epi32(v1, 16)), acc1);
+    }
+    for ( ; i + 8 <= n; i += 8 )
+    {
+        __m256i v0 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(h+i)));
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x+i), _mm256_castsi256_ps(_mm256_slli_epi32(v0, 16)), acc0);
+    }
+
+    float dot = (float)HorizontalSum256(_mm256_add_ps(acc0, acc1));
+    return dot + DotBF16Scalar(x+i, h+i, n-i);
+}
+
+#endif // DK_HAVE_AVX2
+
+
+
+////////////////////////////////////////////
+//           VNNI kernels                 //
+////////////////////////////////////////////
+
+// vpdpwssd does the madd and the add in one instruction.  The VEX form is
+// AVX-VNNI (Alder Lake and later), the EVEX form needs AVX512-VNNI and AVX512VL
+
+#ifdef DK_HAVE_VNNI
+
+DK_TARGET("avx2,avxvnni")
+static long long DotS8S16AVXVNNI( const signed char* codes, const short* q, int n )
+{
+    long long dot = 0;
+    int i = 0;
+
+    while ( i + 16 <= n )
+    {
+        __m256i acc = _mm256_setzero_si256();
+        int end = std::min(n, i + DOT_SPILL);
+        for ( ; i + 16 <= end; i += 16 )
+        {
+            __m256i c = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(codes+i)));
+            acc = _mm256_dpwssd_avx_epi32(acc, c, _mm256_loadu_si256((const __m256i*)(q+i)));
+        }
+        dot += HorizontalSumEpi32_256(acc);
+    }
+
+    return dot + DotS8S16Scalar(codes+i, q+i, n-i);
+}
+
+
+DK_TARGET("avx2,avx512f,avx512vl,avx512vnni")
+static long long DotS8S16AVX512VNNI( const signed char* codes, const short* q, int n )
+{
+    long long dot = 0;
+    int i = 0;
+
+    while ( i + 16 <= n )
+    {
+        __m256i acc = _mm256_setzero_si256();
+        int end = std::min(n, i + DOT_SPILL);
+        for ( ; i + 16 <= end; i += 16 )
+        {
+            __m256i c = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(codes+i)));
+            acc = _mm256_dpwssd_epi32(acc, c, _mm256_loadu_si256((const __m256i*)(q+i)));
+        }
+        dot += HorizontalSumEpi32_256(acc);
+    }
+
+    return dot + DotS8S16Scalar(codes+i, q+i, n-i);
+}
+
+#endif // DK_HAVE_VNNI
+
+
+
+////////////////////////////////////////////
+//           AVX-512 kernels              //
+////////////////////////////////////////////
+
+#ifdef DK_HAVE_AVX512
+
+// the products are made 16 at a time in float, like the scalar kernel, and each
+// half is widened into 8 double lanes for the sums.  The last few columns are
+// loaded with a mask so there is no scalar tail
+
+DK_TARGET("avx512f")
+static double HorizontalSumPD512( __m512d v )
+{
+    double tmp[8];
+    _mm512_storeu_pd(tmp, v);
+    double sum = 0.0;
+    for ( int i = 0; i < 8; i++ )
+        sum += tmp[i];
+    return sum;
+}
+
+
+// adds the 16 float products in p to two double accumulators
+DK_TARGET("avx512f")
+static void AddWidened512( __m512 p, __m512d& acc0, __m512d& acc1 )
+{
+    __m256 lo = _mm512_castps512_ps256(p);
+    __m256 hi = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(p), 1));
+    acc0 = _mm512_add_pd(acc0, _mm512_cvtps_pd(lo));
+    acc1 = _mm512_add_pd(acc1, _mm512_cvtps_pd(hi));
+}
+
+
+DK_TARGET("avx512f")
+static double L2SqrAVX512( const float* a, const float* b, int n )
+{
+    __m512d acc0 = _mm512_setzero_pd();
+    __m512d acc1 = _mm512_setzero_pd();
+    int i = 0;
+
+    for ( ; i + 16 <= n; i += 16 )
+    {
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a+i), _mm512_loadu_ps(b+i));
+        AddWidened512(_mm512_mul_ps(d, d), acc0, acc1);
+    }
+    if ( i < n )
+    {
+        __mmask16 mask = (__mmask16)((1u << (n-i)) - 1);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a+i), _mm512_maskz_loadu_ps(mask, b+i));
+        AddWidened512(_mm512_mul_ps(d, d), acc0, acc1);
+    }
+
+    return HorizontalSumPD512(_mm512_add_pd(acc0, acc1));
+}
+
+
+DK_TARGET("avx512f")
+static double WeightedL2SqrAVX512( const float* a, const float* b, const float* w, int n )
+{
+    __m512d acc0 = _mm512_setzero_pd();
+    __m512d acc1 = _mm512_setzero_pd();
+    int i = 0;
+
+    for ( ; i + 16 <= n; i += 16 )
+    {
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a+i), _mm512_loadu_ps(b+i));
+        AddWidened512(_mm512_mul_ps(_mm512_mul_ps(d, d), _mm512_loadu_ps(w+i)), acc0, acc1);
+    }
+    if ( i < n )
+    {
+        __mmask16 mask = (__mmask16)((1u << (n-i)) - 1);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a+i), _mm512_maskz_loadu_ps(mask, b+i));
+        AddWidened512(_mm512_mul_ps(_mm512_mul_ps(d, d), _mm512_maskz_loadu_ps(mask, w+i)), acc0, acc1);
+    }
+
+    return HorizontalSumPD512(_mm512_add_pd(acc0, acc1));
+}
+
+#endif // DK_HAVE_AVX512
+
+
+
+////////////////////////////////////////////
+//           cpu detection                //
+////////////////////////////////////////////
+
+static void CpuId( int leaf, int subleaf, unsigned int regs[4] )
+{
+#if defined(_MSC_VER)
+    int r[4];
+    __cpuidex(r, leaf, subleaf);
+    for ( int i = 0; i < 4; i++ )
+        regs[i] = (unsigned int)r[i];
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+
+// which register state the OS saves for us on a context switch
+static unsigned long long XGetBV()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned int eax, edx;
+    __asm__ volatile ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((unsigned long long)edx << 32) | eax;
+#endif
+}
+
+
+static bool CpuHasAVX2()
+{
+    unsigned int regs[4];
+    CpuId(0, 0, regs);
+    if ( regs[0] < 7 )
+        return false;
+
+    CpuId(1, 0, regs);
+    bool osxsave = (regs[2] & (1u << 27)) != 0;
+    bool fma = (regs[2] & (1u << 12)) != 0;
+    if ( !osxsave || !fma )
+        return false;
+
+    // OS must save the ymm registers
+    if ( (XGetBV() & 0x6) != 0x6 )
+        return false;
+
+    CpuId(7, 0, regs);
+    return (regs[1] & (1u << 5)) != 0;
+}
+
+
+static bool CpuHasF16C()
+{
+    if ( !CpuHasAVX2() )
+        return false;
+
+    unsigned int regs[4];
+    CpuId(1, 0, regs);
+    return (regs[2] & (1u << 29)) != 0;
+}
+
+
+static bool CpuHasAVX512()
+{
+    if ( !CpuHasAVX2() )
+        return false;
+
+    // OS must also save the opmask and zmm registers
+    if ( (XGetBV() & 0xE6) != 0xE6 )
+        return false;
+
+    unsigned int regs[4];
+    CpuId(7, 0, regs);
+    return (regs[1] & (1u << 16)) != 0;
+}
+
+
+static bool CpuHasAVXVNNI()
+{
+    if ( !CpuHasAVX2() )
+        return false;
+
+    unsigned int regs[4];
+    CpuId(7, 1, regs);
+    return (regs[0] & (1u << 4)) != 0;
+}
+
+
+static bool CpuHasAVX512VNNI()
+{
+    if ( !CpuHasAVX512() )
+        return false;
+
+    unsigned int regs[4];
+    CpuId(7, 0, regs);
+    bool vl = (regs[1] & (1u << 31)) != 0;
+    bool vnni = (regs[2] & (1u << 11)) != 0;
+    return vl && vnni;
+}
+
+#endif // DK_X86
+
+
+
+static DistanceKernel SelectDistanceKernel()
+{
+    DistanceKernel kernel;
+    kernel.m_Name = "scalar";
+    kernel.L2Sqr = L2SqrScalar;
+    kernel.WeightedL2Sqr = WeightedL2SqrScalar;
+    kernel.m_DotName = "scalar";
+    kernel.DotS8S16 = DotS8S16Scalar;
+    kernel.m_HalfName = "scalar";
+    kernel.DotF16 = DotF16Scalar;
+    kernel.DotBF16 = DotBF16Scalar;
+
+#ifdef DK_X86
+    kernel.m_Name = "sse2";
+    kernel.L2Sqr = L2SqrSSE2;
+    kernel.WeightedL2Sqr = WeightedL2SqrSSE2;
+    kernel.m_DotName = "sse2";
+    kernel.DotS8S16 = DotS8S16SSE2;
+    kernel.m_HalfName = "sse2";
+    kernel.DotBF16 = DotBF16SSE2;
+
+#ifdef DK_HAVE_AVX2
+    if ( CpuHasAVX2() )
+    {
+        kernel.m_Name = "avx2";
+        kernel.L2Sqr = L2SqrAVX2;
+        kernel.WeightedL2Sqr = WeightedL2SqrAVX2;
+        kernel.m_DotName = "avx2";
+        kernel.DotS8S16 = DotS8S16AVX2;
+        kernel.m_HalfName = "avx2";
+        kernel.DotBF16 = DotBF16AVX2;
+    }
+    if ( CpuHasF16C() )
+    {
+        kernel.m_HalfName = "avx2+f16c";
+        kernel.DotF16 = DotF16AVX2;
+    }
+#endif
+
+#ifdef DK_HAVE_AVX512
+    if ( CpuHasAVX512() )
+    {
+        kernel.m_Name = "avx512";
+        kernel.L2Sqr = L2SqrAVX512;
+        kernel.WeightedL2Sqr = WeightedL2SqrAVX512;
+    }
+#endif
+
+#ifdef DK_HAVE_VNNI
+    if ( CpuHasAVX512VNNI() )
+    {
+        kernel.m_DotName = "avx512vnni";
+        kernel.DotS8S16 = DotS8S16AVX512VNNI;
+    }
+    if ( CpuHasAVXVNNI() )
+    {
+        kernel.m_DotName = "avxvnni";
+        kernel.DotS8S16 = DotS8S16AVXVNNI;
+    }
+#endif
+#endif
+
+    return kernel;
+}
+
+
+/*
+   Function:   GetDistanceKernel
+   Purpose:    returns the fastest kernel this cpu supports
+   Notes:      picked the first time it is asked for, so a static initializer in
+               another file can use it
+*/
+const DistanceKernel& GetDistanceKernel()
+{
+    static const DistanceKernel kernel = SelectDistanceKernel();
+    return kernel;
+}
+
+
+// local statics are not thread safe before C++11 (VS2010), asking once before
+// main runs means worker threads only ever read the kernel
+static const DistanceKernel& g_DistanceKernel = GetDistanceKernel();
+
+
+
+/*
+   Function:   FloatToHalf
+   Purpose:    nearest IEEE half to f, ties go to the even one
+   Notes:      values too small for a normal half become subnormals, values from
+               65520 up become infinity.  NaN keeps its sign and the top 10 bits of
+               its payload and is made quiet, as vcvtps2ph does
+*/
+unsigned short FloatToHalf( float f )
+{
+    unsigned int x;
+    memcpy(&x, &f, sizeof(x));
+
+    unsigned int sign = (x >> 16) & 0x8000;
+    unsigned int absx = x & 0x7FFFFFFF;
+
+    if ( absx > 0x7F800000 )
+        return (unsigned short)(sign | 0x7C00 | ((absx >> 13) & 0x3FF) | 0x200);
+    if ( absx == 0x7F800000 )
+        return (unsigned short)(sign | 0x7C00);
+    if ( absx >= 0x477FF000 )
+        return (unsigned short)(sign | 0x7C00);
+
+    int exponent = (int)(absx >> 23);
+    if ( exponent < 113 )
+    {
+        // subnormal half, counts of 2^-24.  Anything under 2^-25 rounds to 0
+        if ( exponent < 102 )
+            return (unsigned short)sign;
+
+        unsigned int mantissa = (absx & 0x7FFFFF) | 0x800000;
+        int shift = 126 - exponent;
+        unsigned int h = mantissa >> shift;
+        unsigned int rest = mantissa & ((1u << shift) - 1);
+        unsigned int halfway = 1u << (shift - 1);
+        if ( rest > halfway || (rest == halfway && (h & 1)) )
+            h++;
+        return (unsigned short)(sign | h);
+    }
+
+    // a carry out of the mantissa moves up the exponent, which is what rounding should do
+    unsigned int h = ((unsigned int)(exponent - 112) << 10) | ((absx >> 13) & 0x3FF);
+    unsigned int rest = absx & 0x1FFF;
+    if ( rest > 0x1000 || (rest == 0x1000 && (h & 1)) )
+        h++;
+    return (unsigned short)(sign | h);
+}
+
+
+float HalfToFloat( unsigned short h )
+{
+    unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+    unsigned int exponent = (h >> 10) & 0x1F;
+    unsigned int mantissa = h & 0x3FF;
+    unsigned int x;
+
+    if ( exponent == 0 )
+    {
+        // zero or subnormal, mantissa * 2^-24 is exact in a float
+        float f = (float)mantissa * (1.0f / 16777216.0f);
+        return sign ? -f : f;
+    }
+
+    if ( exponent == 31 )
+        x = sign | 0x7F800000 | (mantissa << 13);
+    else
+        x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+
+/*
+   Function:   FloatToBFloat16
+   Purpose:    top 16 bits of f rounded to the nearest even, NaN is kept quiet
+*/
+unsigned short FloatToBFloat16( float f )
+{
+    unsigned int x;
+    memcpy(&x, &f, sizeof(x));
+
+    if ( (x & 0x7FFFFFFF) > 0x7F800000 )
+        return (unsigned short)((x >> 16) | 0x40);
+
+    x += 0x7FFF + ((x >> 16) & 1);
+    return (unsigned short)(x >> 16);
+}
+
+
+float BFloat16ToFloat( unsigned short h )
+{
+    unsigned int x = (unsigned int)h << 16;
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+
+
+// columns summed between checks of the bound, the eigen vectors are sorted by
+// variance so most of the distance is in the first few blocks
+static const int PARTIAL_BLOCK = 32;
+
+
+/*
+   Function:   PartialL2Sqr
+   Purpose:    squared distance with early abandonment
+   Notes:      stops as soon as the running sum is bigger than bound
+   Returns:    the squared distance, or a partial sum bigger than bound
+*/
+double PartialL2Sqr( const float* a, const float* b, const float* weights, int n, double bound )
+{
+    const DistanceKernel& kernel = GetDistanceKernel();
+    double distance = 0.0;
+
+    for ( int col = 0; col < n; col += PARTIAL_BLOCK )
+    {
+        int len = std::min(PARTIAL_BLOCK, n - col);
+        distance += weights ? kernel.WeightedL2Sqr(a+col, b+col, weights+col, len)
+                            : kernel.L2Sqr(a+col, b+col, len);
+
+        if ( distance > bound )
+            break;
+    }
+
+    return distance;
+}
+
+
+
+/*
+   Function:   NearestRow
+   Purpose:    find the row of gallery closest to probe
+   Notes:      rows are nCols floats each and stored one after the other.  A row
+               is dropped as soon as it is further away than the best so far
+   Returns:    index of the closest row, distance is the squared distance to it
+*/
+int NearestRow( const float* probe, const float* gallery, int nRows, int nCols, const float* weights, double& distance )
+{
+    double bestChoiceDiff = DBL_MAX;
+    int bestIndex = 0;
+
+    for ( int row = 0; row < nRows; row++ )
+    {
+        const float* face = gallery + (size_t)row*nCols;
+        double d = PartialL2Sqr(probe, face, weights, nCols, bestChoiceDiff);
+
+        if ( d < bestChoiceDiff )
+        {
+            bestChoiceDiff = d;
+            bestIndex = row;
+        }
+    }
+
+    distance = bestChoiceDiff;
+
+    return bestIndex;
+}
+
+
+
+// keeps the k closest rows in a max heap, rows lists the gallery rows to look at
+// or is NULL for all nRows of them
+static void ScanRows( const float* probe, const float* gallery, const int* rows, int nRows, int nCols,
+                      const float* weights, int k, NeighbourVec& neighbours )
+{
+    std::priority_queue<Neighbour> best;
+
+    neighbours.clear();
+    if ( k <= 0 )
+        return;
+
+    for ( int i = 0; i < nRows; i++ )
+    {
+        int row = rows ? rows[i] : i;
+        const float* face = gallery + (size_t)row*nCols;
+        double bound = (int)best.size() < k ? DBL_MAX : best.top().m_Distance;
+        double d = PartialL2Sqr(probe, face, weights, nCols, bound);
+
+        if ( d < bound )
+        {
+            Neighbour n;
+            n.m_Index = row;
+            n.m_Distance = d;
+
+            if ( (int)best.size() == k )
+                best.pop();
+            best.push(n);
+        }
+    }
+
+    while ( !best.empty() )
+    {
+        neighbours.push_back(best.top());
+        best.pop();
+    }
+    std::reverse(neighbours.begin(), neighbours.end());
+}
+
+
+
+/*
+   Function:   NearestRows
+   Purpose:    find the k rows of gallery closest to probe
+   Notes:      a max heap holds the k best so far, the k-th best distance is the
+               bound used to abandon the rest of the rows early
+*/
+void NearestRows( const float* probe, const float* gallery, int nRows, int nCols, const float* weights, int k, NeighbourVec& neighbours )
+{
+    ScanRows(probe, gallery, NULL, nRows, nCols, weights, k, neighbours);
+}
+
+
+
+/*
+   Function:   NearestRowsOf
+   Purpose:    same as NearestRows but only looks at the listed rows
+   Notes:      neighbour indexes are gallery rows, not positions in rows
+*/
+void NearestRowsOf( const float* probe, const float* gallery, const std::vector<int>& rows, int nCols, const float* weights, int k, NeighbourVec& neighbours )
+{
+    ScanRows(probe, gallery, rows.empty() ? NULL : &rows[0], (int)rows.size(), nCols, weights, k, neighbours);
+}
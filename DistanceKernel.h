@@ -0,0 +1,89 @@
+#ifndef DISTANCEKERNEL_H
+#define DISTANCEKERNEL_H
+
+/*
+   DistanceKernel.h
+   Description:   squared distance kernels used to scan the projected faces.
+                  The best kernel for the cpu we are running on (AVX-512, AVX2, SSE2
+                  or plain C) is picked once at start up.  The int8 dot product used
+                  by the scalar quantized gallery can also use AVX-VNNI / AVX512-VNNI,
+                  the 16 bit float dot products used by a half precision eigen basis
+                  use F16C
+   Author:        Chris Leighton
+
+*/
+
+#include <vector>
+
+// sum of (a[i]-b[i])^2
+typedef double (*L2SqrFunc)( const float* a, const float* b, int n );
+
+// sum of (a[i]-b[i])^2 * w[i]
+typedef double (*WeightedL2SqrFunc)( const float* a, const float* b, const float* w, int n );
+
+// sum of codes[i]*q[i], int8 gallery codes against an int16 query
+typedef long long (*DotS8S16Func)( const signed char* codes, const short* q, int n );
+
+// sum of x[i]*h[i], h holds 16 bit floats (IEEE half or bfloat16) that are turned
+// into floats as they are loaded, the sum is kept in float
+typedef float (*DotHalfFunc)( const float* x, const unsigned short* h, int n );
+
+
+struct DistanceKernel
+{
+    const char*         m_Name;
+    L2SqrFunc           L2Sqr;
+    WeightedL2SqrFunc   WeightedL2Sqr;
+
+    const char*         m_DotName;      // the integer kernel can use VNNI on cpus that have it
+    DotS8S16Func        DotS8S16;
+
+    const char*         m_HalfName;     // IEEE half needs F16C to be converted 8 at a time
+    DotHalfFunc         DotF16;
+    DotHalfFunc         DotBF16;
+};
+
+
+// kernel picked for this cpu
+const DistanceKernel& GetDistanceKernel();
+
+
+// one value to and from the 16 bit float formats, rounding to the nearest even.
+// Half overflows to infinity past 65504, bfloat16 keeps the whole float range
+unsigned short FloatToHalf( float f );
+float HalfToFloat( unsigned short h );
+unsigned short FloatToBFloat16( float f );
+float BFloat16ToFloat( unsigned short h );
+
+
+// a row of the gallery and its squared distance to the probe
+struct Neighbour
+{
+    int     m_Index;
+    double  m_Distance;
+
+    bool operator<( const Neighbour& rhs ) const { return m_Distance < rhs.m_Distance; }
+};
+
+typedef std::vector<Neighbour> NeighbourVec;
+
+
+// squared distance that gives up once it passes bound, the returned value is then
+// only known to be > bound.  weights can be NULL
+double PartialL2Sqr( const float* a, const float* b, const float* weights, int n, double bound );
+
+
+// compare probe against every row of a nRows x nCols gallery, if weights is not NULL
+// the weighted distance is used.  Returns index of closest row and fills in the squared distance
+int NearestRow( const float* probe, const float* gallery, int nRows, int nCols, const float* weights, double& distance );
+
+
+// same as NearestRow but keeps the k closest rows, neighbours is sorted closest first
+void NearestRows( const float* probe, const float* gallery, int nRows, int nCols, const float* weights, int k, NeighbourVec& neighbours );
+
+
+// same as NearestRows but only the listed rows of the gallery are compared
+void NearestRowsOf( const float* probe, const float* gallery, const std::vector<int>& rows, int nCols, const float* weights, int k, NeighbourVec& neighbours );
+
+
+#endif
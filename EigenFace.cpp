@@ -24,6 +24,7 @@ Date:          Feb 10th 2010
 #include "Training.h"
 #include "TrainingFile.h"
 #include "Recognize.h"
+#include "HaarCascadeEmbed.h"
 
 
 void PrintUsage();
@@ -33,6 +34,11 @@ int main( int argc, char** argv )
     system("clear");
     std::string command = "";
 
+    // one image at a time here, so let each detection use every core
+    PreProcessOptions options;
+    options.m_DetectThreads = 0;
+    SetPreProcessOptions(options);
+
     while (1)
     {
         PrintUsage();
@@ -110,11 +116,18 @@ int main( int argc, char** argv )
                 cout << "Enter results directory:";
                 cin >> resultsdir;
 
+                double energyFraction = 1.0;
+                int maxEigenVals = 0;
+                cout << "Enter fraction of variance to keep (1 keeps every eigen vector):";
+                cin >> energyFraction;
+                cout << "Enter most eigen vectors to keep (0 for no limit):";
+                cin >> maxEigenVals;
+
                 // make sure results dir ends with '/'
                 if ( !resultsdir.empty() &&  resultsdir[resultsdir.size()-1] != '/' )
                     resultsdir.append("/");
 
-                Train( trainingfile.c_str(), outputfile.c_str(), resultsdir );
+                Train( trainingfile.c_str(), outputfile.c_str(), resultsdir, ExactSearch, energyFraction, maxEigenVals );
 
                 cout << "Database created: " << outputfile << endl;
 
@@ -149,6 +162,44 @@ int main( int argc, char** argv )
                     cout << "Distance: " << distance << endl;
                 }
             }
+            else if ( command == "CASCADE" )
+            {
+                std::string cascadefile;
+                std::string sourcefile;
+                cout << "Enter Haar cascade file: ";
+                cin >> cascadefile;
+                cout << "Enter source file to write: ";
+                cin >> sourcefile;
+
+                WriteCascadeSource(cascadefile.c_str(), sourcefile.c_str(), "g_FrontalFaceCascade");
+
+                cout << sourcefile << " created.  Add it to the build and define HAAR_CASCADE_EMBEDDED" << endl;
+            }
+            else if ( command == "CONVERT" )
+            {
+                std::string database;
+                std::string converted;
+                cout << "Enter database to convert: ";
+                cin >> database;
+                cout << "Enter new database name (" << BINARY_DATABASE_EXT << " for binary): ";
+                cin >> converted;
+
+                StoragePrecision precision = Float32Storage;
+                if ( Database::IsBinaryDatabaseName(converted) )
+                {
+                    std::string bits;
+                    cout << "Enter basis precision (32, 16 or bf16): ";
+                    cin >> bits;
+                    if ( bits == "16" )
+                        precision = Float16Storage;
+                    else if ( bits == "bf16" )
+                        precision = BFloat16Storage;
+                }
+
+                ConvertDatabase(database, converted, cout, precision);
+
+                cout << "Database created: " << converted << endl;
+            }
             else if ( command == "SYS" )
             {
                 // if ( bAllowSys )  // this just makes it easy to demo the program
@@ -189,6 +240,8 @@ void PrintUsage()
     cout << "genfile    - create a training file" << endl;
     cout << "train      - train the system" << endl;
     cout << "search     - search the database for a face in an image" << endl;
+    cout << "cascade    - write a Haar cascade as source to compile into the program" << endl;
+    cout << "convert    - convert a database between XML and the binary format" << endl;
     cout << "exit" << endl << ":";
 }
 
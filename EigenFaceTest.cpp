@@ -20,6 +20,7 @@ Date:          June 27th 2011
 #include "FaceDetector.h"
 #include "Utilities.h"
 #include "PreProcess.h"
+#include "FaceCache.h"
 #include "Training.h"
 #include "TrainingFile.h"
 #include "Recognize.h"
@@ -27,6 +28,8 @@ Date:          June 27th 2011
 #include "UPGMA.h"
 
 void PrintUsage();
+void ReadTestFile(const std::string& testFile, std::vector<int>& trueIDs, std::vector<std::string>& probeFaces);
+void BenchmarkSearchMode(SearchMode mode, const std::string& databaseName, const std::string& testFile, std::ostream& out);
 
 int main( int argc, char** argv )
 {
@@ -63,6 +66,57 @@ int main( int argc, char** argv )
 
     try
     {
+        // faces preprocessed by an earlier run are read back instead of detected again
+        if ( argc > 5 )
+        {
+            FaceCache::Open(argv[5]);
+            resultsFile << "Face cache   : " << argv[5] << endl;
+        }
+
+        /*///////////////////////////// cascade loading during LoadImages ////////////////////////
+        cout << "Comparing LoadImages with and without the cascade registry" << endl;
+        resultsFile << "Comparing LoadImages with and without the cascade registry" << endl;
+
+        BenchmarkLoadImages(trainFile.c_str(), resultsFile);
+        resultsFile << endl;
+        /////////////////////////////////////////////////////////////////////////////////////////*/
+
+        /*///////////////////////////// one pass preprocessing ///////////////////////////////////
+        cout << "Comparing preprocessing in one pass with the separate steps" << endl;
+        resultsFile << "Comparing preprocessing in one pass with the separate steps" << endl;
+
+        std::vector<int>         scaleIDs;
+        std::vector<std::string> scaleImages;
+        ReadTestFile(testFile, scaleIDs, scaleImages);
+
+        BenchmarkScaleFace(scaleImages, resultsFile);
+        resultsFile << endl;
+        /////////////////////////////////////////////////////////////////////////////////////////*/
+
+        /*///////////////////////////// detection on a reduced image ///////////////////////////////
+        cout << "Comparing detection at full size with detection on a reduced image" << endl;
+        resultsFile << "Comparing detection at full size with detection on a reduced image" << endl;
+
+        std::vector<int>         detectIDs;
+        std::vector<std::string> detectImages;
+        ReadTestFile(testFile, detectIDs, detectImages);
+
+        PreProcessOptions detectOptions;
+        detectOptions.m_MinFaceSize = 80;
+        detectOptions.m_DetectWindow = 24;
+        SetPreProcessOptions(detectOptions);
+        BenchmarkDetection(detectImages, resultsFile);
+        resultsFile << endl;
+
+        // full size again, with the scales spread over every core
+        detectOptions.m_MinFaceSize = 0;
+        detectOptions.m_DetectThreads = 0;
+        SetPreProcessOptions(detectOptions);
+        BenchmarkDetection(detectImages, resultsFile);
+        SetPreProcessOptions(PreProcessOptions());
+        resultsFile << endl;
+        /////////////////////////////////////////////////////////////////////////////////////////*/
+
         /*/////////////////////////////  Training //////////////////////////////////////////
         cout << "Starting the training procress" << endl;
 
@@ -83,49 +137,30 @@ int main( int argc, char** argv )
         int totalFound = 0;
         int totalNotFound = 0;
 
-        std::ifstream in(testFile.c_str());
-        if ( !in.is_open() )
-            throw std::string("Could not open test file");
-
         t = (double)cvGetTickCount();
-        char linebuffer[512];
         Database* db = new Database();
         db->Read(databaseName);
 
-        while (in.getline(linebuffer,512))
-        {
-            std::string line(linebuffer);
-            size_t pos1;
-            size_t pos2;
-
-            int trueid = 0;
-            std::string personName = "";
-            std::string probeFace = "";
+        std::vector<int>         trueIDs;
+        std::vector<std::string> probeFaces;
+        ReadTestFile(testFile, trueIDs, probeFaces);
 
-            // true person ID
-            pos1 = line.find_first_of(' ');
-            trueid = atoi(line.substr(0, pos1).c_str());
+        // score every probe against the loaded database, one probe per core
+        RecognizeResultVec results = RecognizeBatch(probeFaces, *db, false);
 
-            // person name
-            pos2 = pos1;
-            pos1 = line.find(' ', pos2+1);
-            personName = line.substr(pos2+1, pos1-pos2);
-
-            probeFace = line.substr(pos1+1, line.length()-pos1+1);
-
-            cout << "Attempting to recognize true id " << trueid << " name: " << personName << " image: "
-                 << probeFace << endl;
-
-            double distance = 0.0;
+        for ( size_t i = 0; i < results.size(); i++ )
+        {
+            cout << "Attempting to recognize true id " << trueIDs[i] << " image: "
+                 << results[i].m_ImageName << endl;
 
-            int idFound = 0;
+            if ( !results[i].m_Error.empty() )
+                cout << "Error: " << results[i].m_Error << endl;
 
-            std::string result = Recognize(probeFace.c_str(), databaseName.c_str(), distance, resultsDir, idFound, db, false );
             totalTested++;
 
-            cout << "Id found " << idFound << endl;
+            cout << "Id found " << results[i].m_ID << endl;
 
-            if ( trueid != idFound )
+            if ( trueIDs[i] != results[i].m_ID )
             {
                 totalNotFound++;
                 cout << "Could not find person" << endl;
@@ -133,10 +168,9 @@ int main( int argc, char** argv )
             else
             {
                 totalFound++;
-                cout << "Found: " << result << endl;
+                cout << "Found: " << results[i].m_PersonName << endl;
             }
-            cout << "Distance: " << distance << endl << endl;
-
+            cout << "Distance: " << results[i].m_Distance << endl << endl;
         }
 
         t = (double)cvGetTickCount() - t;
@@ -153,10 +187,27 @@ int main( int argc, char** argv )
         double percentNFound = 100.0 * ((double)totalNotFound/(double)totalTested);
         resultsFile << "Percent Found     : " << percentFound << endl;
         resultsFile << "Percent Not Found : " << percentNFound << endl;
-        in.close();
         delete db;
         /////////////////////////////////////////////////////////////////////////////////////////*/
 
+        /*///////////////////////////// other search modes against the exact scan /////////////////
+        SearchMode searchModes[] = { HNSWSearch, TreeSearch, PQSearch, SQ8Search, CentroidSearch, ProgressiveSearch };
+        for ( int i = 0; i < 6; i++ )
+            BenchmarkSearchMode(searchModes[i], databaseName, testFile, resultsFile);
+        /////////////////////////////////////////////////////////////////////////////////////////*/
+
+        /*///////////////////////////// 16 bit storage against float /////////////////////////////
+        cout << "Comparing float16 and bfloat16 storage with float" << endl;
+        resultsFile << "Comparing float16 and bfloat16 storage with float" << endl;
+
+        std::vector<int>         precisionIDs;
+        std::vector<std::string> precisionProbes;
+        ReadTestFile(testFile, precisionIDs, precisionProbes);
+
+        BenchmarkStoragePrecision(precisionProbes, precisionIDs, databaseName, resultsFile);
+        resultsFile << endl;
+        /////////////////////////////////////////////////////////////////////////////////////////*/
+
         /*////////////// do KMeans on original images ////////////////////////
         t = (double)cvGetTickCount();
         cout << "Starting KMeans on original images" << endl;
@@ -306,6 +357,12 @@ int main( int argc, char** argv )
         resultsFile << "Performed UPGMA on original images with Bray-Curtis Coefficient " << test_ms << " ms." << endl;
         ///////////////////////////////////////////////////////////////////// */
 
+        if ( FaceCache::IsOpen() )
+        {
+            resultsFile << "Face cache hits " << FaceCache::GetnHits() << ", misses " << FaceCache::GetnMisses() << endl;
+            FaceCache::Close();
+        }
+
         resultsFile.close();
     }
     catch ( std::string err )
@@ -322,7 +379,140 @@ int main( int argc, char** argv )
 
 void PrintUsage()
 {
-    cout << "EigenFace train.dat test.dat [database to write to] [results file]"  << std::endl;
+    cout << "EigenFace train.dat test.dat [database to write to] [results file] [optional face cache file]"  << std::endl;
+}
+
+
+
+/*
+   Function:   ReadTestFile
+   Purpose:    read the true id and image path of each probe in a test file
+   Notes:      each line is "id name path"
+   Throws      std::string if the test file cannot be opened
+*/
+void ReadTestFile(const std::string& testFile, std::vector<int>& trueIDs, std::vector<std::string>& probeFaces)
+{
+    std::ifstream in(testFile.c_str());
+    if ( !in.is_open() )
+        throw std::string("Could not open test file");
+
+    char linebuffer[512];
+    while (in.getline(linebuffer,512))
+    {
+        std::string line(linebuffer);
+        size_t pos1;
+        size_t pos2;
+
+        int trueid = 0;
+        std::string personName = "";
+        std::string probeFace = "";
+
+        // true person ID
+        pos1 = line.find_first_of(' ');
+        trueid = atoi(line.substr(0, pos1).c_str());
+
+        // person name
+        pos2 = pos1;
+        pos1 = line.find(' ', pos2+1);
+        personName = line.substr(pos2+1, pos1-pos2);
+
+        probeFace = line.substr(pos1+1, line.length()-pos1+1);
+
+        trueIDs.push_back(trueid);
+        probeFaces.push_back(probeFace);
+    }
+    in.close();
+}
+
+
+
+/*
+   Function:   BenchmarkSearchMode
+   Purpose:    compare one search mode with the exact scan over a range of its settings
+   Notes:      a fresh database is read for each mode so the settings of one mode
+               never leak into the next.  ProgressiveSearch is compared with the
+               full projection rather than the exact scan
+*/
+void BenchmarkSearchMode(SearchMode mode, const std::string& databaseName, const std::string& testFile, std::ostream& out)
+{
+    static const char* modeNames[] = { "exact", "HNSW", "VP tree", "product quantized", "int8", "centroid shortlist", "progressive" };
+
+    cout << "Comparing " << modeNames[mode] << " search with the exact scan" << endl;
+    out << "Comparing " << modeNames[mode] << " search with the exact scan" << endl;
+
+    std::vector<int>         probeIDs;
+    std::vector<std::string> probes;
+    ReadTestFile(testFile, probeIDs, probes);
+
+    Database db;
+    db.Read(databaseName);
+    if ( mode != ProgressiveSearch )
+        db.SetSearchMode(mode);
+
+    if ( mode == HNSWSearch )
+    {
+        int efValues[] = { 16, 32, 64, 128 };
+        for ( int i = 0; i < 4; i++ )
+        {
+            db.SetSearchEf(efValues[i]);
+            BenchmarkSearch(probes, db, out);
+            out << endl;
+        }
+    }
+    else if ( mode == PQSearch )
+    {
+        // 4 and 8 columns per byte are 16x and 32x smaller than the float gallery
+        int subspaceDims[] = { 4, 8 };
+        int reranks[] = { 0, 32 };
+        for ( int i = 0; i < 2; i++ )
+        {
+            for ( int j = 0; j < 2; j++ )
+            {
+                db.SetPQOptions(subspaceDims[i], reranks[j]);
+                db.BuildSearchData();
+                BenchmarkSearch(probes, db, out);
+                out << endl;
+            }
+        }
+    }
+    else if ( mode == SQ8Search )
+    {
+        int reranks[] = { 0, 4, 16 };
+        for ( int i = 0; i < 3; i++ )
+        {
+            db.SetSQ8Rerank(reranks[i]);
+            BenchmarkSearch(probes, db, out);
+            out << endl;
+        }
+    }
+    else if ( mode == CentroidSearch )
+    {
+        int shortlists[] = { 1, 3, 5, 10 };
+        for ( int i = 0; i < 4; i++ )
+        {
+            db.SetShortlistSize(shortlists[i]);
+            BenchmarkSearch(probes, db, out);
+            out << endl;
+        }
+    }
+    else if ( mode == ProgressiveSearch )
+    {
+        int chunks[] = { 8, 16, 32 };
+        for ( int i = 0; i < 3; i++ )
+        {
+            db.SetProgressiveOptions(chunks[i], 0.0);
+            BenchmarkProgressive(probes, db, out);
+            out << endl;
+        }
+        db.SetProgressiveOptions(16, 0.05);
+        BenchmarkProgressive(probes, db, out);
+        out << endl;
+    }
+    else
+    {
+        BenchmarkSearch(probes, db, out);
+        out << endl;
+    }
 }
 
 //#endif // EIGENFACE_TEST
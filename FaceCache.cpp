@@ -0,0 +1,397 @@
+#include "FaceCache.h"
+#include "FaceDetector.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+
+// start of the blob file, the last character goes up when a change to
+// preprocessing makes the faces already in the file out of date
+static const char FACE_CACHE_MAGIC[8] = { 'F', 'A', 'C', 'E', 'C', 'S', 'H', '1' };
+
+// FNV-1a, 64 bit
+static const FaceCache::Key FNV_OFFSET = 14695981039346656037ULL;
+static const FaceCache::Key FNV_PRIME = 1099511628211ULL;
+
+
+static FaceCache::Key HashBytes( FaceCache::Key hash, const void* data, size_t size )
+{
+    const uchar* bytes = (const uchar*)data;
+    for ( size_t i = 0; i < size; i++ )
+    {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+
+
+// fseek and ftell take a long, which is 32 bits on Windows
+static int SeekTo( FILE* file, FaceCache::Offset offset )
+{
+#ifdef _WIN32
+    return _fseeki64(file, offset, SEEK_SET);
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET);
+#endif
+}
+
+
+static FaceCache::Offset SeekToEnd( FILE* file )
+{
+#ifdef _WIN32
+    if ( _fseeki64(file, 0, SEEK_END) != 0 )
+        return -1;
+    return _ftelli64(file);
+#else
+    if ( fseeko(file, 0, SEEK_END) != 0 )
+        return -1;
+    return (FaceCache::Offset)ftello(file);
+#endif
+}
+
+
+
+////////////////////////////////////////////
+//            FaceCache class             //
+////////////////////////////////////////////
+
+FILE*                                           FaceCache::m_File = NULL;
+FaceCache::Offset                               FaceCache::m_End = 0;
+std::map<FaceCache::Key, FaceCache::Record>     FaceCache::m_Index;
+std::map<FaceCache::Key, FaceCache::Face>       FaceCache::m_Faces;
+std::list<FaceCache::Key>                       FaceCache::m_Recent;
+int                                             FaceCache::m_Capacity = 4096;
+int                                             FaceCache::m_nHits = 0;
+int                                             FaceCache::m_nMisses = 0;
+
+
+/*
+   Function:   Open
+   Purpose:    start caching faces in path
+   Notes:      the records already in the file are indexed but not read.  A record
+               cut short, by the program stopping while it was written, ends the
+               index and is written over by the next face
+   Throws      std::string if the file can not be opened or is not a face cache
+*/
+void FaceCache::Open( const std::string& path )
+{
+    Close();
+
+    bool bError = false;
+
+    #pragma omp critical(FaceCache)
+    {
+        m_File = fopen(path.c_str(), "r+b");
+        if ( !m_File )
+        {
+            m_File = fopen(path.c_str(), "w+b");
+            if ( m_File && fwrite(FACE_CACHE_MAGIC, sizeof(FACE_CACHE_MAGIC), 1, m_File) != 1 )
+                bError = true;
+        }
+        else
+        {
+            char magic[sizeof(FACE_CACHE_MAGIC)];
+            if ( fread(magic, sizeof(magic), 1, m_File) != 1 || memcmp(magic, FACE_CACHE_MAGIC, sizeof(magic)) != 0 )
+                bError = true;
+        }
+
+        if ( !m_File )
+            bError = true;
+
+        Offset fileSize = 0;
+        if ( !bError )
+            fileSize = std::max(SeekToEnd(m_File), (Offset)0);
+
+        m_End = (Offset)sizeof(FACE_CACHE_MAGIC);
+        while ( !bError && m_End + (Offset)(sizeof(Key) + 2*sizeof(int)) <= fileSize )
+        {
+            Key key;
+            int size[2];
+            if ( SeekTo(m_File, m_End) != 0 ||
+                 fread(&key, sizeof(key), 1, m_File) != 1 || fread(size, sizeof(size), 1, m_File) != 1 ||
+                 size[0] <= 0 || size[1] <= 0 )
+                break;
+
+            Record record;
+            record.m_Offset = m_End + (Offset)(sizeof(key) + sizeof(size));
+            record.m_Width = size[0];
+            record.m_Height = size[1];
+
+            Offset end = record.m_Offset + (Offset)size[0]*size[1];
+            if ( end > fileSize )
+                break;
+
+            m_Index[key] = record;
+            m_End = end;
+        }
+
+        if ( bError && m_File )
+        {
+            fclose(m_File);
+            m_File = NULL;
+        }
+    }
+
+    if ( bError )
+    {
+        std::string err;
+        err = "FaceCache could not open ";
+        err += path;
+        throw err;
+    }
+}
+
+
+
+void FaceCache::Close()
+{
+    #pragma omp critical(FaceCache)
+    {
+        if ( m_File )
+            fclose(m_File);
+        m_File = NULL;
+        m_Index.clear();
+        m_Faces.clear();
+        m_Recent.clear();
+    }
+}
+
+
+
+bool FaceCache::IsOpen()
+{
+    bool bOpen;
+
+    #pragma omp critical(FaceCache)
+    bOpen = m_File != NULL;
+
+    return bOpen;
+}
+
+
+
+void FaceCache::SetCapacity( int nFaces )
+{
+    #pragma omp critical(FaceCache)
+    {
+        m_Capacity = std::max(nFaces, 0);
+        while ( (int)m_Recent.size() > m_Capacity )
+        {
+            m_Faces.erase(m_Recent.back());
+            m_Recent.pop_back();
+        }
+    }
+}
+
+
+
+/*
+   Function:   MakeKey
+   Purpose:    hash the bytes of imagename, the options that change the face and the
+               cascade that finds it
+   Notes:      the file is read here, outside the critical section, so many threads
+               can hash at once.  bytes holds the whole file afterwards
+   Returns:    false if the file can not be read
+*/
+bool FaceCache::MakeKey( const char* imagename, const PreProcessOptions& options, Key& key, std::vector<uchar>& bytes )
+{
+    bytes.clear();
+
+    FILE* in = fopen(imagename, "rb");
+    if ( !in )
+        return false;
+
+    Offset size = SeekToEnd(in);
+    bool bOk = size >= 0 && SeekTo(in, 0) == 0;
+    if ( bOk && size > 0 )
+    {
+        bytes.resize((size_t)size);
+        bOk = fread(&bytes[0], bytes.size(), 1, in) == 1;
+    }
+    fclose(in);
+
+    Key hash = bytes.empty() ? FNV_OFFSET : HashBytes(FNV_OFFSET, &bytes[0], bytes.size());
+
+    int params[3];
+    params[0] = options.m_bSkipDetection ? 1 : 0;
+    params[1] = options.m_bSkipDetection ? 0 : options.m_MinFaceSize;
+    params[2] = (options.m_bSkipDetection || options.m_MinFaceSize <= 0) ? 0 : options.m_DetectWindow;
+    hash = HashBytes(hash, params, sizeof(params));
+
+    // a different cascade can find a different face
+    if ( !options.m_bSkipDetection )
+    {
+        const std::string& cascade = FaceDetector::GetCascadeName();
+        hash = HashBytes(hash, cascade.c_str(), cascade.size());
+    }
+    key = hash;
+
+    return bOk;
+}
+
+
+
+/*
+   Function:   Decode
+   Purpose:    turn the file bytes MakeKey read into an image, as cvLoadImage would
+   Returns:    a new 8 bit grey image the caller releases, NULL if it can not be decoded
+*/
+IplImage* FaceCache::Decode( const std::vector<uchar>& bytes )
+{
+    if ( bytes.empty() )
+        return NULL;
+
+    CvMat mat = cvMat(1, (int)bytes.size(), CV_8UC1, (void*)&bytes[0]);
+    return cvDecodeImage(&mat, CV_LOAD_IMAGE_GRAYSCALE);
+}
+
+
+
+/*
+   Function:   Find
+   Purpose:    look for a face in memory, then in the blob file
+   Returns:    a new image the caller releases, NULL if key is not cached
+*/
+IplImage* FaceCache::Find( Key key )
+{
+    IplImage* image = NULL;
+
+    #pragma omp critical(FaceCache)
+    {
+        std::map<Key, Face>::iterator it = m_Faces.find(key);
+        if ( it != m_Faces.end() )
+        {
+            m_Recent.splice(m_Recent.begin(), m_Recent, it->second.m_Use);
+            image = MakeImage(it->second);
+        }
+        else if ( m_File )
+        {
+            std::map<Key, Record>::iterator rec = m_Index.find(key);
+            if ( rec != m_Index.end() )
+            {
+                const Record& record = rec->second;
+                Face face;
+                face.m_Pixels.resize((size_t)record.m_Width*record.m_Height);
+                face.m_Width = record.m_Width;
+                face.m_Height = record.m_Height;
+                if ( SeekTo(m_File, record.m_Offset) == 0 && fread(&face.m_Pixels[0], face.m_Pixels.size(), 1, m_File) == 1 )
+                {
+                    image = MakeImage(face);
+                    Remember(key, &face.m_Pixels[0], face.m_Width, face.m_Height);
+                }
+            }
+        }
+
+        if ( image )
+            m_nHits++;
+        else
+            m_nMisses++;
+    }
+
+    return image;
+}
+
+
+
+/*
+   Function:   Insert
+   Purpose:    append a preprocessed 8 bit grey face to the blob file
+   Notes:      the file is flushed so a face is not lost if the program stops.  A face
+               that can not be written is still kept in memory
+*/
+void FaceCache::Insert( Key key, const IplImage* face )
+{
+    if ( !face || face->depth != IPL_DEPTH_8U || face->nChannels != 1 )
+        return;
+
+    std::vector<uchar> pixels((size_t)face->width*face->height);
+    for ( int y = 0; y < face->height; y++ )
+        memcpy(&pixels[(size_t)y*face->width], face->imageData + y*face->widthStep, face->width);
+
+    #pragma omp critical(FaceCache)
+    {
+        if ( m_File && m_Index.find(key) == m_Index.end() )
+        {
+            int size[2] = { face->width, face->height };
+            if ( SeekTo(m_File, m_End) == 0 &&
+                 fwrite(&key, sizeof(key), 1, m_File) == 1 &&
+                 fwrite(size, sizeof(size), 1, m_File) == 1 &&
+                 fwrite(&pixels[0], pixels.size(), 1, m_File) == 1 &&
+                 fflush(m_File) == 0 )
+            {
+                Record record;
+                record.m_Offset = m_End + (Offset)(sizeof(key) + sizeof(size));
+                record.m_Width = face->width;
+                record.m_Height = face->height;
+                m_Index[key] = record;
+                m_End = record.m_Offset + (Offset)pixels.size();
+            }
+        }
+
+        if ( m_File )
+            Remember(key, &pixels[0], face->width, face->height);
+    }
+}
+
+
+
+int FaceCache::GetnHits()
+{
+    return m_nHits;
+}
+
+
+int FaceCache::GetnMisses()
+{
+    return m_nMisses;
+}
+
+
+
+/*
+   Function:   Remember
+   Purpose:    keep a face in memory as the most recently used, dropping the least
+               recently used past m_Capacity
+   Notes:      called inside the critical section
+*/
+void FaceCache::Remember( Key key, const uchar* pixels, int width, int height )
+{
+    if ( m_Capacity <= 0 )
+        return;
+
+    std::map<Key, Face>::iterator it = m_Faces.find(key);
+    if ( it != m_Faces.end() )
+    {
+        m_Recent.splice(m_Recent.begin(), m_Recent, it->second.m_Use);
+        return;
+    }
+
+    m_Recent.push_front(key);
+    Face& face = m_Faces[key];
+    face.m_Pixels.assign(pixels, pixels + (size_t)width*height);
+    face.m_Width = width;
+    face.m_Height = height;
+    face.m_Use = m_Recent.begin();
+
+    while ( (int)m_Recent.size() > m_Capacity )
+    {
+        m_Faces.erase(m_Recent.back());
+        m_Recent.pop_back();
+    }
+}
+
+
+
+IplImage* FaceCache::MakeImage( const Face& face )
+{
+    IplImage* image = cvCreateImage(cvSize(face.m_Width, face.m_Height), IPL_DEPTH_8U, 1);
+    if ( !image )
+        return NULL;
+
+    for ( int y = 0; y < face.m_Height; y++ )
+        memcpy(image->imageData + y*image->widthStep, &face.m_Pixels[(size_t)y*face.m_Width], face.m_Width);
+
+    return image;
+}
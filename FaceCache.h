@@ -0,0 +1,87 @@
+#ifndef FACECACHE_H
+#define FACECACHE_H
+
+/*
+   FaceCache.h
+   Description:   Preprocessed faces kept on disk so an image is only detected and
+                  preprocessed once, however many times it is trained on, read back
+                  with a database or searched for
+   Author:        Chris Leighton
+
+*/
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Utilities.h"
+#include "PreProcess.h"
+
+
+// Faces are keyed by a hash of the image file's bytes, the options it was
+// preprocessed with and the cascade that found the face, so a renamed or copied
+// file still hits and an edited one does not.  Every face is appended to one blob file, the most recently used
+// are also kept in memory.  Nothing is cached until Open is called.  The
+// detection thread count is not part of the key, spreading the scales over
+// threads finds the same faces
+class FaceCache
+{
+public:
+    typedef unsigned long long Key;
+    typedef long long          Offset;     // blob files can pass 2GB, long is 32 bits on Windows
+
+    // use path as the blob file, creating it if it is not there
+    static void Open( const std::string& path );
+    static void Close();
+    static bool IsOpen();
+
+    // faces kept in memory as well as on disk
+    static void SetCapacity( int nFaces );
+
+    // key for imagename preprocessed with options, false if the file can not be read.
+    // The file is left in bytes so a face that is not cached can be made with Decode
+    // instead of reading the file again
+    static bool MakeKey( const char* imagename, const PreProcessOptions& options, Key& key, std::vector<uchar>& bytes );
+
+    // 8 bit grey image from the bytes of an image file, NULL if they are not an image
+    static IplImage* Decode( const std::vector<uchar>& bytes );
+
+    // a new copy of the face for key for the caller to release, NULL if it is not cached
+    static IplImage* Find( Key key );
+    static void Insert( Key key, const IplImage* face );
+
+    static int GetnHits();
+    static int GetnMisses();
+
+private:
+    struct Record
+    {
+        Offset  m_Offset;       // where the pixels start in the blob file
+        int     m_Width;
+        int     m_Height;
+    };
+
+    struct Face
+    {
+        std::vector<uchar>          m_Pixels;
+        int                         m_Width;
+        int                         m_Height;
+        std::list<Key>::iterator    m_Use;      // place in m_Recent
+    };
+
+    static void Remember( Key key, const uchar* pixels, int width, int height );
+    static IplImage* MakeImage( const Face& face );
+
+    static FILE*                    m_File;
+    static Offset                   m_End;      // where the next record is written
+    static std::map<Key, Record>    m_Index;    // every face in the file
+    static std::map<Key, Face>      m_Faces;    // faces in memory
+    static std::list<Key>           m_Recent;   // faces in memory, most recently used first
+    static int                      m_Capacity;
+    static int                      m_nHits;
+    static int                      m_nMisses;
+};
+
+
+#endif
@@ -1,24 +1,419 @@
 #include "FaceDetector.h"
+#include "HaarCascadeEmbed.h"
+#include <math.h>
+#include <algorithm>
 
 
 
-FaceDetector::FaceDetector( IplImage* image, bool isColor ) : m_Image(image), m_bIsColor(isColor), m_NewImage(NULL)
+////////////////////////////////////////////
+//         CascadeRegistry class          //
+////////////////////////////////////////////
+
+std::map<std::string, CascadeRegistry::Entry>   CascadeRegistry::m_Entries;
+bool                                            CascadeRegistry::m_bCaching = true;
+int                                             CascadeRegistry::m_nLoads = 0;
+
+
+/*
+   Function:   Acquire
+   Purpose:    borrow a cascade for path
+   Notes:      the registry is shared by the OpenMP workers so it is only touched
+               inside the critical section.  Parsing the file and copying the parsed
+               cascade are done there too, they only happen until every worker has
+               its own copy
+   Throws      std::string if the file can not be loaded
+*/
+CvHaarClassifierCascade* CascadeRegistry::Acquire( const std::string& path )
 {
-    m_Cascade = NULL;
-    m_Cascade = (CvHaarClassifierCascade*)cvLoad( HAAR_CASCADE_FRONTAL_FILENAME.c_str(),0,0,0);
+    CvHaarClassifierCascade* cascade = NULL;
+
+    #pragma omp critical(CascadeRegistry)
+    {
+        if ( !m_bCaching )
+        {
+            cascade = LoadCascade(path);
+            m_nLoads++;
+        }
+        else
+        {
+            Entry& entry = m_Entries[path];
+            if ( !entry.m_Master )
+            {
+                entry.m_Master = LoadCascade(path);
+                m_nLoads++;
+            }
 
-    if ( !m_Cascade )
+            if ( !entry.m_Free.empty() )
+            {
+                cascade = entry.m_Free.back();
+                entry.m_Free.pop_back();
+            }
+            else if ( entry.m_Master )
+            {
+                cascade = (CvHaarClassifierCascade*)cvClone(entry.m_Master);
+            }
+
+            if ( !entry.m_Master )
+                m_Entries.erase(path);
+        }
+    }
+
+    if ( !cascade )
         throw std::string("FaceDetector constructor could not create cascade.  Check path?");
 
+    return cascade;
+}
+
+
+
+/*
+   Function:   LoadCascade
+   Purpose:    build a cascade compiled into the program or read it from a file
+   Returns:    NULL if it can not be loaded
+*/
+CvHaarClassifierCascade* CascadeRegistry::LoadCascade( const std::string& path )
+{
+    CvHaarClassifierCascade* cascade = NULL;
+    try
+    {
+        cascade = LoadEmbeddedCascade(path);
+    }
+    catch ( std::string )
+    {
+        return NULL;
+    }
+
+    if ( cascade )
+        return cascade;
+
+    return (CvHaarClassifierCascade*)cvLoad( path.c_str(),0,0,0);
+}
+
+
+
+/*
+   Function:   Release
+   Purpose:    give back a cascade from Acquire
+*/
+void CascadeRegistry::Release( const std::string& path, CvHaarClassifierCascade* cascade )
+{
+    if ( !cascade )
+        return;
+
+    #pragma omp critical(CascadeRegistry)
+    {
+        std::map<std::string, Entry>::iterator it = m_Entries.find(path);
+        if ( m_bCaching && it != m_Entries.end() )
+            it->second.m_Free.push_back(cascade);
+        else
+            cvReleaseHaarClassifierCascade(&cascade);
+    }
+}
+
+
+
+void CascadeRegistry::Clear()
+{
+    #pragma omp critical(CascadeRegistry)
+    {
+        FreeEntries();
+    }
+}
+
+
+
+/*
+   Function:   FreeEntries
+   Purpose:    release every cascade in the registry
+   Notes:      the caller must be in the CascadeRegistry critical section, OpenMP
+               critical sections do not nest so this can not take it itself
+*/
+void CascadeRegistry::FreeEntries()
+{
+    for ( std::map<std::string, Entry>::iterator it = m_Entries.begin(); it != m_Entries.end(); it++ )
+    {
+        for ( size_t i = 0; i < it->second.m_Free.size(); i++ )
+            cvReleaseHaarClassifierCascade(&it->second.m_Free[i]);
+        if ( it->second.m_Master )
+            cvReleaseHaarClassifierCascade(&it->second.m_Master);
+    }
+    m_Entries.clear();
+}
+
+
+
+void CascadeRegistry::SetCaching( bool b )
+{
+    // Acquire and Release read the flag in the critical section, so it changes there too
+    #pragma omp critical(CascadeRegistry)
+    {
+        if ( !b )
+            FreeEntries();
+
+        m_bCaching = b;
+    }
+}
+
+
+
+int CascadeRegistry::GetnLoads()
+{
+    int nLoads = 0;
+
+    #pragma omp critical(CascadeRegistry)
+    {
+        nLoads = m_nLoads;
+    }
+    return nLoads;
+}
+
+
+
+////////////////////////////////////////////
+//           FaceDetector class           //
+////////////////////////////////////////////
+
+// the compiled in cascade needs no file, otherwise use the one on disk
+#ifdef HAAR_CASCADE_EMBEDDED
+static const std::string FACE_CASCADE_NAME = HAAR_CASCADE_EMBEDDED_FRONTAL;
+#else
+static const std::string FACE_CASCADE_NAME = HAAR_CASCADE_FRONTAL_FILENAME;
+#endif
+
+FaceDetector::FaceDetector( IplImage* image, bool isColor ) : m_Image(image), m_bIsColor(isColor), m_Cascade(NULL),
+                                                              m_CascadeName(FACE_CASCADE_NAME),
+                                                              m_MinFaceSize(0), m_DetectWindow(0), m_nThreads(1), m_bLightweight(false), m_NewImage(NULL)
+{
     if ( !m_Image )
         throw std::string("FaceDetector needs an image to work on");
+
+    m_Cascade = CascadeRegistry::Acquire(m_CascadeName);
 }
 
 FaceDetector::~FaceDetector()
 {
     Reset();
+    CascadeRegistry::Release(m_CascadeName, m_Cascade);
+}
+
+const std::string& FaceDetector::GetCascadeName()
+{
+    return FACE_CASCADE_NAME;
+}
+
+/*
+   Function:   SetDownscale
+   Purpose:    detect on a smaller copy of the image
+   Arguments:  1) smallest face to find, in pixels of the image 2) size that face is
+               shrunk to before detecting, it should not be below the cascade's own
+               window (20 for the frontal cascade).  0 for either detects at full size
+   Notes:      the image is only ever shrunk, never enlarged
+*/
+void FaceDetector::SetDownscale( int minFaceSize, int detectWindow )
+{
+    m_MinFaceSize = minFaceSize;
+    m_DetectWindow = detectWindow;
+}
+
+
+
+/*
+   Function:   SetThreads
+   Purpose:    number of threads Detect spreads the scales over, 0 uses one per core
+               and 1 (the default) detects on this thread only
+*/
+void FaceDetector::SetThreads( int nThreads )
+{
+    m_nThreads = nThreads;
+}
+
+
+
+/*
+   Function:   DetectParallel
+   Purpose:    run the cascade over bands of scales on several threads
+   Notes:      cvHaarDetectObjects tries window sizes cvRound(window*1.1^k) and skips
+               those outside [min_size, max_size], so giving each thread a run of
+               consecutive sizes covers every scale exactly once.  Runs are chosen so
+               each has about the same number of windows to test, the small scales
+               cost the most.  Every thread borrows its own cascade since OpenCV keeps
+               per image data in it.  The threads do not group their candidates
+               (min_neighbors 0), they are grouped together afterwards with the same
+               threshold and eps cvHaarDetectObjects uses, so the result matches the
+               serial path.  FIND_BIGGEST is done after grouping, with the flags
+               cvHaarDetectObjects would have searched with
+*/
+void FaceDetector::DetectParallel( IplImage* image, int flags, CvSize minSize, std::vector<CvRect>& rects )
+{
+    const double scaleFactor = 1.1;
+    const int minNeighbours = 2;
+    const double groupEps = 0.2;
+
+    // cvHaarDetectObjects drops Canny pruning and image scaling when it looks for
+    // the biggest object, so the bands drop them too or they would test fewer windows
+    bool bBiggest = (flags & CV_HAAR_FIND_BIGGEST_OBJECT) != 0;
+    if ( bBiggest )
+        flags &= ~(CV_HAAR_SCALE_IMAGE | CV_HAAR_DO_CANNY_PRUNING);
+    flags &= ~CV_HAAR_FIND_BIGGEST_OBJECT;
+
+    // every window size the serial search would try, and roughly what each costs
+    CvSize window = m_Cascade->orig_window_size;
+    std::vector<CvSize> sizes;
+    std::vector<double> costs;
+    double totalCost = 0.0;
+    for ( double factor = 1.0; factor*window.width < image->width - 10 && factor*window.height < image->height - 10; factor *= scaleFactor )
+    {
+        CvSize size = cvSize(cvRound(window.width*factor), cvRound(window.height*factor));
+        if ( size.width < minSize.width || size.height < minSize.height )
+            continue;
+
+        double cost = (double)(image->width - size.width) * (image->height - size.height) / (factor*factor);
+        sizes.push_back(size);
+        costs.push_back(cost);
+        totalCost += cost;
+    }
+
+    rects.clear();
+    if ( sizes.empty() )
+        return;
+
+    int nWorkers = std::min(GetNumWorkers(m_nThreads), (int)sizes.size());
+
+    // split the sizes into nWorkers runs of about equal cost
+    std::vector<int> firstSize(1, 0);
+    double cost = 0.0;
+    for ( int i = 0; i < (int)sizes.size() && (int)firstSize.size() < nWorkers; i++ )
+    {
+        cost += costs[i];
+        if ( cost >= totalCost * firstSize.size() / nWorkers && i + 1 < (int)sizes.size() )
+            firstSize.push_back(i + 1);
+    }
+    firstSize.push_back((int)sizes.size());
+    int nBands = (int)firstSize.size() - 1;
+
+    std::vector< std::vector<cv::Rect> > bandRects(nBands);
+    std::vector<std::string> errors(nBands);
+
+    // an exception can not leave the parallel region, each band records its error
+    // and the first one is thrown once every worker is done
+    #pragma omp parallel num_threads(nWorkers)
+    {
+        // the calling thread is worker 0, m_Cascade is idle until we return so it uses that
+        int thread = 0;
+#ifdef _OPENMP
+        thread = omp_get_thread_num();
+#endif
+        CvHaarClassifierCascade* cascade = thread == 0 ? m_Cascade : NULL;
+        CvMemStorage* storage = NULL;
+
+        #pragma omp for schedule(dynamic)
+        for ( int band = 0; band < nBands; band++ )
+        {
+            try
+            {
+                if ( !cascade )
+                    cascade = CascadeRegistry::Acquire(m_CascadeName);
+                if ( !storage )
+                    storage = cvCreateMemStorage(0);
+                else
+                    cvClearMemStorage(storage);
+
+                CvSize bandMin = sizes[firstSize[band]];
+                CvSize bandMax = sizes[firstSize[band+1] - 1];
+                CvSeq* faces = cvHaarDetectObjects(image, cascade, storage, scaleFactor, 0, flags, bandMin, bandMax);
+
+                for ( int i = 0; faces && i < faces->total; i++ )
+                {
+                    CvRect r = *(CvRect*)cvGetSeqElem(faces, i);
+                    bandRects[band].push_back(cv::Rect(r.x, r.y, r.width, r.height));
+                }
+            }
+            catch ( std::string err )
+            {
+                errors[band] = err;
+            }
+            catch ( cv::Exception& e )
+            {
+                errors[band] = std::string("FaceDetector::DetectParallel - ") + e.what();
+            }
+            catch ( ... )
+            {
+                errors[band] = "FaceDetector::DetectParallel - detection failed";
+            }
+        }
+
+        if ( storage )
+            cvReleaseMemStorage(&storage);
+        if ( cascade != m_Cascade )
+            CascadeRegistry::Release(m_CascadeName, cascade);
+    }
+
+    for ( int band = 0; band < nBands; band++ )
+    {
+        if ( !errors[band].empty() )
+            throw errors[band];
+    }
+
+    std::vector<cv::Rect> candidates;
+    for ( int band = 0; band < nBands; band++ )
+        candidates.insert(candidates.end(), bandRects[band].begin(), bandRects[band].end());
+
+    cv::groupRectangles(candidates, minNeighbours, groupEps);
+
+    for ( size_t i = 0; i < candidates.size(); i++ )
+        rects.push_back(cvRect(candidates[i].x, candidates[i].y, candidates[i].width, candidates[i].height));
+
+    if ( bBiggest && rects.size() > 1 )
+    {
+        size_t biggest = 0;
+        for ( size_t i = 1; i < rects.size(); i++ )
+        {
+            if ( rects[i].width*rects[i].height > rects[biggest].width*rects[biggest].height )
+                biggest = i;
+        }
+        rects[0] = rects[biggest];
+        rects.resize(1);
+    }
+}
+
+
+
+/*
+   Function:   SetLightweight
+   Purpose:    only find the rectangles, GetNewImage and GetFaceVec stay empty and
+               the faces are read through GetFaceView
+*/
+void FaceDetector::SetLightweight( bool b )
+{
+    m_bLightweight = b;
 }
 
+
+
+/*
+   Function:   GetFaceView
+   Purpose:    a header over face i inside the image we were given, nothing is copied
+   Notes:      the view is only good while that image is
+   Returns:    view, or NULL if there is no face i
+*/
+CvMat* FaceDetector::GetFaceView( int i, CvMat* view )
+{
+    if ( i < 0 || i >= (int)m_FaceRects.size() )
+        return NULL;
+
+    return cvGetSubRect(m_Image, view, m_FaceRects[i]);
+}
+
+
+
+/*
+   Function:   Detect
+   Purpose:    find the faces in the image
+   Notes:      with SetDownscale the cascade runs on a shrunk copy of the image and
+               the rectangles are mapped back, the faces are still cut from the
+               full size image
+   Returns:    number of faces found
+*/
 int FaceDetector::Detect(bool bOnlyFindLargest)
 {
     int nFaces = 0;
@@ -38,60 +433,119 @@ int FaceDetector::Detect(bool bOnlyFindLargest)
     if ( bOnlyFindLargest )
         flags |= CV_HAAR_FIND_BIGGEST_OBJECT;
 
-    faces = cvHaarDetectObjects(m_Image,m_Cascade,storage,1.1,2,flags);
-    if ( faces )
+    // how much to shrink the image so the smallest face we want fills the detect window
+    double scale = 1.0;
+    if ( m_MinFaceSize > 0 && m_DetectWindow > 0 && m_DetectWindow < m_MinFaceSize )
+        scale = (double)m_DetectWindow / (double)m_MinFaceSize;
+
+    // cvHaarDetectObjects and cvResize throw cv::Exception, the image and storage
+    // are ours to free whichever way we leave
+    IplImage* small = NULL;
+    try
     {
-        if ( !bOnlyFindLargest )
+        if ( scale < 1.0 )
         {
-            nFaces = faces->total;
+            CvSize size = cvSize(std::max(1, cvRound(m_Image->width*scale)), std::max(1, cvRound(m_Image->height*scale)));
+            small = cvCreateImage(size, m_Image->depth, m_Image->nChannels);
+            if ( !small )
+                throw std::string("FaceDetector::Detect could not create reduced image");
 
-            for ( int i = 0; i < nFaces; i++ )
-            {
-                CvRect* r = (CvRect*)cvGetSeqElem(faces,i);
-                m_Rects.push_back(r);
-            }
+            cvResize(m_Image, small, CV_INTER_AREA);
+            minFeatureSize = cvSize(m_DetectWindow, m_DetectWindow);
         }
         else
+            minFeatureSize = cvSize(0, 0);
+
+        IplImage* detectImage = small ? small : m_Image;
+        std::vector<CvRect> found;
+
+        // threads only help if we are not already one of many workers
+        bool bParallel = GetNumWorkers(m_nThreads) > 1;
+#ifdef _OPENMP
+        bParallel = bParallel && !omp_in_parallel();
+#endif
+
+        if ( bParallel )
         {
-            if ( faces->total > 0 )
+            DetectParallel(detectImage, flags, minFeatureSize, found);
+        }
+        else
+        {
+            faces = cvHaarDetectObjects(detectImage,m_Cascade,storage,1.1,2,flags,minFeatureSize);
+            for ( int i = 0; faces && i < faces->total; i++ )
+                found.push_back(*(CvRect*)cvGetSeqElem(faces,i));
+        }
+
+        if ( bParallel || faces )
+        {
+            int nKeep = bOnlyFindLargest ? std::min((int)found.size(), 1) : (int)found.size();
+            nFaces = nKeep;
+
+            // copy the rectangles, in full size image coordinates
+            for ( int i = 0; i < nKeep; i++ )
             {
-                nFaces = 1;
-                CvRect* r = (CvRect*)cvGetSeqElem(faces,0);
-                m_Rects.push_back(r);
+                CvRect r = found[i];
+                if ( small )
+                {
+                    int x0 = std::max(0, (int)floor(r.x / scale));
+                    int y0 = std::max(0, (int)floor(r.y / scale));
+                    int x1 = std::min(m_Image->width, (int)ceil((r.x + r.width) / scale));
+                    int y1 = std::min(m_Image->height, (int)ceil((r.y + r.height) / scale));
+                    r = cvRect(x0, y0, x1 - x0, y1 - y0);
+                }
+                m_FaceRects.push_back(r);
             }
-        }
 
+            for ( size_t i = 0; i < m_FaceRects.size(); i++ )
+                m_Rects.push_back(&m_FaceRects[i]);
+        }
 
-        // now draw the rectanges on the new image
-        m_NewImage = cvCreateImage(cvSize(m_Image->width,m_Image->height),8,(m_bIsColor ? 3 : 1));
+        // the annotated image and the face copies are only made if someone wants them
+        if ( (bParallel || faces) && !m_bLightweight )
+        {
+            // now draw the rectanges on the new image
+            m_NewImage = cvCreateImage(cvSize(m_Image->width,m_Image->height),8,(m_bIsColor ? 3 : 1));
 
-        if ( !m_NewImage )
-            throw std::string("FaceDetector::Detect could not create new image");
+            if ( !m_NewImage )
+                throw std::string("FaceDetector::Detect could not create new image");
 
-        cvCopy(m_Image,m_NewImage,NULL);
+            cvCopy(m_Image,m_NewImage,NULL);
 
-        for ( size_t i = 0; i < m_Rects.size(); i++ )
-        {
-            pt1.x = m_Rects[i]->x;
-            pt2.x = m_Rects[i]->x+m_Rects[i]->width;
-            pt1.y=m_Rects[i]->y;
-            pt2.y=m_Rects[i]->y+m_Rects[i]->height;
+            for ( size_t i = 0; i < m_Rects.size(); i++ )
+            {
+                pt1.x = m_Rects[i]->x;
+                pt2.x = m_Rects[i]->x+m_Rects[i]->width;
+                pt1.y=m_Rects[i]->y;
+                pt2.y=m_Rects[i]->y+m_Rects[i]->height;
 
-            cvRectangle(m_NewImage, pt1, pt2, CV_RGB(255,0,0), 3,8,0);  // draw red rectangle
+                cvRectangle(m_NewImage, pt1, pt2, CV_RGB(255,0,0), 3,8,0);  // draw red rectangle
 
-            // create face for storage
-            IplImage* tempface = NULL;
-            tempface = cvCreateImage(cvSize(m_Rects[i]->width,m_Rects[i]->height),m_Image->depth, m_Image->nChannels);
+                // create face for storage
+                IplImage* tempface = NULL;
+                tempface = cvCreateImage(cvSize(m_Rects[i]->width,m_Rects[i]->height),m_Image->depth, m_Image->nChannels);
 
-            if ( !tempface )
-                throw std::string("FaceDetector::Detect could not create new face image");
+                if ( !tempface )
+                    throw std::string("FaceDetector::Detect could not create new face image");
 
-            cvSetImageROI( m_Image, *m_Rects[i] );
-            cvCopy(m_Image,tempface);
-            m_Faces.push_back(tempface);
-            cvResetImageROI( m_Image );
+                cvSetImageROI( m_Image, *m_Rects[i] );
+                cvCopy(m_Image,tempface);
+                m_Faces.push_back(tempface);
+                cvResetImageROI( m_Image );
+            }
         }
     }
+    catch ( ... )
+    {
+        if ( small )
+            cvReleaseImage(&small);
+        cvReleaseMemStorage(&storage);
+        throw;
+    }
+
+    if ( small )
+        cvReleaseImage(&small);
+    cvReleaseMemStorage(&storage);
+
     return nFaces;
 }
 
@@ -108,6 +562,7 @@ void FaceDetector::Reset()
         cvReleaseImage(&(*it));
 
     m_Rects.clear();
+    m_FaceRects.clear();
     m_Faces.clear();
 }
 
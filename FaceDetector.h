@@ -11,6 +11,7 @@
 #define FACEDETECTOR_H
 
 #include <iostream>
+#include <map>
 #include <string>
 #include <vector>
 
@@ -25,6 +26,42 @@
 static std::string HAAR_CASCADE_FRONTAL_FILENAME = "C:\\Program Files\\OpenCV2.2\\data\\haarcascades\\haarcascade_frontalface_alt.xml";
 static std::string HAAR_CASCADE_PROFILE_FILENAME = "//root//OpenCV-2.2.0//data//haarcascades//haarcascade_profileface.xml";
 
+// Haar cascades parsed once per file and shared by every FaceDetector.
+// cvHaarDetectObjects keeps scratch data for the image it is working on inside
+// the cascade, so a detector borrows its own copy of the parsed cascade and hands
+// it back when it is done.  Copies are kept for the next detector so after start
+// up there is one copy per thread detecting at the same time
+class CascadeRegistry
+{
+public:
+    // a cascade for path, loading the file the first time it is asked for.  path can
+    // also be the name of a cascade compiled into the program (HaarCascadeEmbed.h)
+    static CvHaarClassifierCascade* Acquire( const std::string& path );
+    static void Release( const std::string& path, CvHaarClassifierCascade* cascade );
+
+    // free every cascade, none may be borrowed
+    static void Clear();
+
+    // with caching off every Acquire reads the file like before, for benchmarks
+    static void SetCaching( bool b );
+    static int  GetnLoads();    // times a cascade file has been parsed
+
+private:
+    static CvHaarClassifierCascade* LoadCascade( const std::string& path );
+    static void FreeEntries();
+
+    struct Entry
+    {
+        CvHaarClassifierCascade*                m_Master;   // never detected with, copies are made from it
+        std::vector<CvHaarClassifierCascade*>   m_Free;     // copies not borrowed at the moment
+    };
+
+    static std::map<std::string, Entry>     m_Entries;
+    static bool                             m_bCaching;
+    static int                              m_nLoads;
+};
+
+
 class FaceDetector
 {
 public:
@@ -33,6 +70,22 @@ public:
 
     int Detect(bool bOnlyFindLargest = false); // detect faces in image, return number of faces found
 
+    // the cascade every detector is made with, a file path or an embedded name
+    static const std::string& GetCascadeName();
+
+    // shrink the image so a face of minFaceSize pixels becomes detectWindow pixels
+    // before detecting, the faces found are still cut from the full size image
+    void SetDownscale( int minFaceSize, int detectWindow );
+
+    // spread the scales over nThreads threads, 0 for one per core.  Ignored when
+    // we are already running on one of many OpenMP workers
+    void SetThreads( int nThreads );
+
+    // skip the annotated image and the copies of the faces, read the faces in place
+    // with GetFaceView instead
+    void SetLightweight( bool b );
+    CvMat* GetFaceView( int i, CvMat* view );
+
     const IplImage* GetNewImage()
     {
         return m_NewImage;
@@ -50,15 +103,22 @@ public:
 private:
     IplImage*                 m_Image;
     bool                       m_bIsColor;
-    CvHaarClassifierCascade*   m_Cascade;
+    CvHaarClassifierCascade*   m_Cascade;   // borrowed from CascadeRegistry
+    std::string                m_CascadeName;
+    int                        m_MinFaceSize;   // 0 detects at full size
+    int                        m_DetectWindow;
+    int                        m_nThreads;      // 1 detects on the calling thread
+    bool                       m_bLightweight;  // rectangles only, no m_NewImage or m_Faces
 
     // results
     // store the CvRects representing the faces
-    RectVec                    m_Rects;     // stored coordinates for where we found the faces
+    RectVec                    m_Rects;     // stored coordinates for where we found the faces, point into m_FaceRects
+    std::vector<CvRect>        m_FaceRects;
     IplImage*                  m_NewImage;  // same as old image with rectangles drawn on it
     ImageVec                   m_Faces;     // each face found
     // Get ready for different image
     void Reset();
+    void DetectParallel( IplImage* image, int flags, CvSize minSize, std::vector<CvRect>& rects );
 
 };
 
@@ -0,0 +1,515 @@
+#include "HNSWIndex.h"
+#include <float.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <queue>
+
+
+static const char HNSW_MAGIC[4] = { 'H', 'N', 'S', 'W' };
+static const int  HNSW_VERSION  = 1;
+static const int  HNSW_MAX_LEVEL = 32;     // RandomLevel can't go past 24
+
+
+// FNV-1a over the gallery so a graph saved for an older database is not reused
+static int GalleryChecksum( const float* data, int nRows, int nCols )
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    size_t n = (size_t)nRows*nCols*sizeof(float);
+    unsigned int hash = 2166136261u;
+
+    for ( size_t i = 0; i < n; i++ )
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return (int)hash;
+}
+
+
+// a link list read from disk is used to index the graph, so every count and
+// row must be in range and every row must reach the level it is linked on
+static bool LinksInRange( const int* links, int maxLinks, int level, const std::vector<int>& levels )
+{
+    if ( links[0] < 0 || links[0] > maxLinks )
+        return false;
+
+    for ( int j = 1; j <= links[0]; j++ )
+    {
+        if ( links[j] < 0 || links[j] >= (int)levels.size() || levels[links[j]] < level )
+            return false;
+    }
+    return true;
+}
+
+
+
+////////////////////////////////////////////
+//           helpers                      //
+////////////////////////////////////////////
+
+// puts the closest neighbour on top of a priority_queue
+struct CloserFirst
+{
+    bool operator()( const Neighbour& a, const Neighbour& b ) const { return a.m_Distance > b.m_Distance; }
+};
+
+typedef std::priority_queue<Neighbour>                                              FurthestQueue;
+typedef std::priority_queue<Neighbour, std::vector<Neighbour>, CloserFirst>        ClosestQueue;
+
+
+////////////////////////////////////////////
+//           HNSWIndex class              //
+////////////////////////////////////////////
+
+HNSWIndex::HNSWIndex( int M, int efConstruction ) : m_pData(NULL), m_pWeights(NULL), m_nRows(0), m_nCols(0),
+                      m_M(M), m_MaxM0(2*M), m_EfConstruction(efConstruction), m_Seed(100),
+                      m_EntryPoint(-1), m_MaxLevel(-1)
+{
+    m_LevelMult = 1.0 / log((double)std::max(M, 2));
+}
+
+
+HNSWIndex::~HNSWIndex()
+{
+    Clear();
+}
+
+
+void HNSWIndex::Clear()
+{
+    m_nRows = 0;
+    m_EntryPoint = -1;
+    m_MaxLevel = -1;
+    m_Seed = 100;
+    m_Levels.clear();
+    m_Level0.clear();
+    m_Upper.clear();
+
+    // the tags are sized for the old rows
+    for ( size_t i = 0; i < m_FreeVisited.size(); i++ )
+        delete m_FreeVisited[i];
+    m_FreeVisited.clear();
+}
+
+
+
+/*
+   Function:   AcquireVisited
+   Purpose:    visited set for one search, reused from an earlier search if one is free
+   Notes:      the pool is shared by every thread so it is only touched in the critical section
+*/
+HNSWIndex::VisitedTags* HNSWIndex::AcquireVisited() const
+{
+    VisitedTags* visited = NULL;
+
+    #pragma omp critical(HNSWVisited)
+    {
+        if ( !m_FreeVisited.empty() )
+        {
+            visited = m_FreeVisited.back();
+            m_FreeVisited.pop_back();
+        }
+    }
+
+    if ( !visited )
+    {
+        visited = new VisitedTags;
+        visited->m_Tags.assign(m_nRows, 0);
+        visited->m_Epoch = 0;
+    }
+    return visited;
+}
+
+
+
+void HNSWIndex::ReleaseVisited( VisitedTags* visited ) const
+{
+    #pragma omp critical(HNSWVisited)
+    {
+        m_FreeVisited.push_back(visited);
+    }
+}
+
+
+
+/*
+   Function:   Build
+   Purpose:    insert every row of data into the graph
+   Notes:      data and weights are not copied, they must live as long as the index
+*/
+void HNSWIndex::Build( const float* data, int nRows, int nCols, const float* weights )
+{
+    Clear();
+
+    m_pData = data;
+    m_pWeights = weights;
+    m_nCols = nCols;
+    m_nRows = nRows;
+
+    m_Levels.assign(nRows, 0);
+    m_Level0.assign((size_t)nRows*(m_MaxM0+1), 0);
+    m_Upper.resize(nRows);
+
+    VisitedTags* visited = AcquireVisited();
+
+    for ( int row = 0; row < nRows; row++ )
+    {
+        int level = RandomLevel();
+        m_Levels[row] = level;
+        m_Upper[row].assign((size_t)level*(m_M+1), 0);
+
+        if ( m_EntryPoint < 0 )
+        {
+            m_EntryPoint = row;
+            m_MaxLevel = level;
+            continue;
+        }
+
+        const float* face = m_pData + (size_t)row*m_nCols;
+        int entry = m_EntryPoint;
+        NeighbourVec found;
+
+        // walk down to the top level of the new row taking the closest node each time
+        for ( int lc = m_MaxLevel; lc > level; lc-- )
+        {
+            SearchLayer(face, entry, 1, lc, *visited, found);
+            entry = found[0].m_Index;
+        }
+
+        for ( int lc = std::min(level, m_MaxLevel); lc >= 0; lc-- )
+        {
+            int maxLinks = lc == 0 ? m_MaxM0 : m_M;
+
+            SearchLayer(face, entry, m_EfConstruction, lc, *visited, found);
+            entry = found[0].m_Index;
+
+            NeighbourVec selected = found;
+            SelectNeighbours(selected, m_M);
+
+            int* links = GetLinks(row, lc);
+            links[0] = (int)selected.size();
+            for ( size_t i = 0; i < selected.size(); i++ )
+                links[i+1] = selected[i].m_Index;
+
+            // link back from each neighbour, shrinking its list if it is full
+            for ( size_t i = 0; i < selected.size(); i++ )
+            {
+                int other = selected[i].m_Index;
+                int* otherLinks = GetLinks(other, lc);
+
+                if ( otherLinks[0] < maxLinks )
+                {
+                    otherLinks[++otherLinks[0]] = row;
+                    continue;
+                }
+
+                const float* otherFace = m_pData + (size_t)other*m_nCols;
+                NeighbourVec candidates;
+                Neighbour n;
+                n.m_Index = row;
+                n.m_Distance = selected[i].m_Distance;
+                candidates.push_back(n);
+                for ( int j = 1; j <= otherLinks[0]; j++ )
+                {
+                    n.m_Index = otherLinks[j];
+                    n.m_Distance = Distance(otherFace, otherLinks[j]);
+                    candidates.push_back(n);
+                }
+                std::sort(candidates.begin(), candidates.end());
+                SelectNeighbours(candidates, maxLinks);
+
+                otherLinks[0] = (int)candidates.size();
+                for ( size_t j = 0; j < candidates.size(); j++ )
+                    otherLinks[j+1] = candidates[j].m_Index;
+            }
+        }
+
+        if ( level > m_MaxLevel )
+        {
+            m_MaxLevel = level;
+            m_EntryPoint = row;
+        }
+    }
+
+    ReleaseVisited(visited);
+}
+
+
+
+/*
+   Function:   Search
+   Purpose:    approximate k nearest rows to query
+   Notes:      neighbours hold squared distances, closest first.  Safe to call from
+               many threads at once
+*/
+void HNSWIndex::Search( const float* query, int k, int ef, NeighbourVec& neighbours ) const
+{
+    neighbours.clear();
+    if ( m_EntryPoint < 0 || k <= 0 )
+        return;
+
+    int entry = m_EntryPoint;
+    NeighbourVec found;
+    VisitedTags* visited = AcquireVisited();
+
+    for ( int lc = m_MaxLevel; lc > 0; lc-- )
+    {
+        SearchLayer(query, entry, 1, lc, *visited, found);
+        entry = found[0].m_Index;
+    }
+
+    SearchLayer(query, entry, std::max(ef, k), 0, *visited, found);
+    ReleaseVisited(visited);
+
+    if ( (int)found.size() > k )
+        found.resize(k);
+    neighbours.swap(found);
+}
+
+
+
+/*
+   Function:   SearchLayer
+   Purpose:    best first search of one level of the graph
+   Notes:      found is sorted closest first and holds at most ef rows
+*/
+void HNSWIndex::SearchLayer( const float* query, int entry, int ef, int level, VisitedTags& visited, NeighbourVec& found ) const
+{
+    // a new epoch empties the set, only when it wraps do the tags need clearing
+    if ( ++visited.m_Epoch == 0 )
+    {
+        std::fill(visited.m_Tags.begin(), visited.m_Tags.end(), 0u);
+        visited.m_Epoch = 1;
+    }
+    unsigned int epoch = visited.m_Epoch;
+    unsigned int* tags = &visited.m_Tags[0];
+
+    ClosestQueue candidates;
+    FurthestQueue results;
+
+    Neighbour n;
+    n.m_Index = entry;
+    n.m_Distance = Distance(query, entry);
+    tags[entry] = epoch;
+    candidates.push(n);
+    results.push(n);
+
+    while ( !candidates.empty() )
+    {
+        Neighbour current = candidates.top();
+        if ( current.m_Distance > results.top().m_Distance )
+            break;
+        candidates.pop();
+
+        const int* links = GetLinks(current.m_Index, level);
+        for ( int i = 1; i <= links[0]; i++ )
+        {
+            int row = links[i];
+            if ( tags[row] == epoch )
+                continue;
+            tags[row] = epoch;
+
+            double bound = (int)results.size() < ef ? DBL_MAX : results.top().m_Distance;
+            double d = PartialL2Sqr(query, m_pData + (size_t)row*m_nCols, m_pWeights, m_nCols, bound);
+
+            if ( d < bound )
+            {
+                n.m_Index = row;
+                n.m_Distance = d;
+                candidates.push(n);
+                results.push(n);
+                if ( (int)results.size() > ef )
+                    results.pop();
+            }
+        }
+    }
+
+    found.clear();
+    while ( !results.empty() )
+    {
+        found.push_back(results.top());
+        results.pop();
+    }
+    std::reverse(found.begin(), found.end());
+}
+
+
+
+/*
+   Function:   SelectNeighbours
+   Purpose:    pick at most M links out of candidates (sorted closest first)
+   Notes:      a candidate is skipped if it is closer to an already picked row than
+               to the row we are linking from, this keeps links pointing in different directions
+*/
+void HNSWIndex::SelectNeighbours( NeighbourVec& candidates, int M ) const
+{
+    if ( (int)candidates.size() <= M )
+        return;
+
+    NeighbourVec selected;
+    for ( size_t i = 0; i < candidates.size() && (int)selected.size() < M; i++ )
+    {
+        const float* face = m_pData + (size_t)candidates[i].m_Index*m_nCols;
+        bool bKeep = true;
+
+        for ( size_t j = 0; j < selected.size() && bKeep; j++ )
+        {
+            if ( Distance(face, selected[j].m_Index) < candidates[i].m_Distance )
+                bKeep = false;
+        }
+
+        if ( bKeep )
+            selected.push_back(candidates[i]);
+    }
+
+    candidates.swap(selected);
+}
+
+
+
+double HNSWIndex::Distance( const float* a, int row ) const
+{
+    const DistanceKernel& kernel = GetDistanceKernel();
+    const float* face = m_pData + (size_t)row*m_nCols;
+
+    return m_pWeights ? kernel.WeightedL2Sqr(a, face, m_pWeights, m_nCols)
+                      : kernel.L2Sqr(a, face, m_nCols);
+}
+
+
+int* HNSWIndex::GetLinks( int row, int level )
+{
+    if ( level == 0 )
+        return &m_Level0[(size_t)row*(m_MaxM0+1)];
+    return &m_Upper[row][(size_t)(level-1)*(m_M+1)];
+}
+
+
+const int* HNSWIndex::GetLinks( int row, int level ) const
+{
+    if ( level == 0 )
+        return &m_Level0[(size_t)row*(m_MaxM0+1)];
+    return &m_Upper[row][(size_t)(level-1)*(m_M+1)];
+}
+
+
+// level drawn from an exponential distribution, seeded so builds are repeatable
+int HNSWIndex::RandomLevel()
+{
+    m_Seed = m_Seed * 1103515245u + 12345u;
+    double u = (double)((m_Seed >> 8) + 1) / (double)(1u << 24);
+    return (int)(-log(u) * m_LevelMult);
+}
+
+
+
+/*
+   Function:   Write
+   Purpose:    save the graph so it does not have to be built again on load
+   Returns:    true on success
+*/
+bool HNSWIndex::Write( const std::string& fileName ) const
+{
+    std::ofstream out(fileName.c_str(), std::ios::out | std::ios::binary);
+    if ( !out.is_open() )
+        return false;
+
+    int header[8] = { HNSW_VERSION, m_nRows, m_nCols, m_M, m_MaxM0, m_MaxLevel, m_EntryPoint,
+                      GalleryChecksum(m_pData, m_nRows, m_nCols) };
+
+    out.write(HNSW_MAGIC, sizeof(HNSW_MAGIC));
+    out.write((const char*)header, sizeof(header));
+    if ( m_nRows > 0 )
+    {
+        out.write((const char*)&m_Levels[0], m_Levels.size()*sizeof(int));
+        out.write((const char*)&m_Level0[0], m_Level0.size()*sizeof(int));
+    }
+    for ( int row = 0; row < m_nRows; row++ )
+    {
+        if ( !m_Upper[row].empty() )
+            out.write((const char*)&m_Upper[row][0], m_Upper[row].size()*sizeof(int));
+    }
+
+    return out.good();
+}
+
+
+
+/*
+   Function:   Read
+   Purpose:    load a graph saved with Write and attach it to the gallery data
+   Returns:    false if the file can't be read or does not match the gallery
+*/
+bool HNSWIndex::Read( const std::string& fileName, const float* data, int nRows, int nCols, const float* weights )
+{
+    std::ifstream in(fileName.c_str(), std::ios::in | std::ios::binary);
+    if ( !in.is_open() )
+        return false;
+
+    char magic[4];
+    int header[8];
+    in.read(magic, sizeof(magic));
+    in.read((char*)header, sizeof(header));
+
+    if ( !in.good() || memcmp(magic, HNSW_MAGIC, sizeof(magic)) != 0 || header[0] != HNSW_VERSION ||
+         header[1] != nRows || header[2] != nCols || header[7] != GalleryChecksum(data, nRows, nCols) )
+        return false;
+
+    // the link counts size the arrays below, so check them against what is
+    // left of the file before allocating anything
+    std::streamoff start = in.tellg();
+    in.seekg(0, std::ios::end);
+    std::streamoff remaining = in.tellg() - start;
+    in.seekg(start);
+    if ( header[3] <= 0 || header[4] != 2*header[3] || header[5] < 0 || header[5] > HNSW_MAX_LEVEL ||
+         (double)nRows*(header[4]+2)*sizeof(int) > (double)remaining )
+        return false;
+
+    Clear();
+    m_pData = data;
+    m_pWeights = weights;
+    m_nRows = nRows;
+    m_nCols = nCols;
+    m_M = header[3];
+    m_MaxM0 = header[4];
+    m_MaxLevel = header[5];
+    m_EntryPoint = header[6];
+    m_LevelMult = 1.0 / log((double)std::max(m_M, 2));
+
+    m_Levels.resize(nRows);
+    m_Level0.resize((size_t)nRows*(m_MaxM0+1));
+    m_Upper.resize(nRows);
+    if ( nRows > 0 )
+    {
+        in.read((char*)&m_Levels[0], m_Levels.size()*sizeof(int));
+        in.read((char*)&m_Level0[0], m_Level0.size()*sizeof(int));
+    }
+    bool bValid = in.good() && ( nRows == 0 || ( m_EntryPoint >= 0 && m_EntryPoint < nRows ) );
+    for ( int row = 0; row < nRows && bValid; row++ )
+        bValid = m_Levels[row] >= 0 && m_Levels[row] <= m_MaxLevel;
+    if ( bValid && nRows > 0 )
+        bValid = m_Levels[m_EntryPoint] == m_MaxLevel;
+
+    for ( int row = 0; row < nRows && bValid && in.good(); row++ )
+    {
+        m_Upper[row].resize((size_t)m_Levels[row]*(m_M+1));
+        if ( !m_Upper[row].empty() )
+            in.read((char*)&m_Upper[row][0], m_Upper[row].size()*sizeof(int));
+    }
+
+    for ( int row = 0; row < nRows && bValid && in.good(); row++ )
+    {
+        for ( int level = 0; level <= m_Levels[row] && bValid; level++ )
+            bValid = LinksInRange(GetLinks(row, level), level == 0 ? m_MaxM0 : m_M, level, m_Levels);
+    }
+
+    if ( !bValid || !in.good() )
+    {
+        Clear();
+        return false;
+    }
+
+    return true;
+}
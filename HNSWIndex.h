@@ -0,0 +1,88 @@
+#ifndef HNSWINDEX_H
+#define HNSWINDEX_H
+
+/*
+   HNSWIndex.h
+   Description:   Hierarchical Navigable Small World graph over the rows of a gallery
+                  matrix, used for approximate nearest neighbour search when the
+                  gallery is too big to scan.  The index only stores the graph, the
+                  vectors stay in the Database
+   Author:        Chris Leighton
+
+*/
+
+#include <string>
+#include <vector>
+
+#include "DistanceKernel.h"
+
+
+class HNSWIndex
+{
+public:
+    HNSWIndex( int M = 16, int efConstruction = 200 );
+    ~HNSWIndex();
+
+    // build the graph over nRows x nCols data, weights can be NULL for plain L2
+    void Build( const float* data, int nRows, int nCols, const float* weights );
+
+    // k closest rows, closest first.  ef is the size of the candidate list,
+    // bigger ef gives better recall and slower searches
+    void Search( const float* query, int k, int ef, NeighbourVec& neighbours ) const;
+
+    // graph goes to disk, the data does not.  Read returns false if the file
+    // is missing or was built for a different gallery
+    bool Write( const std::string& fileName ) const;
+    bool Read( const std::string& fileName, const float* data, int nRows, int nCols, const float* weights );
+
+    int  GetnRows() const { return m_nRows; }
+
+private:
+    // rows seen by one search.  A row has been visited when its tag equals the
+    // epoch, so each layer search bumps the epoch instead of clearing every row
+    struct VisitedTags
+    {
+        std::vector<unsigned int>   m_Tags;
+        unsigned int                m_Epoch;
+    };
+
+    double Distance( const float* a, int row ) const;
+    void   SearchLayer( const float* query, int entry, int ef, int level, VisitedTags& visited, NeighbourVec& found ) const;
+    VisitedTags* AcquireVisited() const;
+    void   ReleaseVisited( VisitedTags* visited ) const;
+    void   SelectNeighbours( NeighbourVec& candidates, int M ) const;
+    int*   GetLinks( int row, int level );
+    const int* GetLinks( int row, int level ) const;
+    int    RandomLevel();
+    void   Clear();
+
+    const float*        m_pData;
+    const float*        m_pWeights;
+    int                 m_nRows;
+    int                 m_nCols;
+
+    int                 m_M;               // links per node on the upper levels
+    int                 m_MaxM0;           // links per node on level 0
+    int                 m_EfConstruction;
+    double              m_LevelMult;
+    unsigned int        m_Seed;
+
+    int                 m_EntryPoint;
+    int                 m_MaxLevel;
+    std::vector<int>    m_Levels;          // top level of each row
+
+    // each link list is a count followed by that many row indexes
+    std::vector<int>    m_Level0;          // m_nRows lists of m_MaxM0+1
+    std::vector< std::vector<int> > m_Upper;  // per row, m_Levels[row] lists of m_M+1
+
+    // visited sets not in use, a search takes one and gives it back so each
+    // thread searching at the same time has its own
+    mutable std::vector<VisitedTags*> m_FreeVisited;
+
+    // not copyable, the pooled visited sets belong to one index
+    HNSWIndex( const HNSWIndex& );
+    HNSWIndex& operator=( const HNSWIndex& );
+};
+
+
+#endif
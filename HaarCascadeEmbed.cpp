@@ -0,0 +1,197 @@
+#include "HaarCascadeEmbed.h"
+#include <stdio.h>
+#include <string.h>
+
+
+/*
+   Function:   CreateEmbeddedCascade
+   Purpose:    build a CvHaarClassifierCascade from compiled in tables
+   Notes:      each classifier's nodes are laid out in one block the way OpenCV's
+               own reader does it (features, thresholds, left, right, alphas) so
+               cvReleaseHaarClassifierCascade frees what we allocate here
+   Throws      std::string if memory cannot be allocated
+*/
+CvHaarClassifierCascade* CreateEmbeddedCascade( const EmbeddedHaarCascade& embedded )
+{
+    CvHaarClassifierCascade* cascade = cvCreateHaarClassifierCascade(embedded.m_nStages);
+    if ( !cascade )
+        throw std::string("CreateEmbeddedCascade could not create cascade");
+
+    cascade->orig_window_size = cvSize(embedded.m_Width, embedded.m_Height);
+
+    const int* classifierNodes = embedded.m_ClassifierNodes;
+    const EmbeddedHaarNode* node = embedded.m_Nodes;
+    const float* alpha = embedded.m_Alphas;
+
+    for ( int i = 0; i < embedded.m_nStages; i++ )
+    {
+        const EmbeddedHaarStage& source = embedded.m_Stages[i];
+        CvHaarStageClassifier& stage = cascade->stage_classifier[i];
+
+        stage.count = source.m_nClassifiers;
+        stage.threshold = source.m_Threshold;
+        stage.parent = source.m_Parent;
+        stage.next = source.m_Next;
+        stage.child = -1;
+        if ( stage.parent != -1 && cascade->stage_classifier[stage.parent].child == -1 )
+            cascade->stage_classifier[stage.parent].child = i;
+
+        stage.classifier = (CvHaarClassifier*)cvAlloc(stage.count*sizeof(CvHaarClassifier));
+        memset(stage.classifier, 0, stage.count*sizeof(CvHaarClassifier));
+
+        for ( int j = 0; j < stage.count; j++ )
+        {
+            CvHaarClassifier& classifier = stage.classifier[j];
+            int count = *classifierNodes++;
+
+            classifier.count = count;
+            classifier.haar_feature = (CvHaarFeature*)cvAlloc(count*(sizeof(CvHaarFeature) + sizeof(float) + 2*sizeof(int)) +
+                                                               (count + 1)*sizeof(float));
+            classifier.threshold = (float*)(classifier.haar_feature + count);
+            classifier.left = (int*)(classifier.threshold + count);
+            classifier.right = classifier.left + count;
+            classifier.alpha = (float*)(classifier.right + count);
+
+            for ( int n = 0; n < count; n++, node++ )
+            {
+                CvHaarFeature& feature = classifier.haar_feature[n];
+                feature.tilted = node->m_Tilted;
+                for ( int r = 0; r < CV_HAAR_FEATURE_MAX; r++ )
+                {
+                    feature.rect[r].r = cvRect(node->m_Rects[r][0], node->m_Rects[r][1], node->m_Rects[r][2], node->m_Rects[r][3]);
+                    feature.rect[r].weight = node->m_Weights[r];
+                }
+
+                classifier.threshold[n] = node->m_Threshold;
+                classifier.left[n] = node->m_Left;
+                classifier.right[n] = node->m_Right;
+            }
+
+            for ( int n = 0; n <= count; n++ )
+                classifier.alpha[n] = *alpha++;
+        }
+    }
+
+    return cascade;
+}
+
+
+
+CvHaarClassifierCascade* LoadEmbeddedCascade( const std::string& name )
+{
+#ifdef HAAR_CASCADE_EMBEDDED
+    if ( name == HAAR_CASCADE_EMBEDDED_FRONTAL )
+        return CreateEmbeddedCascade(g_FrontalFaceCascade);
+#endif
+
+    return NULL;
+}
+
+
+
+/*
+   Function:   WriteCascadeSource
+   Purpose:    the build step that turns a cascade XML file into compiled in tables
+   Notes:      OpenCV reads the file so the tables hold exactly what cvLoad gives.
+               Floats are written in exponent form so they read back unchanged
+   Throws      std::string if the cascade cannot be loaded or the source written
+*/
+void WriteCascadeSource( const char* cascadeFile, const char* sourceFile, const char* variable )
+{
+    CvHaarClassifierCascade* cascade = (CvHaarClassifierCascade*)cvLoad(cascadeFile, 0, 0, 0);
+    if ( !cascade )
+    {
+        std::string err;
+        err = "WriteCascadeSource could not load cascade ";
+        err += cascadeFile;
+        throw err;
+    }
+
+    FILE* out = fopen(sourceFile, "w");
+    if ( !out )
+    {
+        cvReleaseHaarClassifierCascade(&cascade);
+        std::string err;
+        err = "WriteCascadeSource could not open ";
+        err += sourceFile;
+        throw err;
+    }
+
+    fprintf(out, "// made from %s by WriteCascadeSource, do not edit\n", cascadeFile);
+    fprintf(out, "// build with HAAR_CASCADE_EMBEDDED defined to use it\n\n");
+    fprintf(out, "#include \"HaarCascadeEmbed.h\"\n\n");
+
+    fprintf(out, "static const EmbeddedHaarStage stages[] =\n{\n");
+    for ( int i = 0; i < cascade->count; i++ )
+    {
+        const CvHaarStageClassifier& stage = cascade->stage_classifier[i];
+        fprintf(out, "    { %d, %.9ef, %d, %d },\n", stage.count, stage.threshold, stage.parent, stage.next);
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static const int classifierNodes[] =\n{\n");
+    for ( int i = 0; i < cascade->count; i++ )
+    {
+        const CvHaarStageClassifier& stage = cascade->stage_classifier[i];
+        for ( int j = 0; j < stage.count; j++ )
+            fprintf(out, "    %d,\n", stage.classifier[j].count);
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static const EmbeddedHaarNode nodes[] =\n{\n");
+    for ( int i = 0; i < cascade->count; i++ )
+    {
+        const CvHaarStageClassifier& stage = cascade->stage_classifier[i];
+        for ( int j = 0; j < stage.count; j++ )
+        {
+            const CvHaarClassifier& classifier = stage.classifier[j];
+            for ( int n = 0; n < classifier.count; n++ )
+            {
+                const CvHaarFeature& feature = classifier.haar_feature[n];
+                fprintf(out, "    { %d, {", feature.tilted);
+                for ( int r = 0; r < CV_HAAR_FEATURE_MAX; r++ )
+                {
+                    const CvRect& rect = feature.rect[r].r;
+                    fprintf(out, "%s{ %d, %d, %d, %d }", r ? ", " : " ", rect.x, rect.y, rect.width, rect.height);
+                }
+                fprintf(out, " }, {");
+                for ( int r = 0; r < CV_HAAR_FEATURE_MAX; r++ )
+                    fprintf(out, "%s%.9ef", r ? ", " : " ", feature.rect[r].weight);
+                fprintf(out, " }, %.9ef, %d, %d },\n", classifier.threshold[n], classifier.left[n], classifier.right[n]);
+            }
+        }
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static const float alphas[] =\n{\n");
+    for ( int i = 0; i < cascade->count; i++ )
+    {
+        const CvHaarStageClassifier& stage = cascade->stage_classifier[i];
+        for ( int j = 0; j < stage.count; j++ )
+        {
+            const CvHaarClassifier& classifier = stage.classifier[j];
+            fprintf(out, "   ");
+            for ( int n = 0; n <= classifier.count; n++ )
+                fprintf(out, " %.9ef,", classifier.alpha[n]);
+            fprintf(out, "\n");
+        }
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "const EmbeddedHaarCascade %s =\n{\n", variable);
+    fprintf(out, "    %d, %d, %d, stages, classifierNodes, nodes, alphas\n",
+            cascade->orig_window_size.width, cascade->orig_window_size.height, cascade->count);
+    fprintf(out, "};\n");
+
+    bool bOk = ferror(out) == 0;
+    fclose(out);
+    cvReleaseHaarClassifierCascade(&cascade);
+
+    if ( !bOk )
+    {
+        std::string err;
+        err = "WriteCascadeSource could not write ";
+        err += sourceFile;
+        throw err;
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef HAARCASCADEEMBED_H
+#define HAARCASCADEEMBED_H
+
+/*
+   HaarCascadeEmbed.h
+   Description:   Haar cascades kept as tables compiled into the program, so a
+                  detector can start without reading or parsing the cascade XML.
+                  WriteCascadeSource turns a cascade file into a .cpp holding the
+                  tables, CreateEmbeddedCascade builds the OpenCV cascade from them
+   Author:        Chris Leighton
+
+*/
+
+#include <string>
+#include <cv.h>
+#include <cxcore.h>
+
+
+// one stage of the cascade, its classifiers follow the previous stage's
+struct EmbeddedHaarStage
+{
+    int     m_nClassifiers;
+    float   m_Threshold;
+    int     m_Parent;
+    int     m_Next;
+};
+
+// one node of a classifier tree, unused rectangles have a weight of 0
+struct EmbeddedHaarNode
+{
+    int     m_Tilted;
+    int     m_Rects[CV_HAAR_FEATURE_MAX][4];    // x, y, width, height
+    float   m_Weights[CV_HAAR_FEATURE_MAX];
+    float   m_Threshold;
+    int     m_Left;
+    int     m_Right;
+};
+
+struct EmbeddedHaarCascade
+{
+    int                         m_Width;            // window the cascade was trained on
+    int                         m_Height;
+    int                         m_nStages;
+    const EmbeddedHaarStage*    m_Stages;
+    const int*                  m_ClassifierNodes;  // nodes in each classifier, stage by stage
+    const EmbeddedHaarNode*     m_Nodes;            // every node of every classifier in order
+    const float*                m_Alphas;           // nodes+1 leaf values for each classifier
+};
+
+
+// name FaceDetector and CascadeRegistry use for the compiled in frontal face cascade
+#define HAAR_CASCADE_EMBEDDED_FRONTAL "embedded:haarcascade_frontalface_alt"
+
+#ifdef HAAR_CASCADE_EMBEDDED
+// made by WriteCascadeSource.  ClusterTest runs CascadeEmbed before compiling and
+// defines HAAR_CASCADE_EMBEDDED, EigenFace's CASCADE command does the same by hand
+extern const EmbeddedHaarCascade g_FrontalFaceCascade;
+#endif
+
+
+// build a cascade the same way cvLoad would, release it with cvReleaseHaarClassifierCascade
+CvHaarClassifierCascade* CreateEmbeddedCascade( const EmbeddedHaarCascade& embedded );
+
+// the cascade for one of the embedded names, NULL if name is not one of them
+CvHaarClassifierCascade* LoadEmbeddedCascade( const std::string& name );
+
+// load cascadeFile and write its tables to sourceFile as an EmbeddedHaarCascade called variable
+void WriteCascadeSource( const char* cascadeFile, const char* sourceFile, const char* variable );
+
+
+#endif
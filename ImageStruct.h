@@ -22,6 +22,9 @@ struct Image
 
     Image(const char* buffer)
     {
+        // the face is made later, PreProcess releases whatever is here first
+        m_Image = NULL;
+
         std::string stuff(buffer);
 
         // LOOK!!!!! this assumes that the line is space delimited
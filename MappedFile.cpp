@@ -0,0 +1,164 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#endif
+
+
+#ifdef _WIN32
+
+MappedFile::MappedFile() : m_pData(NULL), m_Size(0), m_hFile(INVALID_HANDLE_VALUE), m_hMapping(NULL)
+{
+}
+
+#else
+
+MappedFile::MappedFile() : m_pData(NULL), m_Size(0), m_File(-1)
+{
+}
+
+#endif
+
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+
+
+/*
+   Function:   Open
+   Purpose:    map the whole of path
+   Throws      std::string if the file can not be opened, is empty or can not be mapped
+*/
+void MappedFile::Open( const std::string& path )
+{
+    Close();
+
+    std::string err;
+
+#ifdef _WIN32
+    // FILE_SHARE_DELETE lets RenameOver move a new file over this one while it is mapped
+    m_hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                          FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+    if ( m_hFile == INVALID_HANDLE_VALUE )
+    {
+        err = "MappedFile could not open ";
+        err += path;
+        throw err;
+    }
+
+    LARGE_INTEGER size;
+    if ( !GetFileSizeEx(m_hFile, &size) || size.QuadPart == 0 )
+    {
+        Close();
+        err = "MappedFile could not get the size of ";
+        err += path;
+        throw err;
+    }
+    m_Size = (size_t)size.QuadPart;
+
+    m_hMapping = CreateFileMappingA(m_hFile, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    if ( m_hMapping )
+        m_pData = (unsigned char*)MapViewOfFile(m_hMapping, FILE_MAP_COPY, 0, 0, 0);
+#else
+    m_File = open(path.c_str(), O_RDONLY);
+    if ( m_File < 0 )
+    {
+        err = "MappedFile could not open ";
+        err += path;
+        throw err;
+    }
+
+    struct stat st;
+    if ( fstat(m_File, &st) != 0 || st.st_size == 0 )
+    {
+        Close();
+        err = "MappedFile could not get the size of ";
+        err += path;
+        throw err;
+    }
+    m_Size = (size_t)st.st_size;
+
+    void* data = mmap(NULL, m_Size, PROT_READ | PROT_WRITE, MAP_PRIVATE, m_File, 0);
+    if ( data != MAP_FAILED )
+        m_pData = (unsigned char*)data;
+#endif
+
+    if ( !m_pData )
+    {
+        Close();
+        err = "MappedFile could not map ";
+        err += path;
+        throw err;
+    }
+}
+
+
+
+void MappedFile::Close()
+{
+#ifdef _WIN32
+    if ( m_pData )
+        UnmapViewOfFile(m_pData);
+    if ( m_hMapping )
+        CloseHandle(m_hMapping);
+    if ( m_hFile != INVALID_HANDLE_VALUE )
+        CloseHandle(m_hFile);
+    m_hMapping = NULL;
+    m_hFile = INVALID_HANDLE_VALUE;
+#else
+    if ( m_pData )
+        munmap(m_pData, m_Size);
+    if ( m_File >= 0 )
+        close(m_File);
+    m_File = -1;
+#endif
+
+    m_pData = NULL;
+    m_Size = 0;
+}
+
+
+
+/*
+   Function:   RenameOver
+   Purpose:    move from over to, replacing to if it already exists
+   Notes:      on POSIX rename is atomic and anyone who has the old to mapped keeps
+               its pages.  Windows will not replace a file that is open, even one
+               opened with FILE_SHARE_DELETE, but it will rename and delete it.  So
+               the old to is moved aside first and deleted, it goes away once the
+               last handle to it, such as a MappedFile, is closed
+   Returns:    false if the file could not be moved
+*/
+bool RenameOver( const std::string& from, const std::string& to )
+{
+#ifdef _WIN32
+    if ( MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) )
+        return true;
+
+    std::string aside = to + ".old";
+    DeleteFileA(aside.c_str());
+    if ( !MoveFileExA(to.c_str(), aside.c_str(), 0) )
+        return false;
+
+    if ( !MoveFileExA(from.c_str(), to.c_str(), 0) )
+    {
+        MoveFileExA(aside.c_str(), to.c_str(), 0);
+        return false;
+    }
+
+    DeleteFileA(aside.c_str());
+    return true;
+#else
+    return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
@@ -0,0 +1,53 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+/*
+   MappedFile.h
+   Description:   a whole file mapped into memory so its contents can be used in place
+   Author:        Chris Leighton
+
+*/
+
+#include <string>
+#include <stddef.h>
+
+
+// The mapping is copy on write: nothing is read until it is touched, pages that
+// are only read are shared with the file cache, and writing to a page changes
+// our copy of it, never the file
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    // map path, throws std::string if it can not be opened or mapped
+    void Open( const std::string& path );
+    void Close();
+
+    unsigned char* GetData() { return m_pData; }
+    size_t GetSize() { return m_Size; }
+
+private:
+    unsigned char*  m_pData;
+    size_t          m_Size;
+
+#ifdef _WIN32
+    void*           m_hFile;
+    void*           m_hMapping;
+#else
+    int             m_File;
+#endif
+
+    // not copyable, the mapping belongs to one object
+    MappedFile( const MappedFile& );
+    MappedFile& operator=( const MappedFile& );
+};
+
+
+// move from over to, replacing to if it exists.  A MappedFile of the old to stays
+// valid and keeps the old contents
+bool RenameOver( const std::string& from, const std::string& to );
+
+
+#endif
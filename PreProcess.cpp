@@ -1,5 +1,22 @@
 #include "PreProcess.h"
 #include "FaceDetector.h"
+#include "FaceCache.h"
+
+
+static PreProcessOptions g_PreProcessOptions;
+
+
+void SetPreProcessOptions( const PreProcessOptions& options )
+{
+    g_PreProcessOptions = options;
+}
+
+
+const PreProcessOptions& GetPreProcessOptions()
+{
+    return g_PreProcessOptions;
+}
+
 
 /*
 Function:   DetectAndPreProcess
@@ -18,32 +35,33 @@ bool DetectAndPreProcess(const char *image, const char* name)
     // the one indicates that we assume the image is color
     faceImage = cvLoadImage(image,1);
 
-    if ( image )
+    if ( faceImage )
     {
         try
         {
-            FaceDetector* fd = new FaceDetector(faceImage, true);
+            // on the stack so the cascade goes back to the registry if we throw
+            FaceDetector fd(faceImage, false);
+            fd.SetDownscale(g_PreProcessOptions.m_MinFaceSize, g_PreProcessOptions.m_DetectWindow);
+            fd.SetThreads(g_PreProcessOptions.m_DetectThreads);
+            fd.SetLightweight(true);
 
             // find the largest face in the image
-            fd->Detect(true);
-            IplImage *tempFace;
+            fd.Detect(true);
+            CvMat view;
 
             // did we find the face?
-            if ( !fd->GetFaceVec().empty() )
+            if ( fd.GetFaceView(0, &view) )
             {
-                // get the face from the face detector
-                IplImage* face = fd->GetFaceVec()[0];
-
-                // now perform the rest of the preprocessing on the face
-                tempFace = cvCreateImage(cvSize(face->width, face->height), face->depth, 1);
-                ConvertToGreyScale(face, tempFace);
-                Resize(face, tempFace);
-
-                // do histogram equalization on the found face
-                cvEqualizeHist(tempFace, tempFace);
+                // grey scale, resize and equalize the face straight out of the image
+                IplImage* tempFace = cvCreateImage(cvSize(100, 100), faceImage->depth, 1);
+                if ( !tempFace )
+                    throw std::string("Error: DetectAndPreProcess could not create face image");
+                GreyResizeEqualize(&view, tempFace);
 
                 // try to save it to disk
-                if ( !cvSaveImage( name, tempFace ) )
+                bool bSaved = cvSaveImage( name, tempFace ) != 0;
+                cvReleaseImage(&tempFace);
+                if ( !bSaved )
                 {
                     std::string err;
                     err = "Error: DetectAndPreProcess could not save ";
@@ -57,14 +75,14 @@ bool DetectAndPreProcess(const char *image, const char* name)
 
             }
 
-            delete fd;
-
         }
         catch (...)
         {
+            cvReleaseImage(&faceImage);
             throw;
         }
 
+        cvReleaseImage(&faceImage);
     }
     else
     {
@@ -85,48 +103,269 @@ bool DetectAndPreProcess(const char *image, const char* name)
 /*
 Function:   PreProcess
 Purpose:    Resize, make into grey scale, and do histogram equalization on given image
-Notes:
+Notes:      uses the options set with SetPreProcessOptions
 Throws      std::string if somthing goes wrong
 */
 
 void PreProcess( IplImage* src, IplImage** dest )
+{
+    PreProcess(src, dest, g_PreProcessOptions);
+}
+
+
+
+/*
+Function:   PreProcess
+Purpose:    same as above with options for this image only
+Notes:      with m_bSkipDetection the whole image is taken to be the face, for
+            images that are already cropped to the face
+Throws      std::string if somthing goes wrong
+*/
+void PreProcess( IplImage* src, IplImage** dest, const PreProcessOptions& options )
 {
     if ( *dest )
         cvReleaseImage(&*dest);
 
-    try
+    if ( options.m_bSkipDetection )
     {
-        FaceDetector* fd = new FaceDetector(src, false);
-        fd->Detect(true);
+        *dest = cvCreateImage(cvSize(100, 100), src->depth, 1);
+        if ( !*dest )
+            throw std::string("PreProcess could not create dest image");
 
-        if ( !fd->GetFaceVec().empty() )
-        {
-            // get the face from the face detector
-            IplImage* face = fd->GetFaceVec()[0];
+        GreyResizeEqualize(src, *dest);
+        return;
+    }
 
-            int width = 100;
-            int height = 100;
+    // we only need the rectangle, the face is read straight out of src.  The
+    // detector is on the stack so its cascade goes back to the registry if we throw
+    FaceDetector fd(src, false);
+    fd.SetDownscale(options.m_MinFaceSize, options.m_DetectWindow);
+    fd.SetThreads(options.m_DetectThreads);
+    fd.SetLightweight(true);
+    fd.Detect(true);
 
-            *dest = cvCreateImage(cvSize(width, height), src->depth, 1);
-            if ( !*dest )
-                throw std::string("PreProcess could not create dest image");
+    CvMat view;
+    if ( !fd.GetFaceView(0, &view) )
+        throw std::string("FaceDetector could not find face");
 
-            if ( src->nChannels != 1 )
-                ConvertToGreyScale(face, face);
+    int width = 100;
+    int height = 100;
 
-            Resize(face, *dest);
+    *dest = cvCreateImage(cvSize(width, height), src->depth, 1);
+    if ( !*dest )
+        throw std::string("PreProcess could not create dest image");
 
-            // do histogram equalization on the found face
-            cvEqualizeHist(*dest, *dest);
-        }
-        else
+    GreyResizeEqualize(&view, *dest);
+}
+
+
+
+/*
+Function:   LoadAndPreProcess
+Purpose:    load an image file and preprocess the face in it
+Notes:      when FaceCache is open the face is looked for there first, and a face
+            that was not there is added
+Throws      std::string if the face can not be found
+Returns:    false if the image can not be loaded
+*/
+bool LoadAndPreProcess( const char* imagename, IplImage** dest, const PreProcessOptions& options )
+{
+    FaceCache::Key key = 0;
+    std::vector<uchar> bytes;
+    bool bCache = FaceCache::IsOpen() && FaceCache::MakeKey(imagename, options, key, bytes);
+    if ( bCache )
+    {
+        IplImage* face = FaceCache::Find(key);
+        if ( face )
         {
-            throw std::string("FaceDetector could not find face");
+            if ( *dest )
+                cvReleaseImage(&*dest);
+            *dest = face;
+            return true;
         }
     }
+
+    // the file has already been read for the key, decode those bytes rather than read it again
+    IplImage* image = bCache ? FaceCache::Decode(bytes) : cvLoadImage(imagename, CV_LOAD_IMAGE_GRAYSCALE);
+    if ( !image )
+        return false;
+
+    try
+    {
+        PreProcess(image, dest, options);
+    }
     catch ( ... )
     {
+        cvReleaseImage(&image);
         throw;
     }
+    cvReleaseImage(&image);
+
+    if ( bCache )
+        FaceCache::Insert(key, *dest);
+
+    return true;
 }
 
+
+
+/*
+Function:   MeanOverlap
+Purpose:    mean intersection over union of the rectangles found in both lists
+Notes:      a width of 0 means no face was found, nBoth is how many images had one in both
+*/
+static double MeanOverlap(const std::vector<CvRect>& first, const std::vector<CvRect>& second, int& nBoth)
+{
+    double overlap = 0.0;
+    nBoth = 0;
+    for ( size_t i = 0; i < first.size(); i++ )
+    {
+        const CvRect& a = first[i];
+        const CvRect& b = second[i];
+        if ( a.width == 0 || b.width == 0 )
+            continue;
+
+        int w = std::min(a.x + a.width, b.x + b.width) - std::max(a.x, b.x);
+        int h = std::min(a.y + a.height, b.y + b.height) - std::max(a.y, b.y);
+        double inter = (w > 0 && h > 0) ? (double)w*h : 0.0;
+        overlap += inter / ((double)a.width*a.height + (double)b.width*b.height - inter);
+        nBoth++;
+    }
+
+    return nBoth ? overlap / nBoth : 0.0;
+}
+
+
+
+/*
+Function:   BenchmarkDetection
+Purpose:    time finding the largest face at full size on one thread, with the
+            current downscale on one thread, and with the current options
+Notes:      images are loaded grey scale up front so only detection is timed.  The
+            rectangles are compared by how much they overlap (intersection over union),
+            full size against the options, and the one thread pass against the
+            options to check DetectParallel finds what the serial search does
+*/
+void BenchmarkDetection(const std::vector<std::string>& images, std::ostream& out)
+{
+    const PreProcessOptions& options = GetPreProcessOptions();
+
+    ImageVec loaded;
+    for ( size_t i = 0; i < images.size(); i++ )
+    {
+        IplImage* img = cvLoadImage(images[i].c_str(), CV_LOAD_IMAGE_GRAYSCALE);
+        if ( img )
+            loaded.push_back(img);
+        else
+            out << "Skipping " << images[i] << std::endl;
+    }
+
+    static const char* passNames[3] = { "Full size (ms)  : ", "Serial (ms)     : ", "Options (ms)    : " };
+    int nImages = (int)loaded.size();
+    std::vector<CvRect> rects[3];
+
+    for ( int pass = 0; pass < 3; pass++ )
+    {
+        int nFound = 0;
+        rects[pass].assign(nImages, cvRect(0,0,0,0));
+
+        double t = (double)cvGetTickCount();
+        for ( int i = 0; i < nImages; i++ )
+        {
+            FaceDetector fd(loaded[i], false);
+            if ( pass > 0 )
+                fd.SetDownscale(options.m_MinFaceSize, options.m_DetectWindow);
+            if ( pass == 2 )
+                fd.SetThreads(options.m_DetectThreads);
+
+            if ( fd.Detect(true) > 0 )
+            {
+                rects[pass][i] = *fd.GetRectVec()[0];
+                nFound++;
+            }
+        }
+        double ms = ((double)cvGetTickCount() - t) / ((double)cvGetTickFrequency() * 1000.0);
+
+        out << passNames[pass] << ms << " (" << (nImages ? ms / nImages : 0.0)
+            << " per image), " << nFound << " faces" << std::endl;
+    }
+
+    int nBoth = 0;
+    int nSerial = 0;
+    double overlap = MeanOverlap(rects[0], rects[2], nBoth);
+    double serialOverlap = MeanOverlap(rects[1], rects[2], nSerial);
+
+    out << "Min face size   : " << options.m_MinFaceSize << " shrunk to " << options.m_DetectWindow << std::endl;
+    out << "Detect threads  : " << options.m_DetectThreads << std::endl;
+    out << "Mean overlap    : " << overlap << " over " << nBoth << " images" << std::endl;
+    out << "Serial overlap  : " << serialOverlap << " over " << nSerial << " images" << std::endl;
+
+    for ( int i = 0; i < nImages; i++ )
+        cvReleaseImage(&loaded[i]);
+}
+
+
+
+/*
+Function:   BenchmarkScaleFace
+Purpose:    time GreyResizeEqualize against doing each step separately with OpenCV
+Notes:      the whole of each image is scaled, as with m_bSkipDetection, so only
+            the preprocessing is timed.  Reports how far apart the two outputs are
+*/
+void BenchmarkScaleFace(const std::vector<std::string>& images, std::ostream& out)
+{
+    ImageVec loaded;
+    for ( size_t i = 0; i < images.size(); i++ )
+    {
+        IplImage* img = cvLoadImage(images[i].c_str(), 1);
+        if ( img )
+            loaded.push_back(img);
+        else
+            out << "Skipping " << images[i] << std::endl;
+    }
+
+    int nImages = (int)loaded.size();
+    ImageVec separate(nImages);
+    ImageVec fused(nImages);
+    for ( int i = 0; i < nImages; i++ )
+    {
+        separate[i] = cvCreateImage(cvSize(100, 100), IPL_DEPTH_8U, 1);
+        fused[i] = cvCreateImage(cvSize(100, 100), IPL_DEPTH_8U, 1);
+    }
+
+    for ( int pass = 0; pass < 2; pass++ )
+    {
+        double t = (double)cvGetTickCount();
+        for ( int i = 0; i < nImages; i++ )
+        {
+            if ( pass == 0 )
+                GreyResizeEqualizeSeparate(loaded[i], separate[i]);
+            else
+                GreyResizeEqualize(loaded[i], fused[i]);
+        }
+        double ms = ((double)cvGetTickCount() - t) / ((double)cvGetTickFrequency() * 1000.0);
+
+        out << (pass == 0 ? "Separate (ms)   : " : "Fused (ms)      : ") << ms
+            << " (" << (nImages ? ms / nImages : 0.0) << " per image)" << std::endl;
+    }
+
+    double meanDiff = 0.0;
+    double maxDiff = 0.0;
+    for ( int i = 0; i < nImages; i++ )
+    {
+        double diff = cvNorm(separate[i], fused[i], CV_C);
+        meanDiff += cvNorm(separate[i], fused[i], CV_L1) / (100.0*100.0);
+        if ( diff > maxDiff )
+            maxDiff = diff;
+    }
+
+    out << "Mean difference : " << (nImages ? meanDiff / nImages : 0.0) << " grey levels" << std::endl;
+    out << "Max difference  : " << maxDiff << " grey levels" << std::endl;
+
+    for ( int i = 0; i < nImages; i++ )
+    {
+        cvReleaseImage(&loaded[i]);
+        cvReleaseImage(&separate[i]);
+        cvReleaseImage(&fused[i]);
+    }
+}
@@ -9,10 +9,39 @@
 
 */
 
+#include <vector>
+
 #include "Utilities.h"
 
+
+// how faces are found before they are preprocessed, shared by every call to
+// PreProcess so set it before loading images from many threads
+struct PreProcessOptions
+{
+    int     m_MinFaceSize;      // smallest face to find in pixels of the source image, 0 detects at full size
+    int     m_DetectWindow;     // a face of m_MinFaceSize is shrunk to this many pixels before detecting
+    int     m_DetectThreads;    // threads one detection is spread over, 0 for one per core
+    bool    m_bSkipDetection;   // the image is already cropped to the face, do not look for it
+
+    PreProcessOptions() : m_MinFaceSize(0), m_DetectWindow(24), m_DetectThreads(1), m_bSkipDetection(false) {}
+};
+
+void SetPreProcessOptions( const PreProcessOptions& options );
+const PreProcessOptions& GetPreProcessOptions();
+
 bool DetectAndPreProcess(const char *image, const char* name);
 void PreProcess( IplImage* src, IplImage** dest );
+void PreProcess( IplImage* src, IplImage** dest, const PreProcessOptions& options );
+
+// load imagename and preprocess it, going through FaceCache when it is open.
+// false if the image can not be loaded
+bool LoadAndPreProcess( const char* imagename, IplImage** dest, const PreProcessOptions& options );
+
+// time detection on images at full size and with the current options
+void BenchmarkDetection(const std::vector<std::string>& images, std::ostream& out);
+
+// time the one pass grey scale, resize and equalize against the separate steps
+void BenchmarkScaleFace(const std::vector<std::string>& images, std::ostream& out);
 
 
 #endif
@@ -0,0 +1,322 @@
+#include "ProductQuantizer.h"
+#include <float.h>
+#include <stdio.h>
+#include <algorithm>
+#include <queue>
+#include <string>
+
+
+ProductQuantizer::ProductQuantizer() : m_nRows(0), m_nCols(0), m_nSubspaces(0), m_nCentroids(0),
+                                       m_Codebooks(NULL), m_Codes(NULL)
+{
+}
+
+
+ProductQuantizer::~ProductQuantizer()
+{
+    Clear();
+}
+
+
+void ProductQuantizer::Clear()
+{
+    if ( m_Codebooks )
+        cvReleaseMat(&m_Codebooks);
+    if ( m_Codes )
+        cvReleaseMat(&m_Codes);
+
+    m_Codebooks = NULL;
+    m_Codes = NULL;
+    m_nRows = 0;
+    m_nCols = 0;
+    m_nSubspaces = 0;
+    m_nCentroids = 0;
+    m_Offsets.clear();
+}
+
+
+
+/*
+   Function:   SetSubspaces
+   Purpose:    split nCols columns into nSubspaces runs that differ in size by at most one
+*/
+void ProductQuantizer::SetSubspaces( int nCols, int nSubspaces )
+{
+    m_nCols = nCols;
+    m_nSubspaces = nSubspaces;
+    m_Offsets.resize(nSubspaces + 1);
+
+    for ( int s = 0; s <= nSubspaces; s++ )
+        m_Offsets[s] = (int)(((long long)s * nCols) / nSubspaces);
+}
+
+
+
+/*
+   Function:   Train
+   Purpose:    learn a codebook for every subspace with k-means and encode data
+   Notes:      the codebooks are learnt without the search weights, for the
+               Mahalanobis search the whitened gallery should be used so the
+               plain L2 k-means matches the distance we search with
+   Throws      std::string if the data is empty or memory cannot be allocated
+*/
+void ProductQuantizer::Train( const float* data, int nRows, int nCols, int subspaceDims, int nCentroids )
+{
+    if ( !data || nRows <= 0 || nCols <= 0 )
+        throw std::string("ProductQuantizer::Train - no data to train with");
+
+    Clear();
+
+    subspaceDims = std::max(1, std::min(subspaceDims, nCols));
+    SetSubspaces(nCols, (nCols + subspaceDims - 1) / subspaceDims);
+
+    m_nRows = nRows;
+    m_nCentroids = std::max(1, std::min(std::min(nCentroids, 256), nRows));
+
+    m_Codebooks = cvCreateMat(m_nCentroids, nCols, CV_32FC1);
+    m_Codes = cvCreateMat(nRows, m_nSubspaces, CV_8UC1);
+    if ( !m_Codebooks || !m_Codes )
+        throw std::string("ProductQuantizer::Train could not allocate matrix");
+
+    CvMat* labels = cvCreateMat(nRows, 1, CV_32SC1);
+    CvTermCriteria crit = cvTermCriteria(CV_TERMCRIT_ITER | CV_TERMCRIT_EPS, 25, 1e-4);
+    CvRNG rng = cvRNG(12345);
+
+    for ( int s = 0; s < m_nSubspaces; s++ )
+    {
+        int first = m_Offsets[s];
+        int dims = m_Offsets[s+1] - first;
+
+        // k-means wants the sub vectors one after the other
+        CvMat* samples = cvCreateMat(nRows, dims, CV_32FC1);
+        CvMat* centers = cvCreateMat(m_nCentroids, dims, CV_32FC1);
+        for ( int row = 0; row < nRows; row++ )
+            std::copy(data + (size_t)row*nCols + first, data + (size_t)row*nCols + first + dims,
+                      samples->data.fl + row*dims);
+
+        cvKMeans2(samples, m_nCentroids, labels, crit, 1, &rng, 0, centers);
+
+        for ( int c = 0; c < m_nCentroids; c++ )
+            std::copy(centers->data.fl + c*dims, centers->data.fl + (c+1)*dims,
+                      m_Codebooks->data.fl + c*nCols + first);
+
+        cvReleaseMat(&samples);
+        cvReleaseMat(&centers);
+    }
+
+    cvReleaseMat(&labels);
+
+    Encode(data);
+}
+
+
+
+/*
+   Function:   Encode
+   Purpose:    store the closest centroid of every sub vector of data
+*/
+void ProductQuantizer::Encode( const float* data )
+{
+    const DistanceKernel& kernel = GetDistanceKernel();
+
+    for ( int row = 0; row < m_nRows; row++ )
+    {
+        const float* face = data + (size_t)row*m_nCols;
+        unsigned char* code = m_Codes->data.ptr + row*m_Codes->step;
+
+        for ( int s = 0; s < m_nSubspaces; s++ )
+        {
+            int first = m_Offsets[s];
+            int dims = m_Offsets[s+1] - first;
+
+            double best = DBL_MAX;
+            int bestCentroid = 0;
+            for ( int c = 0; c < m_nCentroids; c++ )
+            {
+                double d = kernel.L2Sqr(face + first, m_Codebooks->data.fl + c*m_nCols + first, dims);
+                if ( d < best )
+                {
+                    best = d;
+                    bestCentroid = c;
+                }
+            }
+            code[s] = (unsigned char)bestCentroid;
+        }
+    }
+}
+
+
+
+/*
+   Function:   Search
+   Purpose:    find the k rows whose codes are closest to query
+   Notes:      the distance from every sub vector of the query to every centroid is
+               worked out once, after that a row costs one table lookup per subspace.
+               Without re-ranking the distances are the approximate ones
+*/
+void ProductQuantizer::Search( const float* query, const float* weights, int k, int nRerank,
+                               const float* exact, NeighbourVec& neighbours ) const
+{
+    neighbours.clear();
+    if ( m_nRows <= 0 || k <= 0 )
+        return;
+
+    const DistanceKernel& kernel = GetDistanceKernel();
+
+    // distance tables, one run of nCentroids per subspace
+    std::vector<float> table((size_t)m_nSubspaces * m_nCentroids);
+    for ( int s = 0; s < m_nSubspaces; s++ )
+    {
+        int first = m_Offsets[s];
+        int dims = m_Offsets[s+1] - first;
+
+        for ( int c = 0; c < m_nCentroids; c++ )
+        {
+            const float* centroid = m_Codebooks->data.fl + c*m_nCols + first;
+            table[s*m_nCentroids + c] = (float)(weights ? kernel.WeightedL2Sqr(query + first, centroid, weights + first, dims)
+                                                        : kernel.L2Sqr(query + first, centroid, dims));
+        }
+    }
+
+    bool bRerank = exact && nRerank > 0;
+    int nKeep = std::min(m_nRows, bRerank ? std::max(k, nRerank) : k);
+
+    std::priority_queue<Neighbour> heap;
+    for ( int row = 0; row < m_nRows; row++ )
+    {
+        const unsigned char* code = m_Codes->data.ptr + row*m_Codes->step;
+        float d = 0.0f;
+        for ( int s = 0; s < m_nSubspaces; s++ )
+            d += table[s*m_nCentroids + code[s]];
+
+        if ( (int)heap.size() < nKeep )
+        {
+            Neighbour n = { row, d };
+            heap.push(n);
+        }
+        else if ( d < heap.top().m_Distance )
+        {
+            Neighbour n = { row, d };
+            heap.pop();
+            heap.push(n);
+        }
+    }
+
+    neighbours.resize(heap.size());
+    for ( int i = (int)neighbours.size() - 1; i >= 0; i-- )
+    {
+        neighbours[i] = heap.top();
+        heap.pop();
+    }
+
+    if ( bRerank )
+    {
+        for ( size_t i = 0; i < neighbours.size(); i++ )
+        {
+            const float* face = exact + (size_t)neighbours[i].m_Index*m_nCols;
+            neighbours[i].m_Distance = weights ? kernel.WeightedL2Sqr(query, face, weights, m_nCols)
+                                               : kernel.L2Sqr(query, face, m_nCols);
+        }
+        std::sort(neighbours.begin(), neighbours.end());
+    }
+
+    if ( (int)neighbours.size() > k )
+        neighbours.resize(k);
+}
+
+
+
+/*
+   Function:   Write
+   Purpose:    store the codebooks and codes in an open database
+*/
+void ProductQuantizer::Write( CvFileStorage* storage, const char* prefix ) const
+{
+    if ( !m_Codebooks || !m_Codes )
+        return;
+
+    char var[256];
+    sprintf(var, "%s_nSubspaces", prefix);
+    cvWriteInt( storage, var, m_nSubspaces );
+    sprintf(var, "%s_Codebooks", prefix);
+    cvWrite( storage, var, m_Codebooks, cvAttrList(0,0) );
+    sprintf(var, "%s_Codes", prefix);
+    cvWrite( storage, var, m_Codes, cvAttrList(0,0) );
+}
+
+
+
+/*
+   Function:   Read
+   Purpose:    load codebooks and codes written by Write
+   Returns:    false if they are not in the database or were made for another gallery
+*/
+bool ProductQuantizer::Read( CvFileStorage* storage, const char* prefix, int nRows, int nCols )
+{
+    Clear();
+
+    char var[256];
+    sprintf(var, "%s_nSubspaces", prefix);
+    int nSubspaces = cvReadIntByName( storage, 0, var, 0 );
+    if ( nSubspaces <= 0 || nSubspaces > nCols )
+        return false;
+
+    sprintf(var, "%s_Codebooks", prefix);
+    CvMat* codebooks = (CvMat*)cvReadByName( storage, 0, var, 0 );
+    sprintf(var, "%s_Codes", prefix);
+    CvMat* codes = (CvMat*)cvReadByName( storage, 0, var, 0 );
+
+    if ( !Attach(codebooks, codes, nRows, nCols) || m_nSubspaces != nSubspaces )
+    {
+        Clear();
+        return false;
+    }
+
+    return true;
+}
+
+
+
+/*
+   Function:   Attach
+   Purpose:    use codebooks and codes that were made by Train, Read and the
+               binary database both load them this way
+   Notes:      the matrices are ours afterwards even if they are no good.  They can
+               be headers over memory we do not own, such as a mapped file
+   Returns:    false if they were made for another gallery
+*/
+bool ProductQuantizer::Attach( CvMat* codebooks, CvMat* codes, int nRows, int nCols )
+{
+    Clear();
+
+    m_Codebooks = codebooks;
+    m_Codes = codes;
+
+    if ( !m_Codebooks || !m_Codes ||
+         CV_MAT_TYPE(m_Codebooks->type) != CV_32FC1 || m_Codebooks->cols != nCols ||
+         m_Codebooks->rows < 1 || m_Codebooks->rows > 256 ||
+         CV_MAT_TYPE(m_Codes->type) != CV_8UC1 || m_Codes->rows != nRows || m_Codes->cols < 1 || m_Codes->cols > nCols )
+    {
+        Clear();
+        return false;
+    }
+
+    SetSubspaces(nCols, m_Codes->cols);
+    m_nRows = nRows;
+    m_nCentroids = m_Codebooks->rows;
+
+    return true;
+}
+
+
+
+size_t ProductQuantizer::GetCodeBytes() const
+{
+    return (size_t)m_nRows * m_nSubspaces;
+}
+
+
+size_t ProductQuantizer::GetCodebookBytes() const
+{
+    return (size_t)m_nCentroids * m_nCols * sizeof(float);
+}
@@ -0,0 +1,69 @@
+#ifndef PRODUCTQUANTIZER_H
+#define PRODUCTQUANTIZER_H
+
+/*
+   ProductQuantizer.h
+   Description:   compressed copy of a gallery matrix.  The columns are split into
+                  subspaces, each subspace gets its own codebook of up to 256
+                  centroids and every row is stored as one byte per subspace.
+                  Queries are compared with the codes through a table of distances
+                  to the centroids (asymmetric distance), the best candidates can be
+                  re-ranked against the float rows if they are still in memory
+   Author:        Chris Leighton
+
+*/
+
+#include <vector>
+#include <cv.h>
+#include <cxcore.h>
+
+#include "DistanceKernel.h"
+
+
+class ProductQuantizer
+{
+public:
+    ProductQuantizer();
+    ~ProductQuantizer();
+
+    // learn the codebooks from nRows x nCols data and encode every row.  Each subspace
+    // covers about subspaceDims columns, nCentroids is capped at 256 and at nRows
+    void Train( const float* data, int nRows, int nCols, int subspaceDims, int nCentroids = 256 );
+
+    // k closest rows, closest first, distances are squared.  weights can be NULL for
+    // plain L2.  If exact is not NULL the nRerank best codes are re-scored against it
+    void Search( const float* query, const float* weights, int k, int nRerank,
+                 const float* exact, NeighbourVec& neighbours ) const;
+
+    // codebooks and codes are stored in the database under names starting with prefix.
+    // Read returns false if there is nothing stored or it does not fit nRows x nCols
+    void Write( CvFileStorage* storage, const char* prefix ) const;
+    bool Read( CvFileStorage* storage, const char* prefix, int nRows, int nCols );
+
+    // the binary database stores the matrices itself.  Attach takes them over, they
+    // may point into a mapped file, and returns false if they do not fit nRows x nCols
+    bool Attach( CvMat* codebooks, CvMat* codes, int nRows, int nCols );
+    const CvMat* GetCodebooks() const { return m_Codebooks; }
+    const CvMat* GetCodes() const { return m_Codes; }
+
+    int    GetnSubspaces() const { return m_nSubspaces; }
+    size_t GetCodeBytes() const;
+    size_t GetCodebookBytes() const;
+
+private:
+    void Clear();
+    void SetSubspaces( int nCols, int nSubspaces );
+    void Encode( const float* data );
+
+    int                 m_nRows;
+    int                 m_nCols;
+    int                 m_nSubspaces;
+    int                 m_nCentroids;
+    std::vector<int>    m_Offsets;      // first column of each subspace, plus nCols at the end
+
+    CvMat*              m_Codebooks;    // nCentroids x nCols, row c holds centroid c of every subspace
+    CvMat*              m_Codes;        // nRows x nSubspaces CV_8UC1
+};
+
+
+#endif
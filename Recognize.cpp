@@ -3,23 +3,36 @@
 #include "PreProcess.h"
 #include <fstream>
 #include "HTMLHelper.h"
+#include "DistanceKernel.h"
+#include <algorithm>
+
+
+// probes RecognizeBatch loads and projects together, bounds how many
+// preprocessed images are held at once
+static const int BATCH_WINDOW = 256;
 
 /*
    Function:   Recognize
    Purpose:    Recognize a face
    Arguments:  1) the image with the face to recognize 2) the trained database
-   Notes:      Function will return empty string if we don't find the person
+               last) true if the image is already cropped to the face
+   Notes:      Function will return empty string if we don't find the person.
+               Database::Read prepares the search, so a db that has changed search
+               mode since must have had PrepareSearch called
    Returns:    std::string with persons name we found
    Throws:     std::string if it can't open file or create memory
 */
-std::string Recognize( const char* image, const char* database, double& distance, std::string& resultsDir, int& idFound, Database* db, bool bCheckDistance )
+std::string Recognize( const char* image, const char* database, double& distance, std::string& resultsDir, int& idFound, Database* db, bool bCheckDistance,
+                       bool bSkipDetection )
 {
     std::string personFound = "";
+    PreProcessOptions options = GetPreProcessOptions();
+    options.m_bSkipDetection = options.m_bSkipDetection || bSkipDetection;
     try
     {
         if ( db )
         {
-            Recognizer r(db, image, database);
+            Recognizer r(db, image, database, options);
             // find the person
             std::string foundPerson = "";
 
@@ -28,7 +41,7 @@ std::string Recognize( const char* image, const char* database, double& distance
         }
         else
         {
-            Recognizer r(image, database);
+            Recognizer r(image, database, options);
             r.LoadTrainingDatabase();
 
             // find the person
@@ -48,6 +61,503 @@ std::string Recognize( const char* image, const char* database, double& distance
 
 
 
+/*
+   Function:   RecognizeBatch
+   Purpose:    Recognize the faces in many probe images against one loaded database
+   Arguments:  1) the probe images 2) a database that has already been read
+               3) same as Recognize 4) number of threads, 0 uses one per core
+               5) number of ranked candidates to return for each probe
+               6) true if the probes are already cropped to the face
+   Notes:      the database is only read while we search so every worker shares it.
+               Probes are done a window at a time: every image in the window is
+               loaded and preprocessed in parallel, all of the faces are projected
+               with one GEMM, then the searches run in parallel.  Errors are reported
+               per probe in m_Error so one bad image does not stop the batch
+   Returns:    one result per probe, in the same order as probes
+*/
+RecognizeResultVec RecognizeBatch( const std::vector<std::string>& probes, Database& db, bool bCheckDistance, int nThreads, int nCandidates,
+                                   bool bSkipDetection )
+{
+    PreProcessOptions options = GetPreProcessOptions();
+    options.m_bSkipDetection = options.m_bSkipDetection || bSkipDetection;
+
+    int nProbes = (int)probes.size();
+    RecognizeResultVec results(nProbes);
+    int nWorkers = GetNumWorkers(nThreads);
+    int nEigenVals = db.GetnEigenVals();
+
+    // anything the search needs is built now so the workers only read the database
+    db.PrepareSearch();
+
+    for ( int start = 0; start < nProbes; start += BATCH_WINDOW )
+    {
+        int count = std::min(BATCH_WINDOW, nProbes - start);
+        std::vector<Recognizer*> recognizers(count, (Recognizer*)NULL);
+
+        #pragma omp parallel for schedule(dynamic) num_threads(nWorkers)
+        for ( int i = 0; i < count; i++ )
+        {
+            RecognizeResult& result = results[start + i];
+            result.m_ImageName = probes[start + i];
+
+            try
+            {
+                recognizers[i] = new Recognizer(&db, probes[start + i].c_str(), NULL, options);
+            }
+            catch ( std::string err )
+            {
+                result.m_Error = err;
+            }
+            catch ( ... )
+            {
+                result.m_Error = "RecognizeBatch - unknown error";
+            }
+        }
+
+        // project every face we found in one go
+        std::vector<IplImage*> faces;
+        std::vector<int> faceOf(count, -1);
+        for ( int i = 0; i < count; i++ )
+        {
+            if ( recognizers[i] )
+            {
+                faceOf[i] = (int)faces.size();
+                faces.push_back(recognizers[i]->GetFace(0));
+            }
+        }
+
+        std::vector<float> projectedFaces(faces.size() * nEigenVals + 1);
+        try
+        {
+            if ( !faces.empty() )
+                db.ProjectFaces(&faces[0], (int)faces.size(), &projectedFaces[0], nWorkers);
+        }
+        catch ( std::string err )
+        {
+            for ( int i = 0; i < count; i++ )
+            {
+                if ( faceOf[i] >= 0 )
+                    results[start + i].m_Error = err;
+                faceOf[i] = -1;
+            }
+        }
+
+        #pragma omp parallel for schedule(dynamic) num_threads(nWorkers)
+        for ( int i = 0; i < count; i++ )
+        {
+            if ( faceOf[i] < 0 )
+                continue;
+
+            RecognizeResult& result = results[start + i];
+            float* projectedFace = &projectedFaces[(size_t)faceOf[i] * nEigenVals];
+
+            try
+            {
+                result.m_PersonName = recognizers[i]->FindProjectedFace(projectedFace, result.m_Distance, result.m_ID, bCheckDistance);
+                if ( nCandidates > 0 )
+                    recognizers[i]->FindProjectedFaces(projectedFace, nCandidates, result.m_Candidates);
+            }
+            catch ( std::string err )
+            {
+                result.m_Error = err;
+            }
+            catch ( ... )
+            {
+                result.m_Error = "RecognizeBatch - unknown error";
+            }
+        }
+
+        for ( int i = 0; i < count; i++ )
+            delete recognizers[i];
+    }
+
+    return results;
+}
+
+
+
+/*
+   Function:   BenchmarkSearch
+   Purpose:    compare the database's search mode with the exact scan
+   Arguments:  1) the probe images 2) a database that has already been read with
+               the search mode set 3) where to write the report
+   Notes:      probes are projected once up front so only the searches are timed.
+               recall@1 is how often the Mahalanobis match is the same row the
+               exact scan finds
+*/
+void BenchmarkSearch( const std::vector<std::string>& probes, Database& db, std::ostream& out )
+{
+    static const char* modeNames[] = { "Exact", "HNSW", "VPTree", "PQ", "SQ8", "Centroid", "Progressive" };
+    SearchMode mode = db.GetSearchMode();
+
+    db.PrepareSearch();
+
+    // project every probe we can find a face in, the first recognizer is kept to run the searches
+    std::vector< std::vector<float> > projectedFaces;
+    Recognizer* r = NULL;
+    for ( size_t i = 0; i < probes.size(); i++ )
+    {
+        try
+        {
+            Recognizer* probe = new Recognizer(&db, probes[i].c_str(), NULL);
+            std::vector<float> projectedFace;
+            try
+            {
+                probe->ProjectFace(0, projectedFace);
+            }
+            catch ( std::string )
+            {
+                delete probe;
+                throw;
+            }
+            projectedFaces.push_back(projectedFace);
+
+            if ( !r )
+                r = probe;
+            else
+                delete probe;
+        }
+        catch ( std::string err )
+        {
+            out << "Skipping " << probes[i] << ": " << err << std::endl;
+        }
+    }
+
+    if ( !r )
+    {
+        out << "BenchmarkSearch - no usable probes" << std::endl;
+        return;
+    }
+
+    int nProbes = (int)projectedFaces.size();
+    std::vector<int> exactIndex(nProbes);
+    std::vector<int> modeIndex(nProbes);
+    NeighbourVec neighbours;
+
+    double t = (double)cvGetTickCount();
+    for ( int i = 0; i < nProbes; i++ )
+    {
+        r->NearestFaces(&projectedFaces[i][0], 1, MahalanobisMetric, ExactSearch, neighbours);
+        exactIndex[i] = neighbours.empty() ? -1 : neighbours[0].m_Index;
+    }
+    double exact_ms = ((double)cvGetTickCount() - t) / ((double)cvGetTickFrequency() * 1000.0);
+
+    t = (double)cvGetTickCount();
+    for ( int i = 0; i < nProbes; i++ )
+    {
+        r->NearestFaces(&projectedFaces[i][0], 1, MahalanobisMetric, mode, neighbours);
+        modeIndex[i] = neighbours.empty() ? -1 : neighbours[0].m_Index;
+    }
+    double mode_ms = ((double)cvGetTickCount() - t) / ((double)cvGetTickFrequency() * 1000.0);
+
+    int nSame = 0;
+    for ( int i = 0; i < nProbes; i++ )
+    {
+        if ( exactIndex[i] == modeIndex[i] )
+            nSame++;
+    }
+
+    // how often the person the exact scan finds is not one of the people CentroidSearch looks at
+    int nShortlistMiss = 0;
+    if ( mode == CentroidSearch )
+    {
+        for ( int i = 0; i < nProbes; i++ )
+        {
+            if ( exactIndex[i] < 0 )
+                continue;
+
+            NeighbourVec people;
+            r->ShortlistPeople(&projectedFaces[i][0], MahalanobisMetric, db.GetShortlistSize(), people);
+
+            bool bFound = false;
+            for ( size_t j = 0; j < people.size() && !bFound; j++ )
+                bFound = personCentroidIDMatrix->data.i[people[j].m_Index] == personIDMatrix->data.i[exactIndex[i]];
+            if ( !bFound )
+                nShortlistMiss++;
+        }
+    }
+
+    out << "Search mode    : " << modeNames[mode] << std::endl;
+    if ( mode == HNSWSearch )
+        out << "ef             : " << db.GetSearchEf() << std::endl;
+    if ( mode == PQSearch && db.GetQuantizer(MahalanobisMetric) )
+    {
+        ProductQuantizer* pq = db.GetQuantizer(MahalanobisMetric);
+        size_t floatBytes = (size_t)db.GetnImages() * db.GetnEigenVals() * sizeof(float);
+        out << "Re-rank        : " << db.GetPQRerank() << std::endl;
+        out << "Gallery bytes  : " << floatBytes << " float, " << pq->GetCodeBytes() << " codes + "
+            << pq->GetCodebookBytes() << " codebooks" << std::endl;
+    }
+    if ( mode == CentroidSearch )
+    {
+        out << "Shortlist      : " << db.GetShortlistSize() << " of " << db.GetnCentroids() << " people" << std::endl;
+        out << "Shortlist miss : " << nShortlistMiss << " (" << (double)nShortlistMiss / (double)nProbes << ")" << std::endl;
+    }
+    if ( mode == SQ8Search && db.GetScalarQuantizer(MahalanobisMetric) )
+    {
+        size_t floatBytes = (size_t)db.GetnImages() * db.GetnEigenVals() * sizeof(float);
+        out << "Re-rank        : " << db.GetSQ8Rerank() << std::endl;
+        out << "Dot kernel     : " << GetDistanceKernel().m_DotName << std::endl;
+        out << "Gallery bytes  : " << floatBytes << " float, "
+            << db.GetScalarQuantizer(MahalanobisMetric)->GetCodeBytes() << " int8" << std::endl;
+    }
+    out << "Probes         : " << nProbes << std::endl;
+    out << "Recall@1       : " << (double)nSame / (double)nProbes << std::endl;
+    out << "Exact (ms)     : " << exact_ms << " (" << exact_ms / nProbes << " per probe)" << std::endl;
+    out << "Mode (ms)      : " << mode_ms << " (" << mode_ms / nProbes << " per probe)" << std::endl;
+
+    delete r;
+}
+
+
+
+/*
+   Function:   BenchmarkProgressive
+   Purpose:    compare ProgressiveNearestFace with projecting every component and scanning
+   Arguments:  1) the probe images 2) a database that has already been read
+               3) where to write the report
+   Notes:      both sides include the projection.  Each distance is reported with how
+               many components were needed before the winner was certain and how many
+               face components were compared, on average
+*/
+void BenchmarkProgressive( const std::vector<std::string>& probes, Database& db, std::ostream& out )
+{
+    static const char* metricNames[NUM_METRICS] = { "Euclidean", "Mahalanobis" };
+
+    SearchMode mode = db.GetSearchMode();
+    db.SetSearchMode(ProgressiveSearch);
+    db.PrepareSearch();
+    db.SetSearchMode(mode);
+
+    std::vector<Recognizer*> recognizers;
+    for ( size_t i = 0; i < probes.size(); i++ )
+    {
+        try
+        {
+            recognizers.push_back(new Recognizer(&db, probes[i].c_str(), NULL));
+        }
+        catch ( std::string err )
+        {
+            out << "Skipping " << probes[i] << ": " << err << std::endl;
+        }
+    }
+
+    int nProbes = (int)recognizers.size();
+    if ( nProbes == 0 )
+    {
+        out << "BenchmarkProgressive - no usable probes" << std::endl;
+        return;
+    }
+
+    out << "Chunk          : " << db.GetProgressiveChunk() << std::endl;
+    out << "Tolerance      : " << db.GetProgressiveTolerance() << std::endl;
+    out << "Probes         : " << nProbes << std::endl;
+
+    for ( int m = 0; m < NUM_METRICS; m++ )
+    {
+        DistanceMetric metric = (DistanceMetric)m;
+        std::vector<int> exactIndex(nProbes);
+        std::vector<float> projectedFace;
+        NeighbourVec neighbours;
+
+        double t = (double)cvGetTickCount();
+        for ( int i = 0; i < nProbes; i++ )
+        {
+            recognizers[i]->ProjectFace(0, projectedFace);
+            recognizers[i]->NearestFaces(&projectedFace[0], 1, metric, ExactSearch, neighbours);
+            exactIndex[i] = neighbours.empty() ? -1 : neighbours[0].m_Index;
+        }
+        double exact_ms = ((double)cvGetTickCount() - t) / ((double)cvGetTickFrequency() * 1000.0);
+
+        int nSame = 0;
+        double nComponents = 0.0;
+        double nCompared = 0.0;
+        t = (double)cvGetTickCount();
+        for ( int i = 0; i < nProbes; i++ )
+        {
+            Neighbour best;
+            double compared = 0.0;
+            nComponents += recognizers[i]->ProgressiveNearestFace(0, metric, DBL_MAX, best, &compared);
+            nCompared += compared;
+            if ( best.m_Index == exactIndex[i] )
+                nSame++;
+        }
+        double progressive_ms = ((double)cvGetTickCount() - t) / ((double)cvGetTickFrequency() * 1000.0);
+
+        out << metricNames[m] << ":" << std::endl;
+        out << "  Recall@1     : " << (double)nSame / (double)nProbes << std::endl;
+        out << "  Components   : " << nComponents / nProbes << " of " << db.GetnEigenVals() << " on average" << std::endl;
+        out << "  Compared     : " << nCompared / nProbes << " of " << (double)db.GetnImages() * db.GetnEigenVals()
+            << " face components on average" << std::endl;
+        out << "  Full (ms)    : " << exact_ms << " (" << exact_ms / nProbes << " per probe)" << std::endl;
+        out << "  Progressive  : " << progressive_ms << " (" << progressive_ms / nProbes << " per probe)" << std::endl;
+    }
+
+    for ( int i = 0; i < nProbes; i++ )
+        delete recognizers[i];
+}
+
+
+
+/*
+   Function:   BenchmarkStoragePrecision
+   Purpose:    compare a float binary database with the float16 and bfloat16 ones
+   Arguments:  1) the probe images 2) the person id of each probe, empty if not known
+               3) the database to compare 4) where to write the report
+   Notes:      databaseName is written next to itself as a binary database in each
+               precision, under names ending .benchmark.f32.edb and so on that are
+               removed again when we are done.  For each one the file size, basis memory, read time and
+               projection time per probe are reported, with how far the projected
+               coefficients and the matches moved from the float ones.  Files are read
+               just after they are written so the read times are with a warm cache
+*/
+void BenchmarkStoragePrecision( const std::vector<std::string>& probes, const std::vector<int>& trueIDs, const std::string& databaseName, std::ostream& out )
+{
+    static const char* precisionNames[] = { "float32", "float16", "bfloat16" };
+    static const char* suffixes[] = { ".f32", ".f16", ".bf16" };
+
+    std::vector<std::string> written;
+    std::vector<Recognizer*> recognizers;
+    std::vector<int> usable;
+    std::vector< std::vector<float> > floatProjected;
+    std::vector<int> floatIDs;
+    long floatBytes = 0;
+
+    out << "Half kernel    : " << GetDistanceKernel().m_HalfName << std::endl;
+
+    // the copies, and the recognizers when something throws, are cleaned up below
+    try
+    {
+        for ( int p = 0; p < 3; p++ )
+        {
+            StoragePrecision precision = (StoragePrecision)p;
+            std::string name = databaseName + ".benchmark" + suffixes[p] + BINARY_DATABASE_EXT;
+            written.push_back(name);
+            {
+                Database db;
+                db.Read(databaseName);
+                db.SetStoragePrecision(precision);
+                db.Write(name);
+            }
+
+            long fileBytes = 0;
+            FILE* in = fopen(name.c_str(), "rb");
+            if ( in )
+            {
+                fseek(in, 0, SEEK_END);
+                fileBytes = ftell(in);
+                fclose(in);
+            }
+
+            double t = (double)cvGetTickCount();
+            Database db;
+            db.Read(name);
+            double read_ms = ((double)cvGetTickCount() - t) / ((double)cvGetTickFrequency() * 1000.0);
+
+            // the faces do not depend on the database, a probe that fails once fails every time
+            int nCandidates = p == 0 ? (int)probes.size() : (int)usable.size();
+            for ( int c = 0; c < nCandidates; c++ )
+            {
+                int i = p == 0 ? c : usable[c];
+                try
+                {
+                    recognizers.push_back(new Recognizer(&db, probes[i].c_str(), NULL));
+                    if ( p == 0 )
+                        usable.push_back(i);
+                }
+                catch ( std::string err )
+                {
+                    out << "Skipping " << probes[i] << ": " << err << std::endl;
+                }
+            }
+
+            int nProbes = (int)recognizers.size();
+            if ( nProbes == 0 )
+            {
+                out << "BenchmarkStoragePrecision - no usable probes" << std::endl;
+                break;
+            }
+
+            std::vector< std::vector<float> > projected(nProbes);
+            t = (double)cvGetTickCount();
+            for ( int i = 0; i < nProbes; i++ )
+                recognizers[i]->ProjectFace(0, projected[i]);
+            double project_ms = ((double)cvGetTickCount() - t) / ((double)cvGetTickFrequency() * 1000.0);
+
+            int nCorrect = 0;
+            int nChanged = 0;
+            double errorSum = 0.0;
+            double floatSum = 0.0;
+            double largestError = 0.0;
+            for ( int i = 0; i < nProbes; i++ )
+            {
+                double distance;
+                int id = 0;
+                recognizers[i]->FindProjectedFace(&projected[i][0], distance, id, true);
+
+                if ( p == 0 )
+                {
+                    floatProjected.push_back(projected[i]);
+                    floatIDs.push_back(id);
+                }
+                else
+                {
+                    if ( id != floatIDs[i] )
+                        nChanged++;
+
+                    for ( size_t j = 0; j < projected[i].size(); j++ )
+                    {
+                        double d = (double)projected[i][j] - floatProjected[i][j];
+                        errorSum += d*d;
+                        floatSum += (double)floatProjected[i][j]*floatProjected[i][j];
+                        largestError = std::max(largestError, fabs(d));
+                    }
+                }
+
+                if ( !trueIDs.empty() && id == trueIDs[usable[i]] )
+                    nCorrect++;
+            }
+
+            if ( p == 0 )
+                floatBytes = fileBytes;
+
+            out << precisionNames[p] << ":" << std::endl;
+            out << "  File bytes   : " << fileBytes;
+            if ( p > 0 && floatBytes > 0 )
+                out << " (" << (double)fileBytes / (double)floatBytes << " of float)";
+            out << std::endl;
+            out << "  Basis bytes  : " << db.GetBasisBytes() << std::endl;
+            out << "  Read (ms)    : " << read_ms << std::endl;
+            out << "  Project (ms) : " << project_ms << " (" << project_ms / nProbes << " per probe)" << std::endl;
+            if ( p > 0 )
+            {
+                out << "  Coefficients : " << (floatSum > 0.0 ? sqrt(errorSum / floatSum) : 0.0) << " relative rms error, "
+                    << largestError << " largest" << std::endl;
+                out << "  Matches      : " << nChanged << " of " << nProbes << " changed from float" << std::endl;
+            }
+            if ( !trueIDs.empty() )
+                out << "  Accuracy     : " << (double)nCorrect / (double)nProbes << std::endl;
+
+            for ( int i = 0; i < nProbes; i++ )
+                delete recognizers[i];
+            recognizers.clear();
+        }
+    }
+    catch ( ... )
+    {
+        for ( size_t i = 0; i < recognizers.size(); i++ )
+            delete recognizers[i];
+        for ( size_t i = 0; i < written.size(); i++ )
+            remove(written[i].c_str());
+        throw;
+    }
+
+    for ( size_t i = 0; i < written.size(); i++ )
+        remove(written[i].c_str());
+}
+
+
+
 /*
    Function:   Recognizer class constructor
    Purpose:
@@ -55,11 +565,16 @@ std::string Recognize( const char* image, const char* database, double& distance
    Notes:
    Throws:     std::string if it can't open file or create memory
 */
-Recognizer::Recognizer( const char* imagename, const char* databasename ) : m_DatabaseName(databasename), m_pDatabase(NULL), m_SearchImageName(imagename),
-                        m_FaceImage(NULL), m_nFacesToFind(0), m_IDFound(0), m_DistanceFound(0.0), m_PersonFound(""), m_bDeleteDb(true)
+Recognizer::Recognizer( const char* imagename, const char* databasename, const PreProcessOptions& options ) : m_DatabaseName(databasename), m_pDatabase(NULL), m_SearchImageName(imagename),
+                        m_FaceImage(NULL), m_FacesToFind(NULL), m_nFacesToFind(0), m_IDFound(0), m_DistanceFound(0.0), m_PersonFound(""), m_bDeleteDb(true)
 {
-    IplImage* tempface = cvLoadImage(imagename,CV_LOAD_IMAGE_GRAYSCALE);
-    PreProcess(tempface, &m_FaceImage);
+    if ( !LoadAndPreProcess(imagename, &m_FaceImage, options) )
+    {
+        std::string err;
+        err = "Recognizer could not load image: ";
+        err += imagename;
+        throw err;
+    }
     if ( m_FaceImage )
     {
         m_nFacesToFind = 1;
@@ -78,11 +593,16 @@ Recognizer::Recognizer( const char* imagename, const char* databasename ) : m_Da
 }
 
 
-Recognizer::Recognizer( Database* db, const char* imagename, const char* databasename) : m_DatabaseName(databasename), m_SearchImageName(imagename),
-                        m_FaceImage(NULL), m_nFacesToFind(0), m_IDFound(0), m_DistanceFound(0.0), m_PersonFound(""), m_bDeleteDb(false)
+Recognizer::Recognizer( Database* db, const char* imagename, const char* databasename, const PreProcessOptions& options ) : m_DatabaseName(databasename), m_SearchImageName(imagename),
+                        m_FaceImage(NULL), m_FacesToFind(NULL), m_nFacesToFind(0), m_IDFound(0), m_DistanceFound(0.0), m_PersonFound(""), m_bDeleteDb(false)
 {
-    IplImage* tempface = cvLoadImage(imagename,CV_LOAD_IMAGE_GRAYSCALE);
-    PreProcess(tempface, &m_FaceImage);
+    if ( !LoadAndPreProcess(imagename, &m_FaceImage, options) )
+    {
+        std::string err;
+        err = "Recognizer could not load image: ";
+        err += imagename;
+        throw err;
+    }
     if ( m_FaceImage )
     {
         m_nFacesToFind = 1;
@@ -110,6 +630,8 @@ Recognizer::~Recognizer()
 {
     // release the image with all of the faces
     cvReleaseImage(&m_FaceImage);
+    if ( m_FacesToFind )
+        cvFree(&m_FacesToFind);
 
     if ( m_bDeleteDb && m_pDatabase )
         delete m_pDatabase;
@@ -134,39 +656,64 @@ bool Recognizer::LoadTrainingDatabase()
 /*
    Function:   FindFace
    Purpose:    attempts to find a face in the database
+   Notes:      projects the face and calls FindProjectedFace
+   Returns:    name of person, if it finds it, empty if it does not find the face
+   throws:     std::string if faceNum is bad
+*/
+std::string Recognizer::FindFace( int faceNum, double& distance, int& idFound, bool bCheckDistance )
+{
+    // project the test face onto
+    // the PCA subspace so try to find a match
+    std::vector<float> projectedTestFace;  // this is the face that results from projecting the new face onto the subspace
+    if ( m_pDatabase->GetSearchMode() == ProgressiveSearch )
+    {
+        // the threshold is on the square rooted distance, the search works with squares
+        double threshold = m_pDatabase->GetMahalanobisThreshold();
+        Neighbour best;
+        ProgressiveNearestFace(faceNum, MahalanobisMetric, bCheckDistance ? threshold*threshold : DBL_MAX, best);
+
+        return AcceptMatch(best.m_Index, sqrt(best.m_Distance), distance, idFound, bCheckDistance);
+    }
+
+    ProjectFace(faceNum, projectedTestFace);
+
+    return FindProjectedFace(&projectedTestFace[0], distance, idFound, bCheckDistance);
+}
+
+
+
+/*
+   Function:   FindProjectedFace
+   Purpose:    attempts to find a face that has already been projected in the database
    Notes:      this function uses distance to determine how
                confident we are with the closest face, the threshold value can be adjusted
                to try to prevent false positive results
    Returns:    name of person, if it finds it, empty if it does not find the face
    throws:
 */
-std::string Recognizer::FindFace( int faceNum, double& distance, int& idFound, bool bCheckDistance )
+std::string Recognizer::FindProjectedFace( float* projectedFace, double& distance, int& idFound, bool bCheckDistance )
 {
-    std::string personName = "";
-    int nEigenVals = m_pDatabase->GetnEigenVals();
-    int nImages = m_pDatabase->GetnImages();
-    int nPeople = m_pDatabase->GetnPeople();
-    Database::NameVec& namesVec = m_pDatabase->GetNames();
-    double mahalanobisThreshold = m_pDatabase->GetMahalanobisThreshold();
-    double euclideanThreshold = m_pDatabase->GetEuclideanThreshold();
+    // only the Mahalanobis match is used, the Euclidean one gave too many false positives
+    double matchDistance = 0.0;
+    int matchIndex = MahalanobisDistance(projectedFace, matchDistance);
 
-    // project the test face onto
-    // the PCA subspace so try to find a match
-    if ( faceNum < 0 || faceNum >= m_nFacesToFind )
-        throw std::string("Recognizer::FindFace - Invalid face number argument");
+    return AcceptMatch(matchIndex, matchDistance, distance, idFound, bCheckDistance);
+}
 
-    float *projectedFace = NULL;  // this is the face that results from projecting the new face onto the subspace
-    projectedFace = (float*)cvAlloc(nEigenVals*sizeof(float));
 
-    cvEigenDecomposite(m_FacesToFind[faceNum], nEigenVals, eigenVectorArray, 0, 0, averageImage, projectedFace );
 
-    int 		e_index = 0; // index that results from using EuclideanDistance
-    int 		m_index = 0; // index that results from using MahalanobisDistance
-    double 	    e_distance = 0.0;
-    double      m_distance = 0.0;
 
-    e_index = EuclideanDistance(projectedFace, e_distance);
-    m_index = MahalanobisDistance(projectedFace, m_distance);
+/*
+   Function:   AcceptMatch
+   Purpose:    decide whether the closest face is close enough and record the result
+   Arguments:  1) row of the closest face 2) its Mahalanobis distance, square rooted
+   Returns:    name of person, empty if the match is not good enough
+*/
+std::string Recognizer::AcceptMatch( int matchIndex, double matchDistance, double& distance, int& idFound, bool bCheckDistance )
+{
+    std::string personName = "";
+    Database::NameVec& namesVec = m_pDatabase->GetNames();
+    double mahalanobisThreshold = m_pDatabase->GetMahalanobisThreshold();
 
     // select the lowest distance
     int index = 0;  // the index that we will use
@@ -183,10 +730,10 @@ std::string Recognizer::FindFace( int faceNum, double& distance, int& idFound, b
         std::cout << "Using Euclidean Distance" << std::endl;
         } ////////////////// Not using Euclidean Distance - too many false positive results
         else*/
-        if ( m_distance <= mahalanobisThreshold )
+        if ( matchDistance <= mahalanobisThreshold )
         {
-            index = m_index;
-            distance = m_distance;
+            index = matchIndex;
+            distance = matchDistance;
             bGoodDistance = true;
         }
         if ( bGoodDistance )
@@ -202,69 +749,84 @@ std::string Recognizer::FindFace( int faceNum, double& distance, int& idFound, b
     }
     else
     {
-        int id = personIDMatrix->data.i[m_index];
-        personName = namesVec[m_index];
-        distance = m_distance;
+        int id = personIDMatrix->data.i[matchIndex];
+        personName = namesVec[matchIndex];
+        distance = matchDistance;
         m_IDFound = id;
         idFound = id;
     }
     m_PersonFound = personName;
     m_DistanceFound = distance;
 
+    return personName;
+}
 
 
-    ///////////////////CLUSTER TEST CODE///////////////////
 
-    // kmeans2 -
-    // samples = prejectedFaceMatrix
-    // nclusters = nPeople
+/*
+   Function:   FindFaces
+   Purpose:    find the k closest faces in the database
+   Notes:      candidates are sorted closest first, this does not check the thresholds.
+               Mahalanobis distances are square rooted like FindFace does
+   throws:     std::string if faceNum is bad
+*/
+void Recognizer::FindFaces( int faceNum, int k, CandidateVec& candidates, bool bMahalanobis )
+{
+    std::vector<float> projectedTestFace;
+    ProjectFace(faceNum, projectedTestFace);
 
-    /*CvMat* clusters = cvCreateMat(nImages, 1, CV_32SC1);
-    CvTermCriteria crit = cvTermCriteria( CV_TERMCRIT_EPS+CV_TERMCRIT_ITER, 10000, 1.0 );
+    FindProjectedFaces(&projectedTestFace[0], k, candidates, bMahalanobis);
+}
 
 
-    // calculate means for each projected face
-    double *projectedMeans = new double[nImages];
-    for ( int row = 0; row < nImages; row++ )
-    {
-        double total = 0.0;
-        for ( int col = 0; col < nEigenVals; col++ )
-        {
-            total += projectedFaceMatrix->data.fl[row*nEigenVals+col];
-        }
 
-        projectedMeans[row] = total/(double)nEigenVals;
-        //cout << "Mean for image " << row+1 << " ID: " << personIDMatrix->data.i[row] << " is: " << projectedMeans[row] << std::endl;
-    }
+/*
+   Function:   FindProjectedFaces
+   Purpose:    find the k closest faces to a face that has already been projected
+   Notes:      same as FindFaces
+*/
+void Recognizer::FindProjectedFaces( float* projectedFace, int k, CandidateVec& candidates, bool bMahalanobis )
+{
+    Database::NameVec& namesVec = m_pDatabase->GetNames();
 
+    NeighbourVec neighbours;
+    NearestFaces(projectedFace, k, bMahalanobis ? MahalanobisMetric : EuclideanMetric,
+                 m_pDatabase->GetSearchMode(), neighbours);
 
-    // output projected values to disk (transposed)
-    std::ofstream out("projectedValues.csv");
-    CvMat* projectedFaceMatrixT = cvCreateMat(nEigenVals, nImages, CV_32FC1);
-    cvTranspose(projectedFaceMatrix, projectedFaceMatrixT);
-    for ( int row = 0; row < nEigenVals; row++ )
+    candidates.clear();
+    for ( size_t i = 0; i < neighbours.size(); i++ )
     {
-        for ( int col = 0; col < nImages; col++ )
-        {
-            out << projectedFaceMatrixT->data.fl[row*nImages+col] << ", ";
-        }
-        out << std::endl;
+        int index = neighbours[i].m_Index;
+
+        Candidate c;
+        c.m_Index = index;
+        c.m_ID = personIDMatrix->data.i[index];
+        c.m_PersonName = namesVec[index];
+        c.m_ImageName = m_pDatabase->GetImageName(index);
+        c.m_Distance = bMahalanobis ? sqrt(neighbours[i].m_Distance) : neighbours[i].m_Distance;
+        candidates.push_back(c);
     }
-    cvReleaseMat(&projectedFaceMatrixT);
-    out.close();
+}
 
 
-    cvKMeans2(projectedFaceMatrix, nPeople, clusters, crit);
 
-    /*for ( int i = 0; i < nImages; i++ )
-    {
-        std::cout << "Image ID: " << personIDMatrix->data.i[i] << " Clusters to: " << (clusters->data.i[i] + 1) << std::endl;
-    }
+/*
+   Function:   ProjectFace
+   Purpose:    project one of the faces to find onto the PCA subspace
+   Notes:      projectedFace is resized to nEigenVals
+   throws:     std::string if faceNum is bad
+*/
+void Recognizer::ProjectFace( int faceNum, std::vector<float>& projectedFace )
+{
+    if ( faceNum < 0 || faceNum >= m_nFacesToFind )
+        throw std::string("Recognizer::ProjectFace - Invalid face number argument");
 
-    delete projectedMeans; */
-    return personName;
-}
+    int nEigenVals = m_pDatabase->GetnEigenVals();
+    projectedFace.resize(nEigenVals);
 
+    // one face is a single row GEMM, threads would cost more than they save
+    m_pDatabase->ProjectFaces(&m_FacesToFind[faceNum], 1, &projectedFace[0], 1);
+}
 
 
 
@@ -277,76 +839,267 @@ std::string Recognizer::FindFace( int faceNum, double& distance, int& idFound, b
 */
 int Recognizer::EuclideanDistance( float* projectedTestFace, double& distance )
 {
-    double bestChoiceDiff = DBL_MAX;
-    int bestIndex = 0;
+    NeighbourVec neighbours;
+    NearestFaces(projectedTestFace, 1, EuclideanMetric, m_pDatabase->GetSearchMode(), neighbours);
+
+    distance = neighbours.empty() ? DBL_MAX : neighbours[0].m_Distance;
+    return neighbours.empty() ? 0 : neighbours[0].m_Index;
+}
+
+
+
+
+/*
+   Function:  MahalanobisDistance
+   Purpose:   find closest image and person using Mahalanobis distance
+   Notes:     fills in distance.  If the database has a whitened gallery the probe
+              is whitened once and we do the same L2 search as EuclideanDistance,
+              otherwise the eigen values are inverted once so the scan only multiplies
+   Returns:   index of person found
+
+*/
+int Recognizer::MahalanobisDistance( float* projectedTestFace, double& distance )
+{
+    NeighbourVec neighbours;
+    NearestFaces(projectedTestFace, 1, MahalanobisMetric, m_pDatabase->GetSearchMode(), neighbours);
+
+    distance = neighbours.empty() ? DBL_MAX : sqrt(neighbours[0].m_Distance);
+    return neighbours.empty() ? 0 : neighbours[0].m_Index;
+}
+
+
+
+/*
+   Function:  NearestFaces
+   Purpose:   find the k closest images with either distance
+   Notes:     neighbours hold squared distances, closest first.  ExactSearch scans every
+              face, dropping a row once it is further away than the k-th best so far.
+              HNSWSearch walks the graph, TreeSearch the VP tree, PQSearch and SQ8Search
+              scan the codes, Database::Read prepares them for the Mahalanobis metric and the
+              first Euclidean search prepares them for that.  CentroidSearch only scans the
+              faces of the closest few people
+*/
+void Recognizer::NearestFaces( float* projectedTestFace, int k, DistanceMetric metric, SearchMode mode, NeighbourVec& neighbours )
+{
     int nEigenVals = m_pDatabase->GetnEigenVals();
     int nImages = m_pDatabase->GetnImages();
 
-    for ( int row = 0; row < nImages; row++ )
+    // nothing is built for the Euclidean metric until it is searched with
+    if ( metric == EuclideanMetric && mode == m_pDatabase->GetSearchMode() &&
+         ( mode == HNSWSearch || mode == TreeSearch || mode == PQSearch || mode == SQ8Search ) )
+        m_pDatabase->PrepareSearch(EuclideanMetric);
+
+    std::vector<float> query;
+    m_pDatabase->MakeQuery(metric, projectedTestFace, query);
+
+    HNSWIndex* index = m_pDatabase->GetHNSWIndex(metric);
+    VPTree* tree = m_pDatabase->GetVPTree(metric);
+    ProductQuantizer* pq = m_pDatabase->GetQuantizer(metric);
+    ScalarQuantizer* sq = m_pDatabase->GetScalarQuantizer(metric);
+    if ( mode == PQSearch && pq )
     {
-        double distance = 0.0;
+        pq->Search(&query[0], m_pDatabase->GetGalleryWeights(metric), k, m_pDatabase->GetPQRerank(),
+                   m_pDatabase->GetGallery(metric), neighbours);
+    }
+    else if ( m_pDatabase->IsFloatGalleryReleased() )
+    {
+        throw std::string("Recognizer::NearestFaces - the float gallery has been released, use PQSearch");
+    }
+    else if ( mode == CentroidSearch && m_pDatabase->GetnCentroids() > 0 )
+    {
+        NeighbourVec people;
+        ShortlistPeople(projectedTestFace, metric, m_pDatabase->GetShortlistSize(), people);
 
-        for ( int col = 0; col < nEigenVals; col++ )
+        std::vector<int> rows;
+        for ( size_t i = 0; i < people.size(); i++ )
         {
-            // subtract each projected face's coefficient value to find out
-            // how close they are
-            float d = projectedTestFace[col] - projectedFaceMatrix->data.fl[row*nEigenVals + col];
-            distance += d*d;
+            const std::vector<int>& personRows = m_pDatabase->GetCentroidRows(people[i].m_Index);
+            rows.insert(rows.end(), personRows.begin(), personRows.end());
         }
 
-        if ( distance < bestChoiceDiff )
-        {
-            bestChoiceDiff = distance;
-            bestIndex = row;
-        }
+        NearestRowsOf(&query[0], m_pDatabase->GetGallery(metric), rows, nEigenVals,
+                      m_pDatabase->GetGalleryWeights(metric), k, neighbours);
+    }
+    else if ( mode == SQ8Search && sq )
+    {
+        sq->Search(&query[0], k, m_pDatabase->GetSQ8Rerank(), m_pDatabase->GetGallery(metric), neighbours);
+    }
+    else if ( mode == HNSWSearch && index )
+    {
+        index->Search(&query[0], k, m_pDatabase->GetSearchEf(), neighbours);
     }
+    else if ( mode == TreeSearch && tree )
+    {
+        tree->Search(&query[0], k, neighbours);
+    }
+    else
+    {
+        NearestRows(&query[0], m_pDatabase->GetGallery(metric), nImages, nEigenVals,
+                    m_pDatabase->GetGalleryWeights(metric), k, neighbours);
+    }
+}
 
-    distance = bestChoiceDiff;
 
-    return bestIndex;
-}
 
+/*
+   Function:  ShortlistPeople
+   Purpose:   find the M people whose mean face is closest to the probe
+   Notes:     people hold rows of personCentroidMatrix and squared distances, closest first
+*/
+void Recognizer::ShortlistPeople( float* projectedTestFace, DistanceMetric metric, int M, NeighbourVec& people )
+{
+    std::vector<float> query;
+    m_pDatabase->MakeQuery(metric, projectedTestFace, query);
+
+    NearestRows(&query[0], m_pDatabase->GetCentroids(metric), m_pDatabase->GetnCentroids(),
+                m_pDatabase->GetnEigenVals(), m_pDatabase->GetGalleryWeights(metric), M, people);
+}
 
 
 
 /*
-   Function:  MahalanobisDistance
-   Purpose:   find closest image and person using Mahalanobis distance
-   Notes:     fills in distance
-   Returns:   index of person found
-
+   Function:  ProgressiveNearestFace
+   Purpose:   find the closest face without comparing the probe with every component
+              of every face
+   Arguments: 1) face to find 2) distance to use 3) squared distance the match is
+              checked against, DBL_MAX if it is not 4) filled with the row found and
+              its squared distance 5) if not NULL, gets the number of face components
+              compared
+   Notes:     the probe is projected once, then the faces are compared a chunk of
+              components at a time, largest eigen value first.  The probe's and each
+              face's weighted energy in the components not compared yet give lower and
+              upper bounds on the face's full distance by the triangle inequality.
+              Faces whose lower bound is above the best upper bound are dropped.  We
+              stop when nothing left can beat the best face (within the database's
+              tolerance) and it is certain which side of the threshold it is on, then
+              finish the best face's distance so the one returned is exact.  The
+              bounds only use the coefficients, so they hold whatever precision the
+              basis is stored in
+   Returns:   number of components compared before the best face was certain
+   throws:    std::string if faceNum is bad or PrepareSearch has not been called
 */
-int Recognizer::MahalanobisDistance( float* projectedTestFace, double& distance )
+int Recognizer::ProgressiveNearestFace( int faceNum, DistanceMetric metric, double threshold, Neighbour& best,
+                                        double* pnCompared )
 {
-    double bestChoiceDiff = DBL_MAX;
-    int bestIndex = 0;
+    if ( faceNum < 0 || faceNum >= m_nFacesToFind )
+        throw std::string("Recognizer::ProgressiveNearestFace - Invalid face number argument");
+
+    const float* suffixEnergy = m_pDatabase->GetSuffixEnergy(metric);
+    if ( !suffixEnergy || m_pDatabase->IsFloatGalleryReleased() )
+        throw std::string("Recognizer::ProgressiveNearestFace - PrepareSearch has not been called for ProgressiveSearch");
+
+    const DistanceKernel& kernel = GetDistanceKernel();
     int nEigenVals = m_pDatabase->GetnEigenVals();
     int nImages = m_pDatabase->GetnImages();
+    int chunk = m_pDatabase->GetProgressiveChunk();
+    int nBounds = m_pDatabase->GetnChunkBounds();
+    double tolerance = m_pDatabase->GetProgressiveTolerance();
+    const float* weights = m_pDatabase->GetProjectedWeights(metric);
+    const float* gallery = projectedFaceMatrix->data.fl;
 
+    // the energies are summed in float, the slack keeps the bounds on the safe side
+    const double slack = 1e-4;
+
+    std::vector<float> coefficients;
+    ProjectFace(faceNum, coefficients);
+
+    // the probe's weighted energy from each chunk boundary on
+    std::vector<double> probeEnergy(nBounds, 0.0);
+    for ( int b = nBounds - 2; b >= 0; b-- )
+    {
+        double total = probeEnergy[b+1];
+        for ( int col = b*chunk; col < std::min((b+1)*chunk, nEigenVals); col++ )
+            total += (weights ? weights[col] : 1.0) * coefficients[col] * coefficients[col];
+        probeEnergy[b] = total;
+    }
+
+    std::vector<double> partial(nImages, 0.0);
+    std::vector<double> lower(nImages, 0.0);
+    std::vector<int> alive(nImages);
     for ( int row = 0; row < nImages; row++ )
+        alive[row] = row;
+
+    best.m_Index = 0;
+    best.m_Distance = DBL_MAX;
+    double nCompared = 0.0;
+
+    for ( int b = 0; b*chunk < nEigenVals && !alive.empty(); b++ )
     {
-        double distance = 0.0;
+        int first = b*chunk;
+        int count = std::min(chunk, nEigenVals - first);
+
+        for ( size_t i = 0; i < alive.size(); i++ )
+        {
+            const float* row = gallery + (size_t)alive[i]*nEigenVals;
+            partial[alive[i]] += weights ? kernel.WeightedL2Sqr(&coefficients[first], row + first, weights + first, count)
+                                         : kernel.L2Sqr(&coefficients[first], row + first, count);
+        }
+        nCompared += (double)alive.size()*count;
 
-        for ( int col = 0; col < nEigenVals; col++ )
+        if ( first + count == nEigenVals )
+            break;
+
+        double probeRest = sqrt(probeEnergy[b+1]);
+        double bestUpper = DBL_MAX;
+        int bestRow = alive[0];
+        for ( size_t i = 0; i < alive.size(); i++ )
+        {
+            int row = alive[i];
+            double faceRest = sqrt((double)suffixEnergy[(size_t)row*nBounds + b+1]);
+            double upper = (partial[row] + (probeRest + faceRest)*(probeRest + faceRest)) * (1.0 + slack);
+            lower[row] = (partial[row] + (probeRest - faceRest)*(probeRest - faceRest)) * (1.0 - slack);
+            if ( upper < bestUpper )
+            {
+                bestUpper = upper;
+                bestRow = row;
+            }
+        }
+
+        // drop the faces that cannot win, and find the closest one can get to the best
+        double nextLower = DBL_MAX;
+        size_t nAlive = 0;
+        for ( size_t i = 0; i < alive.size(); i++ )
         {
-            // subtract each eigenvector value to find out
-            // how close they are
-            float d = projectedTestFace[col] - projectedFaceMatrix->data.fl[row*nEigenVals + col];
+            int row = alive[i];
+            if ( lower[row] > bestUpper )
+                continue;
 
-            distance += d*d / eigenValueMatrix->data.fl[col];
+            alive[nAlive++] = row;
+            if ( row != bestRow )
+                nextLower = std::min(nextLower, lower[row]);
         }
-        distance = sqrt(distance);
+        alive.resize(nAlive);
 
-        if ( distance < bestChoiceDiff )
+        bool bWinner = nextLower == DBL_MAX || nextLower*(1.0 + tolerance) >= bestUpper;
+        bool bThreshold = threshold == DBL_MAX || bestUpper <= threshold || lower[bestRow] > threshold;
+        if ( bWinner && bThreshold )
         {
-            bestChoiceDiff = distance;
-            bestIndex = row;
+            // finish the winner so the distance reported is its real one
+            int rest = nEigenVals - (first + count);
+            const float* row = gallery + (size_t)bestRow*nEigenVals;
+            best.m_Index = bestRow;
+            best.m_Distance = partial[bestRow] +
+                (weights ? kernel.WeightedL2Sqr(&coefficients[first + count], row + first + count, weights + first + count, rest)
+                         : kernel.L2Sqr(&coefficients[first + count], row + first + count, rest));
+
+            if ( pnCompared )
+                *pnCompared = nCompared + rest;
+            return first + count;
         }
     }
 
-    distance = bestChoiceDiff;
+    for ( size_t i = 0; i < alive.size(); i++ )
+    {
+        if ( partial[alive[i]] < best.m_Distance )
+        {
+            best.m_Index = alive[i];
+            best.m_Distance = partial[alive[i]];
+        }
+    }
 
-    return bestIndex;
+    if ( pnCompared )
+        *pnCompared = nCompared;
+    return nEigenVals;
 }
 
 
@@ -354,7 +1107,8 @@ int Recognizer::MahalanobisDistance( float* projectedTestFace, double& distance
 /*
 function:	GenResults
 Purpose:	Generate html and image results for face search
-Notes:
+Notes:		eigenBasisMatrix and eigenVectorArray are NULL when the database has
+			a 16 bit basis, anything shown from them must check first
 */
 void Recognizer::GenResults(std::string& resultsDir)
 {
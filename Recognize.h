@@ -13,28 +13,87 @@
 
 #include "Utilities.h"
 #include "Database.h"
+#include "PreProcess.h"
+#include "DistanceKernel.h"
 
 
-std::string Recognize(const char* image, const char* database, double& distance, std::string& resultsdir, int& idFound, Database* db = NULL, bool bCheckDistance = true);
+std::string Recognize(const char* image, const char* database, double& distance, std::string& resultsdir, int& idFound, Database* db = NULL, bool bCheckDistance = true,
+                      bool bSkipDetection = false);
+
+
+// one ranked match for a probe
+struct Candidate
+{
+    int            m_Index;        // row in the database
+    int            m_ID;           // person id
+    std::string    m_PersonName;
+    std::string    m_ImageName;    // original image in the database
+    double         m_Distance;
+};
+
+typedef std::vector<Candidate> CandidateVec;
+
+
+// result of recognizing one probe image in a batch
+struct RecognizeResult
+{
+    std::string    m_ImageName;    // probe image
+    int            m_ID;           // person id found, 0 if we did not find anyone
+    std::string    m_PersonName;   // person found, empty if we did not find anyone
+    double         m_Distance;     // distance to the closest face
+    std::string    m_Error;        // set if the probe could not be processed
+    CandidateVec   m_Candidates;   // closest faces, closest first, if asked for
+
+    RecognizeResult() : m_ID(0), m_Distance(DBL_MAX) {}
+};
+
+typedef std::vector<RecognizeResult> RecognizeResultVec;
+
+RecognizeResultVec RecognizeBatch(const std::vector<std::string>& probes, Database& db, bool bCheckDistance = true, int nThreads = 0, int nCandidates = 0,
+                                  bool bSkipDetection = false);
+
+// time the database's search mode against the exact scan and report recall@1
+void BenchmarkSearch(const std::vector<std::string>& probes, Database& db, std::ostream& out);
+
+// time ProgressiveSearch against projecting every component, for both distances
+void BenchmarkProgressive(const std::vector<std::string>& probes, Database& db, std::ostream& out);
+
+// write databaseName as float, float16 and bfloat16 binary databases and compare their
+// size, read time, projection time and matches.  trueIDs can be empty
+void BenchmarkStoragePrecision(const std::vector<std::string>& probes, const std::vector<int>& trueIDs, const std::string& databaseName, std::ostream& out);
 
 
 
 class Recognizer
 {
 public:
-    Recognizer(const char* imagename, const char* databasename);
-    Recognizer( Database* db, const char* imagename, const char* databasename);
+    // options defaults to the ones set with SetPreProcessOptions
+    Recognizer(const char* imagename, const char* databasename, const PreProcessOptions& options = GetPreProcessOptions());
+    Recognizer( Database* db, const char* imagename, const char* databasename, const PreProcessOptions& options = GetPreProcessOptions());
     ~Recognizer();
 
 
     bool        LoadTrainingDatabase();
     std::string FindFace( int faceNum, double& distance, int& idFound, bool bCheckDistance );
+    std::string FindProjectedFace( float* projectedFace, double& distance, int& idFound, bool bCheckDistance );
+    void        FindFaces( int faceNum, int k, CandidateVec& candidates, bool bMahalanobis = true );
+    void        FindProjectedFaces( float* projectedFace, int k, CandidateVec& candidates, bool bMahalanobis = true );
+    void        ProjectFace( int faceNum, std::vector<float>& projectedFace );
     int         EuclideanDistance( float* projectedTestFace, double& distance );
     int         MahalanobisDistance( float* projectedTestFace, double& distance );
+    void        NearestFaces( float* projectedTestFace, int k, DistanceMetric metric, SearchMode mode, NeighbourVec& neighbours );
+    void        ShortlistPeople( float* projectedTestFace, DistanceMetric metric, int M, NeighbourVec& people );
+    int         ProgressiveNearestFace( int faceNum, DistanceMetric metric, double threshold, Neighbour& best,
+                                        double* pnCompared = NULL );
+
+    Database*   GetDatabase() { return m_pDatabase; }
+    IplImage*   GetFace( int faceNum ) { return m_FacesToFind[faceNum]; }
 
     void	    GenResults(std::string& resultsdir);
 
 private:
+    std::string AcceptMatch( int matchIndex, double matchDistance, double& distance, int& idFound, bool bCheckDistance );
+
     const char*             m_DatabaseName;
     Database*               m_pDatabase;
 
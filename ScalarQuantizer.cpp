@@ -0,0 +1,266 @@
+#include "ScalarQuantizer.h"
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <queue>
+#include <string>
+
+
+ScalarQuantizer::ScalarQuantizer() : m_nRows(0), m_nCols(0), m_Scales(NULL), m_Codes(NULL)
+{
+}
+
+
+ScalarQuantizer::~ScalarQuantizer()
+{
+    Clear();
+}
+
+
+void ScalarQuantizer::Clear()
+{
+    if ( m_Scales )
+        cvReleaseMat(&m_Scales);
+    if ( m_Codes )
+        cvReleaseMat(&m_Codes);
+
+    m_Scales = NULL;
+    m_Codes = NULL;
+    m_nRows = 0;
+    m_nCols = 0;
+    m_Weights.clear();
+    m_Norms.clear();
+}
+
+
+void ScalarQuantizer::SetWeights( const float* weights )
+{
+    if ( weights )
+        m_Weights.assign(weights, weights + m_nCols);
+    else
+        m_Weights.clear();
+}
+
+
+
+/*
+   Function:   Train
+   Purpose:    pick a scale for every column and store data as int8
+   Throws      std::string if the data is empty or memory cannot be allocated
+*/
+void ScalarQuantizer::Train( const float* data, int nRows, int nCols, const float* weights )
+{
+    if ( !data || nRows <= 0 || nCols <= 0 )
+        throw std::string("ScalarQuantizer::Train - no data to train with");
+
+    Clear();
+
+    m_nRows = nRows;
+    m_nCols = nCols;
+    m_Scales = cvCreateMat(1, nCols, CV_32FC1);
+    m_Codes = cvCreateMat(nRows, nCols, CV_8SC1);
+    if ( !m_Scales || !m_Codes )
+        throw std::string("ScalarQuantizer::Train could not allocate matrix");
+
+    float* scales = m_Scales->data.fl;
+    for ( int col = 0; col < nCols; col++ )
+        scales[col] = 0.0f;
+
+    for ( int row = 0; row < nRows; row++ )
+    {
+        const float* face = data + (size_t)row*nCols;
+        for ( int col = 0; col < nCols; col++ )
+            scales[col] = std::max(scales[col], (float)fabs(face[col]));
+    }
+
+    for ( int col = 0; col < nCols; col++ )
+        scales[col] = scales[col] > 0 ? scales[col] / 127.0f : 1.0f;
+
+    for ( int row = 0; row < nRows; row++ )
+    {
+        const float* face = data + (size_t)row*nCols;
+        signed char* code = (signed char*)(m_Codes->data.ptr + row*m_Codes->step);
+        for ( int col = 0; col < nCols; col++ )
+        {
+            int c = cvRound(face[col] / scales[col]);
+            code[col] = (signed char)std::max(-127, std::min(127, c));
+        }
+    }
+
+    SetWeights(weights);
+    ComputeNorms();
+}
+
+
+
+/*
+   Function:   ComputeNorms
+   Purpose:    weighted squared length of every decoded row, the only part of the
+               distance that does not depend on the query
+*/
+void ScalarQuantizer::ComputeNorms()
+{
+    const float* scales = m_Scales->data.fl;
+    m_Norms.resize(m_nRows);
+
+    for ( int row = 0; row < m_nRows; row++ )
+    {
+        const signed char* code = (const signed char*)(m_Codes->data.ptr + row*m_Codes->step);
+        double norm = 0.0;
+        for ( int col = 0; col < m_nCols; col++ )
+        {
+            double v = code[col] * scales[col];
+            norm += m_Weights.empty() ? v*v : v*v*m_Weights[col];
+        }
+        m_Norms[row] = (float)norm;
+    }
+}
+
+
+
+/*
+   Function:   Search
+   Purpose:    find the k rows closest to query
+   Notes:      |q-x|^2 = |q|^2 - 2 q.x + |x|^2.  The weights and column scales are
+               folded into the query, which is then stored as int16 so q.x is an
+               integer dot product against the codes.  |x|^2 was worked out when
+               the codes were made
+*/
+void ScalarQuantizer::Search( const float* query, int k, int nRerank, const float* exact, NeighbourVec& neighbours ) const
+{
+    neighbours.clear();
+    if ( m_nRows <= 0 || k <= 0 )
+        return;
+
+    const DistanceKernel& kernel = GetDistanceKernel();
+    const float* scales = m_Scales->data.fl;
+
+    std::vector<float> folded(m_nCols);
+    double queryNorm = 0.0;
+    float maxAbs = 0.0f;
+    for ( int col = 0; col < m_nCols; col++ )
+    {
+        float w = m_Weights.empty() ? 1.0f : m_Weights[col];
+        folded[col] = w * query[col] * scales[col];
+        queryNorm += (double)w * query[col] * query[col];
+        maxAbs = std::max(maxAbs, (float)fabs(folded[col]));
+    }
+
+    double queryScale = maxAbs > 0 ? 32767.0 / maxAbs : 0.0;
+    std::vector<short> q16(m_nCols + 1);
+    for ( int col = 0; col < m_nCols; col++ )
+        q16[col] = (short)cvRound(folded[col] * queryScale);
+
+    bool bRerank = exact && nRerank > 0;
+    int nKeep = std::min(m_nRows, bRerank ? std::max(k, nRerank) : k);
+
+    std::priority_queue<Neighbour> heap;
+    for ( int row = 0; row < m_nRows; row++ )
+    {
+        const signed char* code = (const signed char*)(m_Codes->data.ptr + row*m_Codes->step);
+        double dot = queryScale > 0 ? (double)kernel.DotS8S16(code, &q16[0], m_nCols) / queryScale : 0.0;
+        double d = queryNorm - 2.0*dot + m_Norms[row];
+
+        if ( (int)heap.size() < nKeep )
+        {
+            Neighbour n = { row, d };
+            heap.push(n);
+        }
+        else if ( d < heap.top().m_Distance )
+        {
+            Neighbour n = { row, d };
+            heap.pop();
+            heap.push(n);
+        }
+    }
+
+    neighbours.resize(heap.size());
+    for ( int i = (int)neighbours.size() - 1; i >= 0; i-- )
+    {
+        neighbours[i] = heap.top();
+        heap.pop();
+    }
+
+    if ( bRerank )
+    {
+        const float* weights = m_Weights.empty() ? NULL : &m_Weights[0];
+        for ( size_t i = 0; i < neighbours.size(); i++ )
+        {
+            const float* face = exact + (size_t)neighbours[i].m_Index*m_nCols;
+            neighbours[i].m_Distance = weights ? kernel.WeightedL2Sqr(query, face, weights, m_nCols)
+                                               : kernel.L2Sqr(query, face, m_nCols);
+        }
+        std::sort(neighbours.begin(), neighbours.end());
+    }
+
+    if ( (int)neighbours.size() > k )
+        neighbours.resize(k);
+}
+
+
+
+/*
+   Function:   Write
+   Purpose:    store the scales and codes in an open database
+*/
+void ScalarQuantizer::Write( CvFileStorage* storage, const char* prefix ) const
+{
+    if ( !m_Scales || !m_Codes )
+        return;
+
+    char var[256];
+    sprintf(var, "%s_Scales", prefix);
+    cvWrite( storage, var, m_Scales, cvAttrList(0,0) );
+    sprintf(var, "%s_Codes", prefix);
+    cvWrite( storage, var, m_Codes, cvAttrList(0,0) );
+}
+
+
+
+/*
+   Function:   Read
+   Purpose:    load scales and codes written by Write
+   Returns:    false if they are not in the database or were made for another gallery
+*/
+bool ScalarQuantizer::Read( CvFileStorage* storage, const char* prefix, int nRows, int nCols, const float* weights )
+{
+    char var[256];
+    sprintf(var, "%s_Scales", prefix);
+    CvMat* scales = (CvMat*)cvReadByName( storage, 0, var, 0 );
+    sprintf(var, "%s_Codes", prefix);
+    CvMat* codes = (CvMat*)cvReadByName( storage, 0, var, 0 );
+
+    return Attach(scales, codes, nRows, nCols, weights);
+}
+
+
+
+/*
+   Function:   Attach
+   Purpose:    take over scales and codes made by an earlier Train
+   Notes:      both headers are released by Clear whether or not they fit, their
+               data is only freed if they own it
+   Returns:    false if they were made for another gallery
+*/
+bool ScalarQuantizer::Attach( CvMat* scales, CvMat* codes, int nRows, int nCols, const float* weights )
+{
+    Clear();
+
+    m_Scales = scales;
+    m_Codes = codes;
+
+    if ( !m_Scales || !m_Codes ||
+         CV_MAT_TYPE(m_Scales->type) != CV_32FC1 || m_Scales->rows != 1 || m_Scales->cols != nCols ||
+         CV_MAT_TYPE(m_Codes->type) != CV_8SC1 || m_Codes->rows != nRows || m_Codes->cols != nCols )
+    {
+        Clear();
+        return false;
+    }
+
+    m_nRows = nRows;
+    m_nCols = nCols;
+    SetWeights(weights);
+    ComputeNorms();
+
+    return true;
+}
@@ -0,0 +1,63 @@
+#ifndef SCALARQUANTIZER_H
+#define SCALARQUANTIZER_H
+
+/*
+   ScalarQuantizer.h
+   Description:   int8 copy of a gallery matrix.  Each column has its own scale so
+                  the largest value in it maps to 127.  Searching reads a quarter of
+                  the bytes the float gallery needs, the best candidates are then
+                  re-ranked with the float rows
+   Author:        Chris Leighton
+
+*/
+
+#include <vector>
+#include <cv.h>
+#include <cxcore.h>
+
+#include "DistanceKernel.h"
+
+
+class ScalarQuantizer
+{
+public:
+    ScalarQuantizer();
+    ~ScalarQuantizer();
+
+    // work out the column scales and encode nRows x nCols data.  weights are the
+    // search weights (NULL for plain L2), the row norms are worked out with them
+    void Train( const float* data, int nRows, int nCols, const float* weights );
+
+    // k closest rows, closest first, distances are squared.  If exact is not NULL
+    // the nRerank best rows by the int8 distance are re-scored against it
+    void Search( const float* query, int k, int nRerank, const float* exact, NeighbourVec& neighbours ) const;
+
+    // scales and codes are stored in the database under names starting with prefix.
+    // Read returns false if there is nothing stored or it does not fit nRows x nCols
+    void Write( CvFileStorage* storage, const char* prefix ) const;
+    bool Read( CvFileStorage* storage, const char* prefix, int nRows, int nCols, const float* weights );
+
+    // for the binary database, which keeps the scales and codes in its own sections.
+    // Attach owns the two headers afterwards, false if they do not fit nRows x nCols
+    bool Attach( CvMat* scales, CvMat* codes, int nRows, int nCols, const float* weights );
+    const CvMat* GetScales() const { return m_Scales; }
+    const CvMat* GetCodes() const { return m_Codes; }
+
+    size_t GetCodeBytes() const { return m_Codes ? (size_t)m_nRows * m_nCols : 0; }
+
+private:
+    void Clear();
+    void SetWeights( const float* weights );
+    void ComputeNorms();
+
+    int                 m_nRows;
+    int                 m_nCols;
+
+    CvMat*              m_Scales;       // 1 x nCols CV_32FC1, code * scale is the value
+    CvMat*              m_Codes;        // nRows x nCols CV_8SC1
+    std::vector<float>  m_Weights;      // empty for plain L2
+    std::vector<float>  m_Norms;        // sum of w * (code*scale)^2 for each row
+};
+
+
+#endif
@@ -1,7 +1,14 @@
 #include "Training.h"
 #include "PreProcess.h"
+#include "FaceDetector.h"
+#include "FaceCache.h"
 #include <fstream>
 #include "HTMLHelper.h"
+#include <algorithm>
+
+
+// images decoded ahead of the ones being preprocessed in Trainer::LoadImages
+static const int LOAD_WINDOW = 64;
 
 
 /*
@@ -10,11 +17,15 @@
    Notes:      generates html results to show what happened
    Throws
 */
-void Train(const char* imagelist, const char* database, std::string& resultdir)
+void Train(const char* imagelist, const char* database, std::string& resultdir, SearchMode mode,
+           double energyFraction, int maxEigenVals)
 {
     try
     {
         Trainer trn(imagelist,database);
+        trn.SetSearchMode(mode);
+        trn.SetEnergyFraction(energyFraction);
+        trn.SetMaxEigenVals(maxEigenVals);
         trn.LoadImages();
         trn.CreateSubspace();
         trn.ProjectOntoSubSpace();
@@ -34,6 +45,44 @@ void Train(const char* imagelist, const char* database, std::string& resultdir)
 
 
 
+/*
+   Function:   BenchmarkLoadImages
+   Purpose:    show what sharing the Haar cascade and the load pipeline save when
+               loading training images
+   Notes:      LoadImages runs three times, first on one decode and one detect thread
+               with CascadeRegistry caching off so every FaceDetector parses the
+               cascade file, then with it on, then with the default threads.  Each run
+               has its own Trainer so nothing else is shared between them
+*/
+void BenchmarkLoadImages(const char* imagelist, std::ostream& out)
+{
+    for ( int run = 0; run < 3; run++ )
+    {
+        bool bCaching = run > 0;
+        CascadeRegistry::SetCaching(bCaching);
+        int nLoads = CascadeRegistry::GetnLoads();
+
+        double t = (double)cvGetTickCount();
+        int nImages = 0;
+        {
+            Trainer trn(imagelist, "");
+            if ( run < 2 )
+                trn.SetLoadThreads(1, 1);
+            nImages = trn.LoadImages();
+        }
+        double ms = ((double)cvGetTickCount() - t) / ((double)cvGetTickFrequency() * 1000.0);
+
+        const char* label = run == 0 ? "Cascade per face : " : (run == 1 ? "Shared cascade   : " : "All threads      : ");
+        out << label << ms << " ms for " << nImages << " images, "
+            << CascadeRegistry::GetnLoads() - nLoads << " cascade loads" << std::endl;
+    }
+
+    CascadeRegistry::SetCaching(true);
+}
+
+
+
+
 ////////////////////////////////////////////
 //           Trainer class                //
 ////////////////////////////////////////////
@@ -45,7 +94,8 @@ void Train(const char* imagelist, const char* database, std::string& resultdir)
    Notes:
    Throws
 */
-Trainer::Trainer(const char* imagelist, const char* database)
+Trainer::Trainer(const char* imagelist, const char* database) : m_EnergyFraction(1.0), m_MaxEigenVals(0),
+                                                                m_nDecodeThreads(1), m_nDetectThreads(0)
 {
     m_ImageFile = imagelist;
     m_DatabaseFile = database;
@@ -73,7 +123,16 @@ Trainer::~Trainer()
 /*
    Function:   LoadImages
    Purpose:    reads in m_ImageFile and loads the images
-   Notes:      LoadImages will pre-process the images
+   Notes:      LoadImages will pre-process the images.  A "#nodetect" first line
+               means every image is already cropped to the face so detection is
+               skipped.  The database keeps that for the whole gallery, so it is
+               rejected anywhere else in the file.  The list is read first, then the images go through in
+               windows of LOAD_WINDOW: while the decode threads load one window the
+               detect threads preprocess the one before it, and between windows the
+               finished faces are collected in file order.  Two windows of images are
+               held at most, and the faces come out in the same order as the file.
+               When FaceCache is open the decode threads look for each face there
+               first and the detect threads add the faces they make
    Throws      std::string if file can not be opened, or if image can not be found
    returns:    Number if images processed
 */
@@ -93,59 +152,233 @@ int Trainer::LoadImages()
     // buffer to read each line of file
     char buffer[512];
 
-    Database::NameVec& names = m_pDatabase->GetNames();
-    Database::ImageVec& imageVec = m_pDatabase->GetImageVec();
-    int nImages = 0;
+    std::vector<Image> entries;
+    bool bFirstLine = true;
     while ( in.getline(buffer,512) )
     {
-        try
+        std::string line(buffer);
+        if ( line.empty() )
+            break;
+
+        // "#nodetect" as the first line says the images are already cropped to the face
+        if ( line.substr(0, 9) == "#nodetect" )
         {
-            std::string line(buffer);
-            if ( line.empty() )
-                break;
+            if ( !bFirstLine )
+                throw std::string("Trainer::LoadImages - #nodetect must be the first line of the images file");
+
+            m_pDatabase->SetSkipDetection(true);
+            bFirstLine = false;
+            continue;
+        }
+        bFirstLine = false;
+
+        Image img(buffer);
 
-            Image img(buffer);
+        if ( img.m_ID == 0 )
+            throw std::string("Trainer::LoadImages - Training person ids should start with 1");
 
-            if ( img.m_ID == 0 )
-                throw std::string("Trainer::LoadImages - Training person ids should start with 1");
+        entries.push_back(img);
+    }
+    in.close();
 
-            names.push_back(img.m_PersonName);
+    bool bSkipDetection = m_pDatabase->GetSkipDetection();
 
-            // load image
-            IplImage* temp = NULL;
-            temp = cvLoadImage(img.m_ImageName.c_str(),CV_LOAD_IMAGE_GRAYSCALE);
+    Database::NameVec& names = m_pDatabase->GetNames();
+    Database::ImageVec& imageVec = m_pDatabase->GetImageVec();
 
-            if ( !temp )
+    int nEntries = (int)entries.size();
+    int nWindows = (nEntries + LOAD_WINDOW - 1) / LOAD_WINDOW;
+    int nDecode = GetNumWorkers(m_nDecodeThreads);
+    int nDetect = GetNumWorkers(m_nDetectThreads);
+
+    // decoded images for the window being loaded and the one being preprocessed
+    std::vector<IplImage*> decoded[2];
+    decoded[0].assign(LOAD_WINDOW, (IplImage*)NULL);
+    decoded[1].assign(LOAD_WINDOW, (IplImage*)NULL);
+    std::vector<std::string> errors(nEntries);
+    std::vector<FaceCache::Key> keys(nEntries, 0);
+    std::vector<char> cacheable(nEntries, 0);
+    bool bCache = FaceCache::IsOpen();
+    int nextDecode = 0;
+    int nextDetect = 0;
+    bool bFailed = false;
+    int nImages = 0;
+
+    #pragma omp parallel num_threads(nDecode + nDetect)
+    {
+        // with fewer threads than asked for every thread does both jobs
+        int nThreads = 1;
+        int thread = 0;
+#ifdef _OPENMP
+        nThreads = omp_get_num_threads();
+        thread = omp_get_thread_num();
+#endif
+        int nDecoders = std::min(nDecode, nThreads - 1);
+        bool bDecoder = nThreads == 1 || thread < nDecoders;
+        bool bDetector = nThreads == 1 || thread >= nDecoders;
+
+        for ( int step = 0; step <= nWindows && !bFailed; step++ )
+        {
+            if ( bDecoder && step < nWindows )
             {
-                std::string err;
-                err = "Trainer::LoadImages could not create image for ";
-                err += img.m_ImageName;
-                throw err;
+                int start = step * LOAD_WINDOW;
+                int count = std::min(LOAD_WINDOW, nEntries - start);
+                std::vector<IplImage*>& window = decoded[step % 2];
+
+                for ( ;; )
+                {
+                    int i;
+                    #pragma omp critical(LoadImages)
+                    i = nextDecode++;
+                    if ( i >= count )
+                        break;
+
+                    const std::string& name = entries[start + i].m_ImageName;
+
+                    // nothing may be thrown out of the parallel region, the error is
+                    // kept for the slot and the master reports it in file order
+                    try
+                    {
+                        // a face already in the cache skips the detect threads, one that is
+                        // not is decoded from the bytes read for its key
+                        if ( bCache )
+                        {
+                            PreProcessOptions options = GetPreProcessOptions();
+                            options.m_bSkipDetection = options.m_bSkipDetection || bSkipDetection;
+                            FaceCache::Key key;
+                            std::vector<uchar> bytes;
+                            if ( FaceCache::MakeKey(name.c_str(), options, key, bytes) )
+                            {
+                                keys[start + i] = key;
+                                cacheable[start + i] = 1;
+                                entries[start + i].m_Image = FaceCache::Find(key);
+                                if ( entries[start + i].m_Image )
+                                    continue;
+
+                                window[i] = FaceCache::Decode(bytes);
+                            }
+                        }
+
+                        if ( !cacheable[start + i] )
+                            window[i] = cvLoadImage(name.c_str(), CV_LOAD_IMAGE_GRAYSCALE);
+                        if ( !window[i] )
+                        {
+                            std::string err;
+                            err = "Trainer::LoadImages could not create image for ";
+                            err += name;
+                            errors[start + i] = err;
+                        }
+                    }
+                    catch ( std::string err )
+                    {
+                        errors[start + i] = err;
+                    }
+                    catch ( cv::Exception& e )
+                    {
+                        errors[start + i] = std::string("Trainer::LoadImages could not decode ") + name + " - " + e.what();
+                    }
+                    catch ( ... )
+                    {
+                        errors[start + i] = "Trainer::LoadImages could not decode " + name;
+                    }
+                }
             }
 
-            IplImage* newtemp = NULL;
+            if ( bDetector && step > 0 )
+            {
+                int start = (step - 1) * LOAD_WINDOW;
+                int count = std::min(LOAD_WINDOW, nEntries - start);
+                std::vector<IplImage*>& window = decoded[(step - 1) % 2];
+
+                for ( ;; )
+                {
+                    int i;
+                    #pragma omp critical(LoadImages)
+                    i = nextDetect++;
+                    if ( i >= count )
+                        break;
+                    if ( !window[i] )
+                        continue;
+
+                    try
+                    {
+                        PreProcessOptions options = GetPreProcessOptions();
+                        options.m_bSkipDetection = options.m_bSkipDetection || bSkipDetection;
+                        PreProcess(window[i], &entries[start + i].m_Image, options);
+                        if ( cacheable[start + i] )
+                            FaceCache::Insert(keys[start + i], entries[start + i].m_Image);
+                    }
+                    catch ( std::string err )
+                    {
+                        errors[start + i] = err;
+                    }
+                    catch ( ... )
+                    {
+                        errors[start + i] = "Trainer::LoadImages - unknown error";
+                    }
+
+                    cvReleaseImage(&window[i]);
+                }
+            }
 
-            PreProcess(temp, &newtemp);
+            #pragma omp barrier
 
-            //////////////////////////img.m_Image = newtemp;
-            img.m_Image = newtemp;
+            // collect the window that was just preprocessed, in file order
+            #pragma omp master
+            {
+                nextDecode = 0;
+                nextDetect = 0;
+
+                if ( step > 0 )
+                {
+                    int start = (step - 1) * LOAD_WINDOW;
+                    int count = std::min(LOAD_WINDOW, nEntries - start);
+                    for ( int i = start; i < start + count && !bFailed; i++ )
+                    {
+                        if ( !errors[i].empty() )
+                        {
+                            bFailed = true;
+                            break;
+                        }
+
+                        names.push_back(entries[i].m_PersonName);
+                        imageVec.push_back(entries[i]);
+                        entries[i].m_Image = NULL;
+
+                        // success
+                        nImages++;
+                    }
+                }
+            }
 
-            // save this information
-            imageVec.push_back(img);
+            #pragma omp barrier
+        }
+    }
 
-            ////////////////////////////cvReleaseImage(&temp);
+    // anything decoded or preprocessed after the first error is not kept
+    if ( bFailed )
+    {
+        std::string err;
+        for ( int i = 0; i < nEntries; i++ )
+        {
+            if ( err.empty() && !errors[i].empty() )
+                err = errors[i];
+            if ( entries[i].m_Image )
+                cvReleaseImage(&entries[i].m_Image);
         }
-        catch (...)
+        for ( int w = 0; w < 2; w++ )
         {
-            throw;
+            for ( int i = 0; i < LOAD_WINDOW; i++ )
+            {
+                if ( decoded[w][i] )
+                    cvReleaseImage(&decoded[w][i]);
+            }
         }
 
-        // success
-        nImages++;
+        throw err;
     }
 
     m_pDatabase->SetnImages(nImages);
-    in.close();
 
     // store images and person id's in array to pass to eigen functions
     imageArray = (IplImage**)cvAlloc(nImages*sizeof(IplImage*));
@@ -186,15 +419,9 @@ void Trainer::CreateSubspace()
     size.width = imageVec[0].m_Image->width;
     size.height = imageVec[0].m_Image->height;
 
-    // allocate space for the eigen vectors
-    eigenVectorArray = (IplImage**)cvAlloc(sizeof(IplImage*) * nEigenVals);
-    for ( int i = 0; i < nEigenVals; i++ )
-    {
-        eigenVectorArray[i] = cvCreateImage(size, IPL_DEPTH_32F, 1);   // floating point image
-
-        if ( !eigenVectorArray[i] )
-            throw std::string("Trainer::DoPCA could not allocate EigenVector");
-    }
+    // allocate space for the eigen vectors, eigenVectorArray images are views
+    // into the one basis buffer the database owns
+    m_pDatabase->AllocateEigenBasis(nEigenVals, size);
 
 
     averageImage = cvCreateImage(size, IPL_DEPTH_32F, 1 );
@@ -215,6 +442,58 @@ void Trainer::CreateSubspace()
     // now we have the averge image, eigenvectors of the covariance matrix, and eigen values
     cvNormalize(eigenValueMatrix, eigenValueMatrix, 1, 0, CV_L1, 0);
 
+    TruncateSubspace();
+}
+
+
+
+/*
+   Function:   TruncateSubspace
+   Purpose:    drop the eigen vectors we were asked not to keep
+   Notes:      the eigen values are sorted largest first and normalized to sum to 1,
+               so the running sum is the fraction of the variance kept.  Every
+               projection and distance after this is over the kept components only
+   Throws
+   returns:
+*/
+void Trainer::TruncateSubspace()
+{
+    int nEigenVals = m_pDatabase->GetnEigenVals();
+    int nKeep = nEigenVals;
+
+    if ( m_EnergyFraction > 0.0 && m_EnergyFraction < 1.0 )
+    {
+        double energy = 0.0;
+        for ( int i = 0; i < nEigenVals; i++ )
+        {
+            energy += eigenValueMatrix->data.fl[i];
+            if ( energy >= m_EnergyFraction )
+            {
+                nKeep = i + 1;
+                break;
+            }
+        }
+    }
+
+    if ( m_MaxEigenVals > 0 && nKeep > m_MaxEigenVals )
+        nKeep = m_MaxEigenVals;
+
+    if ( nKeep >= nEigenVals || nKeep < 1 )
+        return;
+
+    m_pDatabase->TruncateEigenBasis(nKeep);
+
+    CvMat* keptValues = cvCreateMat(1, nKeep, CV_32FC1);
+    if ( !keptValues )
+        throw std::string("Trainer::TruncateSubspace could not allocate eigen values");
+
+    for ( int i = 0; i < nKeep; i++ )
+        keptValues->data.fl[i] = eigenValueMatrix->data.fl[i];
+
+    cvReleaseMat(&eigenValueMatrix);
+    eigenValueMatrix = keptValues;
+
+    std::cout << "Keeping " << nKeep << " of " << nEigenVals << " eigen vectors" << std::endl;
 }
 
 
@@ -242,11 +521,13 @@ void Trainer::ProjectOntoSubSpace()
     // to avoid getting a bunch of NaN values, I normalize the Eigenvalues to be between 0 and 1
     cvNormalize(eigenValueMatrix, eigenValueMatrix, 1, 0, CV_L1, 0);
 
-    for ( int row = 0; row < nImages; row++ )
-    {
-        cvEigenDecomposite(imageArray[row], nEigenVals, eigenVectorArray, 0, 0, averageImage,
-                           projectedFaceMatrix->data.fl + (row*nEigenVals));
-    }
+    // every training face in one batched projection, the same as calling
+    // cvEigenDecomposite on each image
+    m_pDatabase->ProjectFaces(imageArray, nImages, projectedFaceMatrix->data.fl);
+
+    // the mean face of each person lets CentroidSearch skip most of the gallery
+    m_pDatabase->BuildCentroids();
+    m_pDatabase->BuildSearchData();
 
     // now the training projection is completed, Each row of m_ProjectedFaceMatrix represents
     // each image's values projected onto the new subspace.
@@ -259,7 +540,8 @@ void Trainer::ProjectOntoSubSpace()
 /*
    Function:   GenResults
    Purpose:    create images and html representation of results of training session
-   Notes:
+   Notes:      the eigen face images need eigenVectorArray, which is NULL when the
+               database was read from a binary file with a 16 bit basis
    Throws      std::string if it can't create directory
    returns:    void
 */
@@ -16,7 +16,12 @@
 #include "Database.h"
 #include "ImageStruct.h"
 
-void Train(const char* imagelist, const char* database, std::string& resultdir);
+void Train(const char* imagelist, const char* database, std::string& resultdir, SearchMode mode = ExactSearch,
+           double energyFraction = 1.0, int maxEigenVals = 0);
+
+// time Trainer::LoadImages with every detector loading the cascade file, with the
+// cascades shared through CascadeRegistry and with every thread loading images
+void BenchmarkLoadImages(const char* imagelist, std::ostream& out);
 
 class Trainer
 {
@@ -32,11 +37,34 @@ public:
     void CalculateThresholds();
     void MakeDatabase();
 
+    // the training images are already cropped to the face, same as "#nodetect" in the file
+    void SetSkipDetection( bool b ) { m_pDatabase->SetSkipDetection(b); }
+
+    // HNSWSearch builds the search graph when the database is written
+    void SetSearchMode( SearchMode mode ) { m_pDatabase->SetSearchMode(mode); }
+
+    // keep the fewest eigen vectors that cover fraction of the variance (1.0 keeps
+    // them all), and never more than maxEigenVals of them (0 for no cap)
+    void SetEnergyFraction( double fraction ) { m_EnergyFraction = fraction; }
+    void SetMaxEigenVals( int maxEigenVals ) { m_MaxEigenVals = maxEigenVals; }
+
+    // threads LoadImages uses to decode image files and to find and preprocess the
+    // faces in them, 0 for one per core
+    void SetLoadThreads( int nDecodeThreads, int nDetectThreads ) { m_nDecodeThreads = nDecodeThreads; m_nDetectThreads = nDetectThreads; }
+
 private:
     std::string             m_ImageFile;      // list of images of faces and thier names
     std::string             m_DatabaseFile;   // where to put the results
 
     Database*                m_pDatabase;
+
+    double                   m_EnergyFraction;
+    int                      m_MaxEigenVals;
+
+    int                      m_nDecodeThreads;
+    int                      m_nDetectThreads;
+
+    void TruncateSubspace();
 };
 
 
@@ -1,5 +1,14 @@
 #include "Utilities.h"
 #include <time.h>
+#include <math.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define UT_SSE2
+#include <emmintrin.h>
+#endif
 
 
 /*
@@ -56,6 +65,346 @@ void Resize(const IplImage* input, IplImage* output)
 }
 
 
+/*
+   Function:   GreyResizeEqualizeSeparate
+   Purpose:    grey scale, resize and equalize input into output one step at a time
+   Notes:      what GreyResizeEqualize does for images that are not 8 bit
+   Throws      std::string if the grey image cannot be created
+*/
+void GreyResizeEqualizeSeparate( const CvArr* input, IplImage* output )
+{
+    CvSize size = cvGetSize(input);
+    IplImage* grey = NULL;
+
+    if ( CV_MAT_CN(cvGetElemType(input)) != 1 )
+    {
+        grey = cvCreateImage(size, output->depth, 1);
+        if ( !grey )
+            throw std::string("GreyResizeEqualize could not create grey image");
+        cvCvtColor(input, grey, CV_BGR2GRAY);
+        input = grey;
+    }
+
+    // same interpolation as Resize
+    int flag = (output->width < size.width && output->height < size.height) ? CV_INTER_AREA : CV_INTER_LINEAR;
+    cvResize(input, output, flag);
+
+    if ( grey )
+        cvReleaseImage(&grey);
+
+    cvEqualizeHist(output, output);
+}
+
+
+
+// source pixels and weights that make up each output pixel along one axis
+struct ResizeTaps
+{
+    std::vector<int>    m_Start;    // taps for output i are m_Start[i] to m_Start[i+1]
+    std::vector<int>    m_Index;
+    std::vector<float>  m_Weight;
+
+    // the same taps with every output padded to m_nTaps, tap t of output i is at
+    // t*m_Stride + i so 4 outputs are filtered at once.  Padding has weight 0
+    int                 m_nTaps;
+    int                 m_Stride;
+    std::vector<int>    m_PaddedIndex;
+    std::vector<float>  m_PaddedWeight;
+};
+
+
+/*
+   Function:   MakeResizeTaps
+   Purpose:    fill taps for resizing srcLength pixels to dstLength
+   Notes:      area taps cover the part of the source each output pixel falls on,
+               linear taps are the two nearest pixel centres, as cvResize does
+*/
+static void MakeResizeTaps( int srcLength, int dstLength, bool bArea, ResizeTaps& taps )
+{
+    double scale = (double)srcLength / dstLength;
+
+    taps.m_Start.resize(dstLength + 1);
+    taps.m_Index.clear();
+    taps.m_Weight.clear();
+
+    for ( int i = 0; i < dstLength; i++ )
+    {
+        taps.m_Start[i] = (int)taps.m_Index.size();
+
+        if ( bArea )
+        {
+            double f1 = i*scale;
+            double f2 = f1 + scale;
+            int s1 = cvCeil(f1);
+            int s2 = std::min(cvFloor(f2), srcLength);
+
+            if ( s1 - f1 > 1e-3 )
+            {
+                taps.m_Index.push_back(s1 - 1);
+                taps.m_Weight.push_back((float)((s1 - f1) / scale));
+            }
+            for ( int s = s1; s < s2; s++ )
+            {
+                taps.m_Index.push_back(s);
+                taps.m_Weight.push_back((float)(1.0 / scale));
+            }
+            if ( f2 - s2 > 1e-3 && s2 < srcLength )
+            {
+                taps.m_Index.push_back(s2);
+                taps.m_Weight.push_back((float)(std::min(1.0, f2 - s2) / scale));
+            }
+        }
+        else
+        {
+            double f = (i + 0.5)*scale - 0.5;
+            int s = cvFloor(f);
+            float a = (float)(f - s);
+
+            if ( s < 0 )
+            {
+                s = 0;
+                a = 0.f;
+            }
+            if ( s >= srcLength - 1 )
+            {
+                s = srcLength - 1;
+                a = 0.f;
+            }
+
+            taps.m_Index.push_back(s);
+            taps.m_Weight.push_back(1.f - a);
+            if ( a > 0.f )
+            {
+                taps.m_Index.push_back(s + 1);
+                taps.m_Weight.push_back(a);
+            }
+        }
+    }
+
+    taps.m_Start[dstLength] = (int)taps.m_Index.size();
+
+    taps.m_nTaps = 0;
+    for ( int i = 0; i < dstLength; i++ )
+        taps.m_nTaps = std::max(taps.m_nTaps, taps.m_Start[i + 1] - taps.m_Start[i]);
+
+    taps.m_Stride = (dstLength + 3) & ~3;
+    taps.m_PaddedIndex.assign((size_t)taps.m_nTaps*taps.m_Stride, 0);
+    taps.m_PaddedWeight.assign((size_t)taps.m_nTaps*taps.m_Stride, 0.f);
+    for ( int i = 0; i < dstLength; i++ )
+    {
+        for ( int t = taps.m_Start[i]; t < taps.m_Start[i + 1]; t++ )
+        {
+            size_t at = (size_t)(t - taps.m_Start[i])*taps.m_Stride + i;
+            taps.m_PaddedIndex[at] = taps.m_Index[t];
+            taps.m_PaddedWeight[at] = taps.m_Weight[t];
+        }
+    }
+}
+
+
+/*
+   Function:   FilterRow
+   Purpose:    grey scale one source row and resize it across into out
+   Notes:      colour uses cvCvtColor's fixed point BGR weights.  With SSE2 four
+               pixels are made grey at once, a pixel's B and G and its R and the
+               rounding bit are each a pair for one madd.  The taps are filtered for
+               four outputs at once, only fetching the grey pixels is done one by
+               one.  grey must hold width floats and out m_Stride
+*/
+static void FilterRow( const uchar* src, int nChannels, int width, const ResizeTaps& taps,
+                       std::vector<float>& grey, float* out )
+{
+    float* g = &grey[0];
+    int x = 0;
+
+    if ( nChannels == 1 )
+    {
+#ifdef UT_SSE2
+        __m128i zero = _mm_setzero_si128();
+        for ( ; x + 8 <= width; x += 8 )
+        {
+            __m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src + x)), zero);
+            _mm_storeu_ps(g + x, _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)));
+            _mm_storeu_ps(g + x + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)));
+        }
+#endif
+        for ( ; x < width; x++ )
+            g[x] = src[x];
+    }
+    else
+    {
+#ifdef UT_SSE2
+        // each pixel is read as 4 bytes, so the last one is left to the scalar loop
+        __m128i lowByte = _mm_set1_epi32(0xff);
+        __m128i bgWeights = _mm_set1_epi32((9617 << 16) | 1868);
+        __m128i rWeights = _mm_set1_epi32(((1 << 13) << 16) | 4899);
+        __m128i one = _mm_set1_epi32(1 << 16);
+        for ( ; x + 5 <= width; x += 4 )
+        {
+            const uchar* p = src + x*3;
+            int bgr[4];
+            memcpy(bgr, p, 4);
+            memcpy(bgr + 1, p + 3, 4);
+            memcpy(bgr + 2, p + 6, 4);
+            memcpy(bgr + 3, p + 9, 4);
+            __m128i v = _mm_loadu_si128((const __m128i*)bgr);
+
+            // 16 bit lanes (B, G) and (R, 1) in each pixel
+            __m128i bg = _mm_or_si128(_mm_and_si128(v, lowByte), _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(v, 8), lowByte), 16));
+            __m128i r1 = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), lowByte), one);
+            __m128i sum = _mm_add_epi32(_mm_madd_epi16(bg, bgWeights), _mm_madd_epi16(r1, rWeights));
+            _mm_storeu_ps(g + x, _mm_cvtepi32_ps(_mm_srai_epi32(sum, 14)));
+        }
+#endif
+        for ( ; x < width; x++ )
+        {
+            const uchar* p = src + x*3;
+            g[x] = (float)((p[0]*1868 + p[1]*9617 + p[2]*4899 + (1 << 13)) >> 14);
+        }
+    }
+
+    const int* index = &taps.m_PaddedIndex[0];
+    const float* weight = &taps.m_PaddedWeight[0];
+    for ( int i = 0; i < taps.m_Stride; i += 4 )
+    {
+#ifdef UT_SSE2
+        __m128 sum = _mm_setzero_ps();
+        for ( int t = 0; t < taps.m_nTaps; t++ )
+        {
+            const int* at = index + (size_t)t*taps.m_Stride + i;
+            __m128 pixels = _mm_setr_ps(g[at[0]], g[at[1]], g[at[2]], g[at[3]]);
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(weight + (size_t)t*taps.m_Stride + i), pixels));
+        }
+        _mm_storeu_ps(out + i, sum);
+#else
+        for ( int j = i; j < i + 4; j++ )
+        {
+            float sum = 0.f;
+            for ( int t = 0; t < taps.m_nTaps; t++ )
+                sum += weight[(size_t)t*taps.m_Stride + j] * g[index[(size_t)t*taps.m_Stride + j]];
+            out[j] = sum;
+        }
+#endif
+    }
+}
+
+
+/*
+   Function:   GreyResizeEqualize
+   Purpose:    grey scale, resize and histogram equalize input into output in one pass
+   Notes:      input is an 8 bit grey or BGR image or a view of part of one, output
+               8 bit grey.  Each source row is read once: it is made grey and resized
+               across, then added into the output rows it covers.  Finished output
+               rows are rounded and counted into the histogram as they are written,
+               so only the small output is read again to equalize it.  Interpolation
+               is the same as Resize, area when shrinking and linear otherwise.
+               Other depths go through GreyResizeEqualizeSeparate
+   Throws      std::string if output is not 8 bit grey
+*/
+void GreyResizeEqualize( const CvArr* input, IplImage* output )
+{
+    if ( output->depth != IPL_DEPTH_8U || output->nChannels != 1 )
+        throw std::string("GreyResizeEqualize needs an 8 bit grey output image");
+
+    CvMat stub;
+    CvMat* src = cvGetMat(input, &stub);
+    int nChannels = CV_MAT_CN(src->type);
+
+    if ( CV_MAT_DEPTH(src->type) != CV_8U || (nChannels != 1 && nChannels != 3) )
+    {
+        GreyResizeEqualizeSeparate(input, output);
+        return;
+    }
+
+    int srcWidth = src->cols;
+    int srcHeight = src->rows;
+    int width = output->width;
+    int height = output->height;
+    bool bArea = width < srcWidth && height < srcHeight;
+
+    ResizeTaps across, down;
+    MakeResizeTaps(srcWidth, width, bArea, across);
+    MakeResizeTaps(srcHeight, height, bArea, down);
+
+    // resized rows are kept for the next output row, which may share a source row
+    int padded = across.m_Stride;
+    std::vector<float> grey(srcWidth);
+    std::vector<float> rows(2*padded, 0.f);
+    std::vector<float> sum(padded, 0.f);
+    int rowIndex[2] = { -1, -1 };
+    int hist[256] = { 0 };
+
+    for ( int y = 0; y < height; y++ )
+    {
+        float* acc = &sum[0];
+        std::fill(sum.begin(), sum.end(), 0.f);
+
+        for ( int t = down.m_Start[y]; t < down.m_Start[y + 1]; t++ )
+        {
+            int sy = down.m_Index[t];
+            int slot = rowIndex[0] == sy ? 0 : (rowIndex[1] == sy ? 1 : -1);
+            if ( slot < 0 )
+            {
+                slot = rowIndex[0] < rowIndex[1] ? 0 : 1;
+                FilterRow(src->data.ptr + sy*src->step, nChannels, srcWidth, across, grey, &rows[slot*padded]);
+                rowIndex[slot] = sy;
+            }
+
+            const float* row = &rows[slot*padded];
+            float w = down.m_Weight[t];
+            int x = 0;
+#ifdef UT_SSE2
+            __m128 vw = _mm_set1_ps(w);
+            for ( ; x < padded; x += 4 )
+                _mm_storeu_ps(acc + x, _mm_add_ps(_mm_loadu_ps(acc + x), _mm_mul_ps(vw, _mm_loadu_ps(row + x))));
+#endif
+            for ( ; x < width; x++ )
+                acc[x] += w*row[x];
+        }
+
+        uchar* out = (uchar*)(output->imageData + y*output->widthStep);
+        int x = 0;
+#ifdef UT_SSE2
+        for ( ; x + 8 <= width; x += 8 )
+        {
+            __m128i lo = _mm_cvtps_epi32(_mm_loadu_ps(acc + x));
+            __m128i hi = _mm_cvtps_epi32(_mm_loadu_ps(acc + x + 4));
+            __m128i packed = _mm_packs_epi32(lo, hi);
+            _mm_storel_epi64((__m128i*)(out + x), _mm_packus_epi16(packed, packed));
+        }
+#endif
+        for ( ; x < width; x++ )
+        {
+            int v = cvRound(acc[x]);
+            out[x] = (uchar)(v < 0 ? 0 : (v > 255 ? 255 : v));
+        }
+
+        for ( x = 0; x < width; x++ )
+            hist[out[x]]++;
+    }
+
+    // the same table cvEqualizeHist makes
+    uchar lut[256];
+    double scale = 255.0 / ((double)width*height);
+    int total = 0;
+    for ( int i = 0; i < 256; i++ )
+    {
+        total += hist[i];
+        int v = cvRound(total*scale);
+        lut[i] = (uchar)(v > 255 ? 255 : v);
+    }
+    lut[0] = 0;
+
+    for ( int y = 0; y < height; y++ )
+    {
+        uchar* out = (uchar*)(output->imageData + y*output->widthStep);
+        for ( int x = 0; x < width; x++ )
+            out[x] = lut[out[x]];
+    }
+}
+
+
+
 /*
    Function: ConvertFloatToGreyScale
    Purpose:  Given a float image, convert it to grey scale
@@ -110,3 +459,22 @@ std::string getDateTime()
     return ret;
 }
 
+
+
+
+/*
+   Function: GetNumWorkers
+   Purpose:  decide how many threads a parallel loop should use
+   Notes:    returns 1 when we are not built with OpenMP
+   Returns:  number of worker threads
+*/
+int GetNumWorkers( int requested )
+{
+#ifdef _OPENMP
+    if ( requested > 0 )
+        return requested;
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
@@ -18,6 +18,10 @@
 #include <cxcore.h>
 #include <highgui.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 
 typedef std::vector<CvRect*>        RectVec;
 typedef std::vector<IplImage*>      ImageVec;
@@ -38,10 +42,21 @@ void HistogramEqualization(const IplImage* input, IplImage* output);
 void Resize(const IplImage* input, IplImage* output);
 
 
+// grey scale, resize and equalize an 8 bit image or view into output in one pass
+void GreyResizeEqualize( const CvArr* input, IplImage* output );
+
+// the same done one step at a time with OpenCV
+void GreyResizeEqualizeSeparate( const CvArr* input, IplImage* output );
+
+
 // get string representing the date and time
 std::string getDateTime();
 
 
+// number of worker threads to use, 0 or less means one per core
+int GetNumWorkers( int requested = 0 );
+
+
 /*
 
 how to get the time is takes to do somthing in ms
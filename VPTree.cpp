@@ -0,0 +1,214 @@
+#include "VPTree.h"
+#include <float.h>
+#include <math.h>
+#include <algorithm>
+#include <queue>
+
+
+// rows per leaf, below this a scan is cheaper than another level of the tree
+static const int VPTREE_LEAF_SIZE = 8;
+
+
+// k best so far, furthest on top.  Distances are squared, tau is the
+// plain distance to the k-th best and is what the triangle inequality uses
+struct VPTree::SearchState
+{
+    int                             m_k;
+    std::priority_queue<Neighbour>  m_Heap;
+    double                          m_Tau;
+
+    SearchState( int k ) : m_k(k), m_Tau(DBL_MAX) {}
+
+    double Bound() const { return (int)m_Heap.size() < m_k ? DBL_MAX : m_Heap.top().m_Distance; }
+
+    void Add( int row, double distance )
+    {
+        if ( (int)m_Heap.size() < m_k )
+        {
+            Neighbour n = { row, distance };
+            m_Heap.push(n);
+        }
+        else if ( distance < m_Heap.top().m_Distance )
+        {
+            Neighbour n = { row, distance };
+            m_Heap.pop();
+            m_Heap.push(n);
+        }
+        else
+            return;
+
+        if ( (int)m_Heap.size() == m_k )
+            m_Tau = sqrt(m_Heap.top().m_Distance);
+    }
+};
+
+
+
+////////////////////////////////////////////
+//           VPTree class                 //
+////////////////////////////////////////////
+
+VPTree::VPTree() : m_pData(NULL), m_pWeights(NULL), m_nRows(0), m_nCols(0), m_Seed(12345)
+{
+}
+
+
+VPTree::~VPTree()
+{
+}
+
+
+
+/*
+   Function:   Build
+   Purpose:    build the tree over the rows of data
+   Notes:      each node picks a random vantage row and splits the rest of its rows
+               at the median distance from it, so the tree is balanced
+*/
+void VPTree::Build( const float* data, int nRows, int nCols, const float* weights )
+{
+    m_pData = data;
+    m_pWeights = weights;
+    m_nRows = nRows;
+    m_nCols = nCols;
+    m_Seed = 12345;
+
+    m_Nodes.clear();
+    m_Nodes.reserve(2 * (nRows / VPTREE_LEAF_SIZE + 1));
+
+    m_Order.resize(nRows);
+    for ( int i = 0; i < nRows; i++ )
+        m_Order[i] = i;
+
+    if ( nRows > 0 )
+        BuildNode(0, nRows);
+}
+
+
+
+/*
+   Function:   BuildNode
+   Purpose:    make the node for rows m_Order[begin, end)
+   Returns:    index of the node in m_Nodes
+*/
+int VPTree::BuildNode( int begin, int end )
+{
+    int node = (int)m_Nodes.size();
+    Node n;
+    n.m_Row = -1;
+    n.m_Threshold = 0.0;
+    n.m_Inside = -1;
+    n.m_Outside = -1;
+    n.m_Begin = begin;
+    n.m_End = end;
+    m_Nodes.push_back(n);
+
+    if ( end - begin <= VPTREE_LEAF_SIZE )
+        return node;
+
+    // random vantage point, moved to the front of the range
+    m_Seed = m_Seed * 1103515245u + 12345u;
+    int pick = begin + (int)((m_Seed >> 8) % (unsigned int)(end - begin));
+    std::swap(m_Order[begin], m_Order[pick]);
+    int vantage = m_Order[begin];
+
+    std::vector< std::pair<double, int> > distances;
+    distances.reserve(end - begin - 1);
+    for ( int i = begin + 1; i < end; i++ )
+        distances.push_back(std::make_pair(Distance(m_pData + (size_t)vantage*m_nCols, m_Order[i]), m_Order[i]));
+
+    size_t median = distances.size() / 2;
+    std::nth_element(distances.begin(), distances.begin() + median, distances.end());
+
+    for ( size_t i = 0; i < distances.size(); i++ )
+        m_Order[begin + 1 + i] = distances[i].second;
+
+    int mid = begin + 1 + (int)median;
+    double threshold = distances[median].first;
+
+    // m_Nodes can move while the children are built so set fields by index
+    int inside = BuildNode(begin + 1, mid);
+    int outside = BuildNode(mid, end);
+
+    m_Nodes[node].m_Row = vantage;
+    m_Nodes[node].m_Threshold = threshold;
+    m_Nodes[node].m_Inside = inside;
+    m_Nodes[node].m_Outside = outside;
+
+    return node;
+}
+
+
+
+/*
+   Function:   Search
+   Purpose:    find the k rows closest to query
+   Notes:      exact, a subtree is only skipped when the triangle inequality
+               says nothing in it can beat the k-th best so far
+*/
+void VPTree::Search( const float* query, int k, NeighbourVec& neighbours ) const
+{
+    neighbours.clear();
+    if ( m_Nodes.empty() || k <= 0 )
+        return;
+
+    SearchState state(k);
+    SearchNode(0, query, state);
+
+    neighbours.resize(state.m_Heap.size());
+    for ( int i = (int)neighbours.size() - 1; i >= 0; i-- )
+    {
+        neighbours[i] = state.m_Heap.top();
+        state.m_Heap.pop();
+    }
+}
+
+
+
+void VPTree::SearchNode( int node, const float* query, SearchState& state ) const
+{
+    const Node& n = m_Nodes[node];
+
+    if ( n.m_Row < 0 )
+    {
+        for ( int i = n.m_Begin; i < n.m_End; i++ )
+        {
+            int row = m_Order[i];
+            double bound = state.Bound();
+            double d = PartialL2Sqr(query, m_pData + (size_t)row*m_nCols, m_pWeights, m_nCols, bound);
+            if ( d < bound )
+                state.Add(row, d);
+        }
+        return;
+    }
+
+    double d = Distance(query, n.m_Row);
+    state.Add(n.m_Row, d*d);
+
+    // closer side first, it is the one most likely to tighten tau
+    if ( d < n.m_Threshold )
+    {
+        SearchNode(n.m_Inside, query, state);
+        if ( d + state.m_Tau >= n.m_Threshold )
+            SearchNode(n.m_Outside, query, state);
+    }
+    else
+    {
+        SearchNode(n.m_Outside, query, state);
+        if ( d - state.m_Tau <= n.m_Threshold )
+            SearchNode(n.m_Inside, query, state);
+    }
+}
+
+
+
+// plain (not squared) distance, the tree needs a metric for the triangle inequality
+double VPTree::Distance( const float* a, int row ) const
+{
+    const DistanceKernel& kernel = GetDistanceKernel();
+    const float* b = m_pData + (size_t)row*m_nCols;
+
+    double d = m_pWeights ? kernel.WeightedL2Sqr(a, b, m_pWeights, m_nCols)
+                          : kernel.L2Sqr(a, b, m_nCols);
+    return sqrt(d);
+}
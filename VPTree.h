@@ -0,0 +1,62 @@
+#ifndef VPTREE_H
+#define VPTREE_H
+
+/*
+   VPTree.h
+   Description:   vantage point tree over the rows of a gallery matrix.  Gives the
+                  same nearest neighbours as scanning every row but only visits part
+                  of the gallery, works best when the eigenspace has been cut down
+                  to a few dozen components
+   Author:        Chris Leighton
+
+*/
+
+#include <vector>
+
+#include "DistanceKernel.h"
+
+
+class VPTree
+{
+public:
+    VPTree();
+    ~VPTree();
+
+    // build the tree over nRows x nCols data, weights can be NULL for plain L2.
+    // The tree only stores row indexes, data must outlive it
+    void Build( const float* data, int nRows, int nCols, const float* weights );
+
+    // k closest rows, closest first, distances are squared like NearestRows
+    void Search( const float* query, int k, NeighbourVec& neighbours ) const;
+
+    int  GetnRows() const { return m_nRows; }
+
+private:
+    struct Node
+    {
+        int     m_Row;          // vantage point, -1 for a leaf
+        double  m_Threshold;    // median distance from the vantage point
+        int     m_Inside;       // child for rows closer than the threshold
+        int     m_Outside;      // child for the rest
+        int     m_Begin;        // leaf rows are m_Order[m_Begin, m_End)
+        int     m_End;
+    };
+
+    struct SearchState;
+
+    int    BuildNode( int begin, int end );
+    void   SearchNode( int node, const float* query, SearchState& state ) const;
+    double Distance( const float* a, int row ) const;
+
+    const float*        m_pData;
+    const float*        m_pWeights;
+    int                 m_nRows;
+    int                 m_nCols;
+
+    std::vector<Node>   m_Nodes;
+    std::vector<int>    m_Order;        // row indexes, rearranged as the tree is built
+    unsigned int        m_Seed;
+};
+
+
+#endif